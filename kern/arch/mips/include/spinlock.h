@@ -46,6 +46,12 @@ SPINLOCK_INLINE
 spinlock_data_t spinlock_data_get(volatile spinlock_data_t *sd);
 SPINLOCK_INLINE
 spinlock_data_t spinlock_data_testandset(volatile spinlock_data_t *sd);
+SPINLOCK_INLINE
+spinlock_data_t spinlock_data_fetchinc(volatile spinlock_data_t *sd);
+SPINLOCK_INLINE
+bool spinlock_data_compareandset(volatile spinlock_data_t *sd,
+				 spinlock_data_t oldval,
+				 spinlock_data_t newval);
 
 ////////////////////////////////////////////////////////////
 
@@ -96,5 +102,62 @@ spinlock_data_testandset(volatile spinlock_data_t *sd)
 	return x;
 }
 
+SPINLOCK_INLINE
+spinlock_data_t
+spinlock_data_fetchinc(volatile spinlock_data_t *sd)
+{
+	spinlock_data_t x;
+	spinlock_data_t y;
+
+	/*
+	 * Atomic increment using LL/SC, retrying until the SC goes
+	 * through. Returns the value from before the increment.
+	 */
+
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 instructions */
+		".set volatile;"	/* avoid unwanted optimization */
+		"1: ll %0, 0(%2);"	/*   x = *sd */
+		"addiu %1, %0, 1;"	/*   y = x + 1 */
+		"sc %1, 0(%2);"		/*   *sd = y; y = success? */
+		"beqz %1, 1b;"		/*   try again if it failed */
+		".set pop"		/* restore assembler mode */
+		: "=&r" (x), "=&r" (y) : "r" (sd) : "memory");
+	return x;
+}
+
+SPINLOCK_INLINE
+bool
+spinlock_data_compareandset(volatile spinlock_data_t *sd,
+			    spinlock_data_t oldval, spinlock_data_t newval)
+{
+	spinlock_data_t x;
+	spinlock_data_t y;
+
+	/*
+	 * Store NEWVAL if *SD still holds OLDVAL, using LL/SC. Y ends
+	 * up 1 if the store went through, and 0 if *SD didn't match
+	 * or the SC failed.
+	 */
+
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 instructions */
+		".set volatile;"	/* avoid unwanted optimization */
+		".set noreorder;"	/* we fill the delay slot */
+		"ll %0, 0(%2);"		/*   x = *sd */
+		"bne %0, %3, 1f;"	/*   give up if x != oldval */
+		" move %1, $0;"		/*   (delay slot) y = 0 */
+		"move %1, %4;"		/*   y = newval */
+		"sc %1, 0(%2);"		/*   *sd = y; y = success? */
+		"1:"
+		".set pop"		/* restore assembler mode */
+		: "=&r" (x), "=&r" (y)
+		: "r" (sd), "r" (oldval), "r" (newval)
+		: "memory");
+	return y != 0;
+}
+
 
 #endif /* _MIPS_SPINLOCK_H_ */
@@ -37,7 +37,7 @@
  *        into a "random" TLB slot chosen by the processor.
  *
  *        IMPORTANT NOTE: never write more than one TLB entry with the
- *        same virtual page field.
+ *        same virtual page and PID fields.
  *
  *   tlb_write: same as tlb_random, but you choose the slot.
  *
@@ -53,20 +53,27 @@
  *        is not set. To completely invalidate the TLB, load it with
  *        translations for addresses in one of the unmapped address
  *        ranges - these will never be matched.
+ *
+ *   tlb_setentryhi: load ENTRYHI into the entryhi register without
+ *        touching the TLB. The PID field of entryhi is the address
+ *        space ID that user accesses are translated with; note that
+ *        all the functions above also load entryhi, so it must be put
+ *        back after using them with a different PID.
  */
 
 void tlb_random(uint32_t entryhi, uint32_t entrylo);
 void tlb_write(uint32_t entryhi, uint32_t entrylo, uint32_t index);
 void tlb_read(uint32_t *entryhi, uint32_t *entrylo, uint32_t index);
 int tlb_probe(uint32_t entryhi, uint32_t entrylo);
+void tlb_setentryhi(uint32_t entryhi);
 
 /*
  * TLB entry fields.
  *
- * Note that the MIPS has support for a 6-bit address space ID. In the
- * interests of simplicity, we don't use it. The fields related to it
- * (TLBLO_GLOBAL and TLBHI_PID) can be left always zero, as can the
- * bits that aren't assigned a meaning.
+ * Note that the MIPS has support for a 6-bit address space ID, in
+ * TLBHI_PID. An entry only matches if its PID equals the one currently
+ * in entryhi, unless TLBLO_GLOBAL is set; we don't use TLBLO_GLOBAL.
+ * The bits that aren't assigned a meaning can be left always zero.
  *
  * The TLBLO_DIRTY bit is actually a write privilege bit - it is not
  * ever set by the processor. If you set it, writes are permitted. If
@@ -78,7 +85,9 @@ int tlb_probe(uint32_t entryhi, uint32_t entrylo);
 
 /* Fields in the high-order word */
 #define TLBHI_VPAGE   0xfffff000
-/*      TLBHI_PID     0x00000fc0 */
+#define TLBHI_PID     0x00000fc0
+#define TLBHI_PIDSHIFT 6
+#define NUM_TLBPID    64	/* number of distinct PIDs */
 
 /* Fields in the low-order word */
 #define TLBLO_PPAGE   0xfffff000
@@ -65,6 +65,7 @@
  * a valid address, and will make a *huge* mess if you scribble on it.
  */
 #define PADDR_TO_KVADDR(paddr) ((paddr)+MIPS_KSEG0)
+#define KVADDR_TO_PADDR(vaddr) ((vaddr)-MIPS_KSEG0)
 
 /*
  * The top of user space. (Actually, the address immediately above the
@@ -99,13 +100,13 @@
  * called exactly once when the VM system initializes to take over
  * management of physical memory.
  *
- * ram_stealmem can be used before ram_getsize is called to allocate
+ * ram_stealmem can be used before ram_getfirstfree is called to allocate
  * memory that cannot be freed later. This is intended for use early
  * in bootup before VM initialization is complete.
  */
 
 void ram_bootstrap(void);
-paddr_t ram_stealmem(unsigned long npages, uint8_t* map);
+paddr_t ram_stealmem(unsigned long npages);
 paddr_t ram_getsize(void);
 paddr_t ram_getfirstfree(void);
 
@@ -115,11 +116,11 @@ paddr_t ram_getfirstfree(void);
  * We'll take up to 16 invalidations before just flushing the whole TLB.
  */
 
+struct addrspace;
+
 struct tlbshootdown {
-	/*
-	 * Change this to what you need for your VM design.
-	 */
-	int ts_placeholder;
+	struct addrspace *ts_as;	/* address space... */
+	vaddr_t ts_vaddr;		/* ...and page to invalidate */
 };
 
 #define TLBSHOOTDOWN_MAX 16
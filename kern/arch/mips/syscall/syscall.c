@@ -38,8 +38,42 @@
 #include <copyinout.h>
 #include <syscall.h>
 #include <addrspace.h>
+#include <objcache.h>
 
 
+/* Where the trapframes handed to forked children come from. */
+static struct objcache *trapframe_cache;
+
+void
+syscall_bootstrap(void)
+{
+	trapframe_cache = objcache_create("trapframe",
+					  sizeof(struct trapframe), 0,
+					  NULL, NULL);
+	if (trapframe_cache == NULL) {
+		panic("syscall_bootstrap: Out of memory\n");
+	}
+}
+
+struct trapframe *
+trapframe_dup(const struct trapframe *tf)
+{
+	struct trapframe *newtf;
+
+	newtf = objcache_alloc(trapframe_cache);
+	if (newtf == NULL) {
+		return NULL;
+	}
+	memcpy(newtf, tf, sizeof(*newtf));
+	return newtf;
+}
+
+void
+trapframe_free(struct trapframe *tf)
+{
+	objcache_free(trapframe_cache, tf);
+}
+
 /*
  * System call dispatcher.
  *
@@ -221,6 +255,23 @@ syscall(struct trapframe *tf)
 			(const char*)tf->tf_a0,
 			(char**)tf->tf_a1);
 		break;
+
+	    case SYS_sbrk:
+		err = sys_sbrk((intptr_t)tf->tf_a0, &retval);
+		break;
+
+	    case SYS_futex_wait:
+		err = sys_futex_wait((userptr_t)tf->tf_a0, tf->tf_a1);
+		break;
+
+	    case SYS_futex_wake:
+		err = sys_futex_wake((userptr_t)tf->tf_a0, tf->tf_a1,
+				     &retval);
+		break;
+
+	    case SYS_setaffinity:
+		err = sys_setaffinity(tf->tf_a0);
+		break;
 		
 
 
@@ -279,7 +330,7 @@ enter_forked_process(struct trapframe *tf)
 	newtf.tf_a3 = 0;
 	newtf.tf_v0 = 0;
 	newtf.tf_epc += 4;
-	kfree(tf);
+	trapframe_free(tf);
 	as_activate();
 	mips_usermode(&newtf);
 }
@@ -32,74 +32,67 @@
 #include <lib.h>
 #include <spl.h>
 #include <spinlock.h>
+#include <cpu.h>
 #include <proc.h>
 #include <current.h>
 #include <mips/tlb.h>
+#include <uio.h>
+#include <vnode.h>
 #include <addrspace.h>
 #include <vm.h>
 #include <mainbus.h>
+#include <coremap.h>
+#include <pagetable.h>
+#include <swap.h>
+#include <platform/maxcpus.h>
 
 /*
- * Dumb MIPS-only "VM system" that is intended to only be just barely
- * enough to struggle off the ground. You should replace all of this
- * code while doing the VM assignment. In fact, starting in that
- * assignment, this file is not included in your kernel!
+ * MIPS VM system with demand paging.
  *
- * NOTE: it's been found over the years that students often begin on
- * the VM assignment by copying dumbvm.c and trying to improve it.
- * This is not recommended. dumbvm is (more or less intentionally) not
- * a good design reference. The first recommendation would be: do not
- * look at dumbvm at all. The second recommendation would be: if you
- * do, be sure to review it from the perspective of comparing it to
- * what a VM system is supposed to do, and understanding what corners
- * it's cutting (there are many) and why, and more importantly, how.
- */
-
-/* under dumbvm, always have 72k of user stack */
-/* (this must be > 64K so argument blocks of size ARG_MAX will fit) */
-#define DUMBVM_STACKPAGES    18
-#define PAGE_NUM 128
-/*
- * Wrap ram_stealmem in a spinlock.
- */
-static struct spinlock stealmem_lock = SPINLOCK_INITIALIZER;
-/*
- * map keeps track of the state of the page (free or occupied), similar to a bitmap
- */
-static uint8_t map[PAGE_NUM];
-/*
- * start indicates whether it is the first time to initialize map, if start == 0, initialize map, if not, do nothing
+ * Each address space has a two-level page table (see pagetable.h)
+ * and a small list of regions set up from the executable, plus a
+ * stack region below USERSTACK. Nothing is allocated when a region is
+ * defined; vm_fault allocates and zero-fills a frame the first time a
+ * page inside a region is touched. Large sparse programs therefore
+ * only pay for the pages they use, and no physically contiguous runs
+ * are needed for user memory.
+ *
+ * as_copy shares frames between parent and child instead of copying
+ * them. A shared frame has a coremap reference count above one and is
+ * only ever entered into the TLB read-only; the first write to it
+ * takes a fault and vm_cowbreak gives the writer its own copy.
+ *
+ * When memory runs out the coremap evicts user pages to swap (see
+ * coremap.c and swap.c) and turns their PTEs into swap references;
+ * vm_fault reads them back in. Pages are entered into the TLB
+ * read-only until they are first written, so the coremap knows which
+ * pages are dirty and only those are written back.
+ *
+ * TLB entries are tagged with address space IDs, so switching between
+ * processes doesn't flush the TLB; see the ASID allocator below.
  */
-static uint8_t start = 0;
 
 void
 vm_bootstrap(void)
 {
-	/*Do nothing*/
+	/* The coremap was set up by coremap_bootstrap(). */
+	swap_bootstrap();
+	coremap_enablepaging();
 }
 
 static
 paddr_t
 getppages(unsigned long npages)
 {
-	paddr_t addr;
-	spinlock_acquire(&stealmem_lock);
-	addr = ram_stealmem(npages, map);
-	spinlock_release(&stealmem_lock);
-	return addr;
+	return coremap_alloc(npages);
 }
 
 /* Allocate/free some kernel-space virtual pages */
 vaddr_t
 alloc_kpages(unsigned npages)
 {
-	if (start == 0) { //start == 0 so initialize the map
-		for (int i = 0; i < PAGE_NUM; i++) {
-			map[i] = (uint8_t)0;
-		}
-		start++;
-	}
 	paddr_t pa;
+
 	pa = getppages(npages);
 	if (pa==0) {
 		return 0;
@@ -110,45 +103,460 @@ alloc_kpages(unsigned npages)
 void
 free_kpages(vaddr_t addr)
 {
-	paddr_t paddr = addr - MIPS_KSEG0;
-	uint8_t npages = paddr / PAGE_SIZE;
+	KASSERT(addr >= MIPS_KSEG0 && addr < MIPS_KSEG1);
+	coremap_free(addr - MIPS_KSEG0);
+}
+
+/*
+ * Address space IDs.
+ *
+ * Each CPU hands out the hardware's ASIDs 1..NUM_TLBPID-1 in order.
+ * When it runs out it flushes its TLB and starts a new generation, in
+ * which every ASID is free again. An address space keeps, for each
+ * CPU, the ASID it was given there tagged with the generation (which
+ * counts in steps of NUM_TLBPID, so the two can be or'd together). An
+ * ASID from an old generation is stale and is replaced on the next
+ * activation. ASID 0 is never handed out, so a zeroed as_asid entry is
+ * always stale.
+ *
+ * Only the CPU itself touches its asidstate, with interrupts off.
+ */
+#define ASID_MASK	(NUM_TLBPID - 1)
+#define ASID_TLBHI(a)	(((a) & ASID_MASK) << TLBHI_PIDSHIFT)
+
+static struct {
+	uint32_t as_gen;	/* current generation */
+	uint32_t as_next;	/* next ASID to hand out */
+	uint32_t as_cur;	/* ASID in entryhi (0 if none) */
+} asidstate[MAXCPUS];
+
+/*
+ * Invalidate every entry in this CPU's TLB.
+ */
+static
+void
+tlb_flush(void)
+{
+	int i, spl;
+
+	/* Disable interrupts on this CPU while frobbing the TLB. */
+	spl = splhigh();
+
+	for (i=0; i<NUM_TLB; i++) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+	tlb_setentryhi(ASID_TLBHI(asidstate[curcpu->c_number].as_cur));
+
+	splx(spl);
+}
+
+/*
+ * Make AS's ASID on this CPU current, allocating a new one if it has
+ * none in the current generation. Returns the ASID. Call with
+ * interrupts off.
+ */
+static
+uint32_t
+asid_activate(struct addrspace *as)
+{
+	unsigned cpunum = curcpu->c_number;
+	uint32_t asid;
+
+	KASSERT(cpunum < MAXCPUS);
+
+	asid = as->as_asid[cpunum];
+	if ((asid & ASID_MASK) == 0 ||
+	    (asid & ~(uint32_t)ASID_MASK) != asidstate[cpunum].as_gen) {
+		if (asidstate[cpunum].as_next == 0 ||
+		    asidstate[cpunum].as_next == NUM_TLBPID) {
+			/* Out of ASIDs; entries for old ones must go. */
+			asidstate[cpunum].as_gen += NUM_TLBPID;
+			asidstate[cpunum].as_next = 1;
+			asidstate[cpunum].as_cur = 0;
+			tlb_flush();
+		}
+		asid = asidstate[cpunum].as_gen | asidstate[cpunum].as_next++;
+		as->as_asid[cpunum] = asid;
+	}
+
+	asid &= ASID_MASK;
+	if (asidstate[cpunum].as_cur != asid) {
+		asidstate[cpunum].as_cur = asid;
+		tlb_setentryhi(ASID_TLBHI(asid));
+	}
+	return asid;
+}
+
+/*
+ * Forget AS's ASIDs on other CPUs, or on all CPUs if ALL is set.
+ *
+ * This is how the running process invalidates its own mappings
+ * cheaply: it can't be running anywhere else, so rather than shooting
+ * down its entries on other CPUs we make sure it gets a fresh ASID
+ * (and thus no entries) if it runs there again. Must be called by the
+ * thread that owns AS; with ALL, a fresh ASID is loaded here too.
+ */
+static
+void
+asid_retire(struct addrspace *as, bool all)
+{
+	unsigned i;
+	int spl;
+
+	KASSERT(as == proc_getas());
+
+	spl = splhigh();
+	for (i=0; i<MAXCPUS; i++) {
+		if (all || i != curcpu->c_number) {
+			as->as_asid[i] = 0;
+		}
+	}
+	if (all) {
+		asid_activate(as);
+	}
+	splx(spl);
+}
+
+/*
+ * Load a translation into this CPU's TLB. An existing entry for the
+ * same page is replaced (after a write to a page mapped read-only the
+ * old entry is still there, and duplicates are not allowed); otherwise
+ * a free slot is used if there is one, and if not the hardware's
+ * random register picks a victim. Call with interrupts off.
+ */
+static
+void
+tlb_refill(uint32_t ehi, uint32_t elo)
+{
+	uint32_t oehi, oelo;
+	int i;
+
+	curcpu->c_tlbrefills++;
+
+	i = tlb_probe(ehi, 0);
+	if (i >= 0) {
+		tlb_write(ehi, elo, i);
+		return;
+	}
+
+	for (i=0; i<NUM_TLB; i++) {
+		tlb_read(&oehi, &oelo, i);
+		if ((oelo & TLBLO_VALID) == 0) {
+			tlb_write(ehi, elo, i);
+			return;
+		}
+	}
+
+	curcpu->c_tlbevictions++;
+	tlb_random(ehi, elo);
+}
+
+/*
+ * Check whether AS has a live ASID on CPU CPUNUM. If not, that CPU
+ * cannot have any TLB entries for it. This peeks at another CPU's
+ * asidstate without locking; a stale answer is harmless because the
+ * caller has already pinned the pages, so no new entries for them can
+ * be loaded while the shootdown is in progress.
+ */
+static
+bool
+asid_live(struct addrspace *as, unsigned cpunum)
+{
+	uint32_t asid = as->as_asid[cpunum];
 
-	spinlock_acquire(&stealmem_lock);
-	map[npages] = 0;
-	spinlock_release(&stealmem_lock);
+	return (asid & ASID_MASK) != 0 &&
+		(asid & ~(uint32_t)ASID_MASK) == asidstate[cpunum].as_gen;
 }
 
 void
 vm_tlbshootdown_all(void)
 {
-	panic("dumbvm tried to do tlb shootdown?!\n");
+	tlb_flush();
 }
 
 void
 vm_tlbshootdown(const struct tlbshootdown *ts)
 {
-	(void)ts;
-	panic("dumbvm tried to do tlb shootdown?!\n");
+	unsigned cpunum = curcpu->c_number;
+	uint32_t asid;
+	int i, spl;
+
+	spl = splhigh();
+
+	/* If the address space has no live ASID here, it has no entries. */
+	if (asid_live(ts->ts_as, cpunum)) {
+		asid = ts->ts_as->as_asid[cpunum];
+		i = tlb_probe(ts->ts_vaddr | ASID_TLBHI(asid), 0);
+		if (i >= 0) {
+			tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+		}
+		tlb_setentryhi(ASID_TLBHI(asidstate[cpunum].as_cur));
+	}
+
+	splx(spl);
+}
+
+void
+vm_printstats(void)
+{
+	struct cpu *c;
+	unsigned i;
+
+	for (i=0; i<cpu_numcpus(); i++) {
+		c = cpu_getcpu(i);
+		kprintf("cpu%u: %u TLB refills, %u replaced a valid entry\n",
+			c->c_number, c->c_tlbrefills, c->c_tlbevictions);
+	}
+}
+
+void
+vm_unmap(const struct tlbshootdown *ts, unsigned n)
+{
+	struct tlbshootdown batch[TLBSHOOTDOWN_MAX];
+	unsigned tickets[MAXCPUS];
+	bool sent[MAXCPUS];
+	struct cpu *c;
+	unsigned i, j, k, ncpus, self;
+
+	KASSERT(n <= TLBSHOOTDOWN_MAX);
+
+	for (i=0; i<n; i++) {
+		vm_tlbshootdown(&ts[i]);
+	}
+
+	/*
+	 * Send each other CPU one IPI carrying only the mappings whose
+	 * address space it has a live ASID for; skip it if that's none.
+	 */
+	ncpus = cpu_numcpus();
+	self = curcpu->c_number;
+	for (j=0; j<ncpus; j++) {
+		sent[j] = false;
+		if (j == self) {
+			continue;
+		}
+		k = 0;
+		for (i=0; i<n; i++) {
+			if (asid_live(ts[i].ts_as, j)) {
+				batch[k++] = ts[i];
+			}
+		}
+		if (k > 0) {
+			c = cpu_getcpu(j);
+			ipi_tlbshootdown_batch(c, batch, k, &tickets[j]);
+			sent[j] = true;
+		}
+	}
+
+	for (j=0; j<ncpus; j++) {
+		if (sent[j]) {
+			ipi_tlbshootdown_wait(cpu_getcpu(j), tickets[j]);
+		}
+	}
+}
+
+static
+void
+as_zero_region(paddr_t paddr, unsigned npages)
+{
+	bzero((void *)PADDR_TO_KVADDR(paddr), npages * PAGE_SIZE);
+}
+
+/*
+ * Find the region defined by the executable that VADDR is in, if any.
+ */
+static
+struct region *
+as_getregion(struct addrspace *as, vaddr_t vaddr)
+{
+	struct region *rg;
+	unsigned i;
+
+	for (i=0; i<as->as_nregions; i++) {
+		rg = &as->as_regions[i];
+		if (vaddr >= rg->rg_vbase &&
+		    vaddr < rg->rg_vbase + rg->rg_npages * PAGE_SIZE) {
+			return rg;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Check whether VADDR is inside one of the address space's regions
+ * (or the stack or heap). Returns true if so, and sets *WRITEABLE.
+ */
+static
+bool
+as_findregion(struct addrspace *as, vaddr_t vaddr, bool *writeable)
+{
+	struct region *rg;
+
+	if (vaddr >= as->as_stackbase && vaddr < USERSTACK) {
+		*writeable = true;
+		return true;
+	}
+
+	if (vaddr >= as->as_heapbase &&
+	    vaddr < ROUNDUP(as->as_heaptop, PAGE_SIZE)) {
+		*writeable = true;
+		return true;
+	}
+
+	rg = as_getregion(as, vaddr);
+	if (rg != NULL) {
+		*writeable = rg->rg_writeable || as->as_loading;
+		return true;
+	}
+
+	return false;
+}
+
+/*
+ * Fill in the fresh frame PADDR for the page at VADDR in AS: the part
+ * backed by the executable is read from it and the rest is zeroed.
+ */
+static
+int
+as_fillpage(struct addrspace *as, vaddr_t vaddr, paddr_t paddr)
+{
+	struct region *rg;
+	struct iovec iov;
+	struct uio ku;
+	vaddr_t start, end;
+	int result;
+
+	as_zero_region(paddr, 1);
+
+	rg = as_getregion(as, vaddr);
+	if (rg == NULL || rg->rg_filesize == 0) {
+		return 0;
+	}
+
+	/* The part of this page that overlaps the file contents. */
+	start = vaddr > rg->rg_filevaddr ? vaddr : rg->rg_filevaddr;
+	end = rg->rg_filevaddr + rg->rg_filesize;
+	if (end > vaddr + PAGE_SIZE) {
+		end = vaddr + PAGE_SIZE;
+	}
+	if (start >= end) {
+		return 0;
+	}
+
+	uio_kinit(&iov, &ku, (void *)PADDR_TO_KVADDR(paddr + (start - vaddr)),
+		  end - start, rg->rg_fileoff + (start - rg->rg_filevaddr),
+		  UIO_READ);
+	result = VOP_READ(as->as_vnode, &ku);
+	if (result) {
+		return result;
+	}
+	if (ku.uio_resid != 0) {
+		kprintf("averagevm: short read on executable at 0x%x\n",
+			vaddr);
+		return EFAULT;
+	}
+	return 0;
+}
+
+/*
+ * Make the page at VADDR in AS (whose PTE is PTE) resident, reading
+ * it from swap or the executable or zero-filling it as needed, and pin
+ * it. Returns the frame in *RET.
+ */
+static
+int
+vm_getpage(struct addrspace *as, vaddr_t vaddr, uint32_t *pte, paddr_t *ret)
+{
+	paddr_t paddr;
+	unsigned slot;
+	int result;
+
+	if (coremap_pin(pte)) {
+		*ret = *pte & PTE_FRAME;
+		return 0;
+	}
+
+	/*
+	 * Not resident. Nobody else changes a PTE that has no frame
+	 * behind it, so it stays as it is while we sleep.
+	 */
+	paddr = coremap_alloc_user(as, vaddr, pte);
+	if (paddr == 0) {
+		return ENOMEM;
+	}
+
+	if (*pte & PTE_SWAPPED) {
+		slot = PTE_SWAPSLOT(*pte);
+		result = swap_pagein(paddr, slot);
+		if (result) {
+			coremap_free(paddr);
+			return result;
+		}
+		coremap_setswapslot(paddr, slot);
+	}
+	else {
+		result = as_fillpage(as, vaddr, paddr);
+		if (result) {
+			coremap_free(paddr);
+			return result;
+		}
+	}
+	*pte = paddr | PTE_VALID;
+
+	*ret = paddr;
+	return 0;
+}
+
+/*
+ * Give the address space a private copy of the pinned frame *PADDR
+ * that PTE refers to, if the frame is shared. The shared frame loses
+ * one reference and its pin; the copy is returned pinned in *PADDR.
+ */
+static
+int
+vm_cowbreak(struct addrspace *as, vaddr_t vaddr, uint32_t *pte,
+	    paddr_t *paddr)
+{
+	paddr_t oldpa, newpa;
+
+	oldpa = *paddr;
+	if (coremap_refcount(oldpa) == 1) {
+		/* Everyone else already made their copy. */
+		return 0;
+	}
+
+	newpa = coremap_alloc_user(as, vaddr, pte);
+	if (newpa == 0) {
+		return ENOMEM;
+	}
+	memmove((void *)PADDR_TO_KVADDR(newpa),
+		(const void *)PADDR_TO_KVADDR(oldpa), PAGE_SIZE);
+	*pte = newpa | PTE_VALID;
+	coremap_free(oldpa);
+
+	/* Other CPUs may still map the old frame for us. */
+	asid_retire(as, false);
+
+	*paddr = newpa;
+	return 0;
 }
 
 int
 vm_fault(int faulttype, vaddr_t faultaddress)
 {
-	vaddr_t vbase1, vtop1, vbase2, vtop2, stackbase, stacktop;
+	struct addrspace *as;
+	uint32_t *pte;
 	paddr_t paddr;
-	int i;
+	bool writeable;
 	uint32_t ehi, elo;
-	struct addrspace *as;
-	int spl;
+	int spl, result;
 
 	faultaddress &= PAGE_FRAME;
 
-	DEBUG(DB_VM, "dumbvm: fault: 0x%x\n", faultaddress);
+	DEBUG(DB_VM, "averagevm: fault: 0x%x\n", faultaddress);
 
 	switch (faulttype) {
 	    case VM_FAULT_READONLY:
-		/* We always create pages read-write, so we can't get this */
-		panic("dumbvm: got VM_FAULT_READONLY\n");
 	    case VM_FAULT_READ:
 	    case VM_FAULT_WRITE:
 		break;
@@ -174,107 +582,226 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 		return EFAULT;
 	}
 
-	/* Assert that the address space has been set up properly. */
-	KASSERT(as->as_vbase1 != 0);
-	KASSERT(as->as_pbase1 != 0);
-	KASSERT(as->as_npages1 != 0);
-	KASSERT(as->as_vbase2 != 0);
-	KASSERT(as->as_pbase2 != 0);
-	KASSERT(as->as_npages2 != 0);
-	KASSERT(as->as_stackpbase != 0);
-	KASSERT((as->as_vbase1 & PAGE_FRAME) == as->as_vbase1);
-	KASSERT((as->as_pbase1 & PAGE_FRAME) == as->as_pbase1);
-	KASSERT((as->as_vbase2 & PAGE_FRAME) == as->as_vbase2);
-	KASSERT((as->as_pbase2 & PAGE_FRAME) == as->as_pbase2);
-	KASSERT((as->as_stackpbase & PAGE_FRAME) == as->as_stackpbase);
-
-	vbase1 = as->as_vbase1;
-	vtop1 = vbase1 + as->as_npages1 * PAGE_SIZE;
-	vbase2 = as->as_vbase2;
-	vtop2 = vbase2 + as->as_npages2 * PAGE_SIZE;
-	stackbase = USERSTACK - DUMBVM_STACKPAGES * PAGE_SIZE;
-	stacktop = USERSTACK;
-
-	if (faultaddress >= vbase1 && faultaddress < vtop1) {
-		paddr = (faultaddress - vbase1) + as->as_pbase1;
-	}
-	else if (faultaddress >= vbase2 && faultaddress < vtop2) {
-		paddr = (faultaddress - vbase2) + as->as_pbase2;
-	}
-	else if (faultaddress >= stackbase && faultaddress < stacktop) {
-		paddr = (faultaddress - stackbase) + as->as_stackpbase;
+	KASSERT(as->as_pt != NULL);
+
+	if (!as_findregion(as, faultaddress, &writeable)) {
+		return EFAULT;
 	}
-	else {
+	if (faulttype != VM_FAULT_READ && !writeable) {
 		return EFAULT;
 	}
 
+	pte = pt_lookup(as->as_pt, faultaddress, true);
+	if (pte == NULL) {
+		return ENOMEM;
+	}
+
+	result = vm_getpage(as, faultaddress, pte, &paddr);
+	if (result) {
+		return result;
+	}
+
+	if (faulttype != VM_FAULT_READ) {
+		/* Write to a page that may be copy-on-write. */
+		result = vm_cowbreak(as, faultaddress, pte, &paddr);
+		if (result) {
+			coremap_unpin(paddr);
+			return result;
+		}
+	}
+
+	/*
+	 * Only map the page writeable once it has been written (which
+	 * is how dirty pages are found) and only if it isn't shared.
+	 */
+	if (!coremap_map(paddr, as, faultaddress, pte,
+			 faulttype != VM_FAULT_READ)) {
+		writeable = false;
+	}
+
 	/* make sure it's page-aligned */
 	KASSERT((paddr & PAGE_FRAME) == paddr);
 
+	elo = paddr | TLBLO_VALID;
+	if (writeable) {
+		elo |= TLBLO_DIRTY;
+	}
+	DEBUG(DB_VM, "averagevm: 0x%x -> 0x%x\n", faultaddress, paddr);
+
 	/* Disable interrupts on this CPU while frobbing the TLB. */
 	spl = splhigh();
+	ehi = faultaddress | ASID_TLBHI(asid_activate(as));
+	tlb_refill(ehi, elo);
+	splx(spl);
 
-	for (i=0; i<NUM_TLB; i++) {
-		tlb_read(&ehi, &elo, i);
-		if (elo & TLBLO_VALID) {
-			continue;
+	coremap_unpin(paddr);
+	return 0;
+}
+
+/*
+ * Make the page holding user address VADDR in the current address
+ * space resident and private (breaking copy-on-write sharing) and
+ * wire it until vm_unwire, so that it keeps its physical address.
+ * The page must be in a writeable region. Returns the physical
+ * address of VADDR in *RET.
+ */
+int
+vm_wire(vaddr_t vaddr, paddr_t *ret)
+{
+	struct addrspace *as;
+	uint32_t *pte, asid;
+	paddr_t paddr, sharedpa;
+	vaddr_t page;
+	bool writeable;
+	int i, result, spl;
+
+	as = proc_getas();
+	if (as == NULL) {
+		return EFAULT;
+	}
+
+	page = vaddr & PAGE_FRAME;
+	if (!as_findregion(as, page, &writeable) || !writeable) {
+		return EFAULT;
+	}
+
+	pte = pt_lookup(as->as_pt, page, true);
+	if (pte == NULL) {
+		return ENOMEM;
+	}
+
+	result = vm_getpage(as, page, pte, &paddr);
+	if (result) {
+		return result;
+	}
+	sharedpa = paddr;
+	result = vm_cowbreak(as, page, pte, &paddr);
+	if (result) {
+		coremap_unpin(paddr);
+		return result;
+	}
+
+	if (paddr != sharedpa) {
+		/*
+		 * Unlike vm_fault we don't map the copy, so do the rest
+		 * of what that would do by hand: the copy is the only
+		 * place the data now lives, so it must be dirty or
+		 * pageout would just drop it; and our own read-only
+		 * TLB entry for the shared frame has to go, or user
+		 * code keeps using the old frame (vm_cowbreak only
+		 * deals with other CPUs).
+		 */
+		coremap_map(paddr, as, page, pte, true);
+
+		spl = splhigh();
+		asid = asid_activate(as);
+		i = tlb_probe(page | ASID_TLBHI(asid), 0);
+		if (i >= 0) {
+			tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
 		}
-		ehi = faultaddress;
-		elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
-		DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
-		tlb_write(ehi, elo, i);
+		tlb_setentryhi(ASID_TLBHI(asid));
 		splx(spl);
-		return 0;
 	}
 
-	kprintf("dumbvm: Ran out of TLB entries - cannot handle page fault\n");
-	splx(spl);
-	return EFAULT;
+	coremap_wire(paddr);
+	coremap_unpin(paddr);
+
+	*ret = paddr | (vaddr & ~PAGE_FRAME);
+	return 0;
+}
+
+void
+vm_unwire(paddr_t paddr)
+{
+	coremap_unwire(paddr & PAGE_FRAME);
 }
 
 struct addrspace *
 as_create(void)
 {
+	unsigned i;
 	struct addrspace *as = kmalloc(sizeof(struct addrspace));
 	if (as==NULL) {
 		return NULL;
 	}
 
-	as->as_vbase1 = 0;
-	as->as_pbase1 = 0;
-	as->as_npages1 = 0;
-	as->as_vbase2 = 0;
-	as->as_pbase2 = 0;
-	as->as_npages2 = 0;
-	as->as_stackpbase = 0;
+	as->as_pt = pt_create();
+	if (as->as_pt == NULL) {
+		kfree(as);
+		return NULL;
+	}
+	as->as_nregions = 0;
+	as->as_stackbase = USERSTACK - AS_STACKPAGES * PAGE_SIZE;
+	as->as_heapbase = 0;
+	as->as_heaptop = 0;
+	as->as_loading = false;
+	as->as_vnode = NULL;
+	for (i=0; i<MAXCPUS; i++) {
+		as->as_asid[i] = 0;
+	}
 
 	return as;
 }
 
+/*
+ * Release whatever PTE refers to, in memory or in swap, and clear it.
+ * Does not touch the TLB.
+ */
+static
+void
+as_freepage(uint32_t *pte)
+{
+	paddr_t paddr;
+
+	/* Pinning waits out any eviction in progress. */
+	if ((*pte & PTE_VALID) && coremap_pin(pte)) {
+		paddr = *pte & PTE_FRAME;
+		*pte = 0;
+		coremap_free(paddr);
+	}
+	if (*pte & PTE_SWAPPED) {
+		swap_free(PTE_SWAPSLOT(*pte));
+		*pte = 0;
+	}
+}
+
 void
 as_destroy(struct addrspace *as)
 {
+	struct pagetable *pt = as->as_pt;
+	uint32_t *l2;
+	unsigned i, j;
+
+	for (i=0; i<PT_NENTRIES; i++) {
+		l2 = pt->pt_l2[i];
+		if (l2 == NULL) {
+			continue;
+		}
+		for (j=0; j<PT_NENTRIES; j++) {
+			as_freepage(&l2[j]);
+		}
+	}
+	pt_destroy(pt);
+	if (as->as_vnode != NULL) {
+		VOP_DECREF(as->as_vnode);
+	}
 	kfree(as);
 }
 
 void
 as_activate(void)
 {
-	int i, spl;
 	struct addrspace *as;
+	int spl;
 
 	as = proc_getas();
 	if (as == NULL) {
 		return;
 	}
 
-	/* Disable interrupts on this CPU while frobbing the TLB. */
+	/* Just switch ASIDs; the TLB keeps everyone's entries. */
 	spl = splhigh();
-
-	for (i=0; i<NUM_TLB; i++) {
-		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
-	}
-
+	asid_activate(as);
 	splx(spl);
 }
 
@@ -288,7 +815,7 @@ int
 as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 		 int readable, int writeable, int executable)
 {
-	size_t npages;
+	struct region *rg;
 
 	/* Align the region. First, the base... */
 	sz += vaddr & ~(vaddr_t)PAGE_FRAME;
@@ -297,120 +824,193 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 	/* ...and now the length. */
 	sz = (sz + PAGE_SIZE - 1) & PAGE_FRAME;
 
-	npages = sz / PAGE_SIZE;
-
-	/* We don't use these - all pages are read-write */
+	/* Only write permission is enforced by the TLB. */
 	(void)readable;
-	(void)writeable;
 	(void)executable;
 
-	if (as->as_vbase1 == 0) {
-		as->as_vbase1 = vaddr;
-		as->as_npages1 = npages;
-		return 0;
+	if (as->as_nregions == AS_MAXREGIONS) {
+		kprintf("averagevm: Warning: too many regions\n");
+		return ENOSYS;
 	}
 
-	if (as->as_vbase2 == 0) {
-		as->as_vbase2 = vaddr;
-		as->as_npages2 = npages;
-		return 0;
+	rg = &as->as_regions[as->as_nregions++];
+	rg->rg_vbase = vaddr;
+	rg->rg_npages = sz / PAGE_SIZE;
+	rg->rg_writeable = writeable != 0;
+	rg->rg_filevaddr = vaddr;
+	rg->rg_filesize = 0;
+	rg->rg_fileoff = 0;
+
+	/* The heap starts out empty above the highest region. */
+	if (vaddr + sz > as->as_heapbase) {
+		as->as_heapbase = vaddr + sz;
+		as->as_heaptop = vaddr + sz;
 	}
 
-	/*
-	 * Support for more than two regions is not available.
-	 */
-	kprintf("dumbvm: Warning: too many regions\n");
-	return ENOSYS;
-}
-
-static
-void
-as_zero_region(paddr_t paddr, unsigned npages)
-{
-	bzero((void *)PADDR_TO_KVADDR(paddr), npages * PAGE_SIZE);
+	return 0;
 }
 
 int
-as_prepare_load(struct addrspace *as)
+as_define_file(struct addrspace *as, vaddr_t vaddr, size_t filesize,
+	       struct vnode *v, off_t offset)
 {
-	KASSERT(as->as_pbase1 == 0);
-	KASSERT(as->as_pbase2 == 0);
-	KASSERT(as->as_stackpbase == 0);
+	struct region *rg;
 
-	as->as_pbase1 = getppages(as->as_npages1);
-	if (as->as_pbase1 == 0) {
-		return ENOMEM;
-	}
-
-	as->as_pbase2 = getppages(as->as_npages2);
-	if (as->as_pbase2 == 0) {
-		return ENOMEM;
+	rg = as_getregion(as, vaddr);
+	if (rg == NULL ||
+	    filesize > rg->rg_vbase + rg->rg_npages * PAGE_SIZE - vaddr) {
+		return EFAULT;
 	}
 
-	as->as_stackpbase = getppages(DUMBVM_STACKPAGES);
-	if (as->as_stackpbase == 0) {
-		return ENOMEM;
+	/* All regions come from the same executable. */
+	if (as->as_vnode == NULL) {
+		VOP_INCREF(v);
+		as->as_vnode = v;
 	}
+	KASSERT(as->as_vnode == v);
 
-	as_zero_region(as->as_pbase1, as->as_npages1);
-	as_zero_region(as->as_pbase2, as->as_npages2);
-	as_zero_region(as->as_stackpbase, DUMBVM_STACKPAGES);
+	rg->rg_filevaddr = vaddr;
+	rg->rg_filesize = filesize;
+	rg->rg_fileoff = offset;
+	return 0;
+}
 
+int
+as_prepare_load(struct addrspace *as)
+{
+	/* Let load_elf write into read-only segments. */
+	as->as_loading = true;
 	return 0;
 }
 
 int
 as_complete_load(struct addrspace *as)
 {
-	(void)as;
+	as->as_loading = false;
+
+	/* Drop the writeable TLB entries made while loading. */
+	asid_retire(as, true);
 	return 0;
 }
 
 int
 as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 {
-	KASSERT(as->as_stackpbase != 0);
+	KASSERT(as->as_stackbase < USERSTACK);
 
 	*stackptr = USERSTACK;
 	return 0;
 }
 
+int
+as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *oldbreak)
+{
+	struct tlbshootdown ts;
+	vaddr_t oldtop, newtop, va;
+	uint32_t *pte;
+
+	oldtop = as->as_heaptop;
+	if (amount >= 0) {
+		if ((vaddr_t)amount > as->as_stackbase - oldtop) {
+			return ENOMEM;
+		}
+	}
+	else {
+		if ((vaddr_t)0 - (vaddr_t)amount > oldtop - as->as_heapbase) {
+			return EINVAL;
+		}
+	}
+	newtop = oldtop + amount;
+	as->as_heaptop = newtop;
+
+	/* Give back the pages above the new break right away. */
+	for (va = ROUNDUP(newtop, PAGE_SIZE);
+	     va < ROUNDUP(oldtop, PAGE_SIZE);
+	     va += PAGE_SIZE) {
+		pte = pt_lookup(as->as_pt, va, false);
+		if (pte == NULL || *pte == 0) {
+			continue;
+		}
+
+		ts.ts_as = as;
+		ts.ts_vaddr = va;
+		vm_tlbshootdown(&ts);
+
+		as_freepage(pte);
+	}
+	if (ROUNDUP(newtop, PAGE_SIZE) < ROUNDUP(oldtop, PAGE_SIZE)) {
+		/* Entries on other CPUs; see asid_retire. */
+		asid_retire(as, false);
+	}
+
+	*oldbreak = oldtop;
+	return 0;
+}
+
 int
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
 	struct addrspace *new;
+	uint32_t *l2, *pte;
+	paddr_t paddr;
+	vaddr_t vaddr;
+	unsigned i, j;
+	int result;
 
 	new = as_create();
 	if (new==NULL) {
 		return ENOMEM;
 	}
 
-	new->as_vbase1 = old->as_vbase1;
-	new->as_npages1 = old->as_npages1;
-	new->as_vbase2 = old->as_vbase2;
-	new->as_npages2 = old->as_npages2;
-
-	/* (Mis)use as_prepare_load to allocate some physical memory. */
-	if (as_prepare_load(new)) {
-		as_destroy(new);
-		return ENOMEM;
+	for (i=0; i<old->as_nregions; i++) {
+		new->as_regions[i] = old->as_regions[i];
+	}
+	new->as_nregions = old->as_nregions;
+	new->as_stackbase = old->as_stackbase;
+	new->as_heapbase = old->as_heapbase;
+	new->as_heaptop = old->as_heaptop;
+	if (old->as_vnode != NULL) {
+		VOP_INCREF(old->as_vnode);
+		new->as_vnode = old->as_vnode;
 	}
 
-	KASSERT(new->as_pbase1 != 0);
-	KASSERT(new->as_pbase2 != 0);
-	KASSERT(new->as_stackpbase != 0);
-
-	memmove((void *)PADDR_TO_KVADDR(new->as_pbase1),
-		(const void *)PADDR_TO_KVADDR(old->as_pbase1),
-		old->as_npages1*PAGE_SIZE);
-
-	memmove((void *)PADDR_TO_KVADDR(new->as_pbase2),
-		(const void *)PADDR_TO_KVADDR(old->as_pbase2),
-		old->as_npages2*PAGE_SIZE);
+	/*
+	 * Share every page the parent has touched. Both sides see the
+	 * frames read-only from now on (see vm_fault). Pages the parent
+	 * has in swap are read back in first. Pages it never touched
+	 * are left for the child to fault in itself.
+	 */
+	for (i=0; i<PT_NENTRIES; i++) {
+		l2 = old->as_pt->pt_l2[i];
+		if (l2 == NULL) {
+			continue;
+		}
+		for (j=0; j<PT_NENTRIES; j++) {
+			if ((l2[j] & (PTE_VALID | PTE_SWAPPED)) == 0) {
+				continue;
+			}
+			vaddr = PT_VADDR(i, j);
+			pte = pt_lookup(new->as_pt, vaddr, true);
+			if (pte == NULL) {
+				as_destroy(new);
+				return ENOMEM;
+			}
+			result = vm_getpage(old, vaddr, &l2[j], &paddr);
+			if (result) {
+				as_destroy(new);
+				return result;
+			}
+			coremap_incref(paddr);
+			*pte = paddr | PTE_VALID;
+			coremap_unpin(paddr);
+		}
+	}
 
-	memmove((void *)PADDR_TO_KVADDR(new->as_stackpbase),
-		(const void *)PADDR_TO_KVADDR(old->as_stackpbase),
-		DUMBVM_STACKPAGES*PAGE_SIZE);
+	/*
+	 * The parent may still have writeable TLB entries for pages
+	 * that are now shared, on any CPU it has run on.
+	 */
+	asid_retire(old, true);
 
 	*ret = new;
 	return 0;
@@ -32,12 +32,13 @@
 #include <lib.h>
 #include <spl.h>
 #include <spinlock.h>
+#include <cpu.h>
 #include <proc.h>
 #include <current.h>
 #include <mips/tlb.h>
 #include <addrspace.h>
 #include <vm.h>
-#include <page_track.h>
+#include <coremap.h>
 #include <mainbus.h>
 
 /*
@@ -59,44 +60,26 @@
 /* under dumbvm, always have 72k of user stack */
 /* (this must be > 64K so argument blocks of size ARG_MAX will fit) */
 #define DUMBVM_STACKPAGES    18
-#define PAGE_NUM 128
-/*
- * Wrap ram_stealmem in a spinlock.
- */
-static struct spinlock stealmem_lock = SPINLOCK_INITIALIZER;
-//static struct page_track* map;
-static uint8_t map[PAGE_NUM];
-static uint8_t start = 0;
 
 void
 vm_bootstrap(void)
 {
-	
+	/* The coremap was set up by coremap_bootstrap(). */
 }
 
 static
 paddr_t
 getppages(unsigned long npages)
 {
-	paddr_t addr;
-	spinlock_acquire(&stealmem_lock);
-	addr = ram_stealmem(npages, map);
-
-	spinlock_release(&stealmem_lock);
-	return addr;
+	return coremap_alloc(npages);
 }
 
 /* Allocate/free some kernel-space virtual pages */
 vaddr_t
 alloc_kpages(unsigned npages)
 {
-	if (start == 0) {
-		for (int i = 0; i < PAGE_NUM; i++) {
-			map[i] = (uint8_t)0;
-		}
-		start++;
-	}
 	paddr_t pa;
+
 	pa = getppages(npages);
 	if (pa==0) {
 		return 0;
@@ -107,13 +90,8 @@ alloc_kpages(unsigned npages)
 void
 free_kpages(vaddr_t addr)
 {
-	paddr_t paddr = addr - MIPS_KSEG0;
-	/* nothing - leak the memory. */
-	uint8_t npages = paddr / PAGE_SIZE;
-
-	spinlock_acquire(&stealmem_lock);
-	map[npages] = 0;
-	spinlock_release(&stealmem_lock);
+	KASSERT(addr >= MIPS_KSEG0 && addr < MIPS_KSEG1);
+	coremap_free(addr - MIPS_KSEG0);
 }
 
 void
@@ -212,6 +190,8 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	/* Disable interrupts on this CPU while frobbing the TLB. */
 	spl = splhigh();
 
+	curcpu->c_tlbrefills++;
+
 	for (i=0; i<NUM_TLB; i++) {
 		tlb_read(&ehi, &elo, i);
 		if (elo & TLBLO_VALID) {
@@ -225,9 +205,14 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 		return 0;
 	}
 
-	kprintf("dumbvm: Ran out of TLB entries - cannot handle page fault\n");
+	/* TLB is full; let the hardware pick a victim. */
+	curcpu->c_tlbevictions++;
+	ehi = faultaddress;
+	elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
+	DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
+	tlb_random(ehi, elo);
 	splx(spl);
-	return EFAULT;
+	return 0;
 }
 
 struct addrspace *
@@ -252,6 +237,15 @@ as_create(void)
 void
 as_destroy(struct addrspace *as)
 {
+	if (as->as_pbase1 != 0) {
+		coremap_free(as->as_pbase1);
+	}
+	if (as->as_pbase2 != 0) {
+		coremap_free(as->as_pbase2);
+	}
+	if (as->as_stackpbase != 0) {
+		coremap_free(as->as_stackpbase);
+	}
 	kfree(as);
 }
 
@@ -75,6 +75,50 @@ mips_timer_set(uint32_t count)
 		:: "r" (count));
 }
 
+/*
+ * Same for c0_count.
+ */
+static
+void
+mips_count_set(uint32_t count)
+{
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 registers */
+		"mtc0 %0, $9;"		/* do it */
+		".set pop"		/* restore assembler mode */
+		:: "r" (count));
+}
+
+/*
+ * Stop the periodic timer interrupt for tickless idle. The count is
+ * restarted from zero so that the next interrupt comes NSECS from
+ * now; the one after that is periodic again (see mainbus_interrupt),
+ * but by then whoever stopped the tick will have decided again.
+ */
+void
+mainbus_tick_stop(uint64_t nsecs)
+{
+	uint64_t cycles;
+
+	cycles = nsecs / (1000000000 / CPU_FREQUENCY);
+	if (cycles == 0) {
+		cycles = 1;
+	}
+	else if (cycles > 0xffffffff) {
+		cycles = 0xffffffff;
+	}
+	mips_count_set(0);
+	mips_timer_set(cycles);
+}
+
+void
+mainbus_tick_start(void)
+{
+	mips_count_set(0);
+	mips_timer_set(CPU_FREQUENCY / HZ);
+}
+
 /*
  * LAMEbus data for the system. (We have only one LAMEbus per system.)
  * This does not need to be locked, because it's constant once
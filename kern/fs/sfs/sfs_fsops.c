@@ -42,6 +42,7 @@
 #include <vfs.h>
 #include <device.h>
 #include <sfs.h>
+#include <objcache.h>
 #include "sfsprivate.h"
 
 
@@ -213,6 +214,7 @@ sfs_fs_destroy(struct sfs_fs *sfs)
 		bitmap_destroy(sfs->sfs_freemap);
 	}
 	vnodearray_destroy(sfs->sfs_vnodes);
+	objcache_destroy(sfs->sfs_vnodecache);
 	KASSERT(sfs->sfs_device == NULL);
 	kfree(sfs);
 }
@@ -305,6 +307,12 @@ sfs_fs_create(void)
 	if (sfs->sfs_vnodes == NULL) {
 		goto cleanup_object;
 	}
+	sfs->sfs_vnodecache = objcache_create("sfs_vnode",
+					      sizeof(struct sfs_vnode), 0,
+					      NULL, NULL);
+	if (sfs->sfs_vnodecache == NULL) {
+		goto cleanup_vnodes;
+	}
 
 	/* freemap */
 	sfs->sfs_freemap = NULL;
@@ -312,6 +320,8 @@ sfs_fs_create(void)
 
 	return sfs;
 
+cleanup_vnodes:
+	vnodearray_destroy(sfs->sfs_vnodes);
 cleanup_object:
 	kfree(sfs);
 fail:
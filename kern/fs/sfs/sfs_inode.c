@@ -37,6 +37,7 @@
 #include <lib.h>
 #include <vfs.h>
 #include <sfs.h>
+#include <objcache.h>
 #include "sfsprivate.h"
 
 
@@ -136,7 +137,7 @@ sfs_reclaim(struct vnode *v)
 	vfs_biglock_release();
 
 	/* Release the storage for the vnode structure itself. */
-	kfree(sv);
+	objcache_free(sfs->sfs_vnodecache, sv);
 
 	/* Done */
 	return 0;
@@ -184,7 +185,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 
 	/* Didn't have it loaded; load it */
 
-	sv = kmalloc(sizeof(struct sfs_vnode));
+	sv = objcache_alloc(sfs->sfs_vnodecache);
 	if (sv==NULL) {
 		return ENOMEM;
 	}
@@ -198,7 +199,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Read the block the inode is in */
 	result = sfs_readblock(sfs, ino, &sv->sv_i, sizeof(sv->sv_i));
 	if (result) {
-		kfree(sv);
+		objcache_free(sfs->sfs_vnodecache, sv);
 		return result;
 	}
 
@@ -235,7 +236,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Call the common vnode initializer */
 	result = vnode_init(&sv->sv_absvn, ops, &sfs->sfs_absfs, sv);
 	if (result) {
-		kfree(sv);
+		objcache_free(sfs->sfs_vnodecache, sv);
 		return result;
 	}
 
@@ -246,7 +247,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_absvn, NULL);
 	if (result) {
 		vnode_cleanup(&sv->sv_absvn);
-		kfree(sv);
+		objcache_free(sfs->sfs_vnodecache, sv);
 		return result;
 	}
 
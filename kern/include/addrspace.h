@@ -36,11 +36,33 @@
 
 
 #include <vm.h>
+#include <platform/maxcpus.h>
 #include "opt-averagevm.h"
 //#include "opt-dumbvm.h"
 
 struct vnode;
+struct pagetable;
 
+#if OPT_AVERAGEVM
+/*
+ * A region of the address space defined by the executable. Pages in
+ * it are only allocated when first touched.
+ */
+struct region {
+        vaddr_t rg_vbase;               /* page-aligned base */
+        size_t rg_npages;
+        bool rg_writeable;
+        vaddr_t rg_filevaddr;           /* where file contents start */
+        size_t rg_filesize;             /* bytes from file; rest is zero */
+        off_t rg_fileoff;               /* offset in as_vnode */
+};
+
+/* Most executables have two or three loadable segments. */
+#define AS_MAXREGIONS 4
+
+/* Largest the user stack may grow to (also lazily allocated). */
+#define AS_STACKPAGES 1024
+#endif
 
 /*
  * Address space - data structure associated with the virtual memory
@@ -59,13 +81,15 @@ struct addrspace {
         size_t as_npages2;
         paddr_t as_stackpbase;
 #elif OPT_AVERAGEVM
-        vaddr_t as_vbase1;
-        paddr_t as_pbase1;
-        size_t as_npages1;
-        vaddr_t as_vbase2;
-        paddr_t as_pbase2;
-        size_t as_npages2;
-        paddr_t as_stackpbase;
+        struct pagetable *as_pt;        /* page table; pages fault in lazily */
+        struct region as_regions[AS_MAXREGIONS];
+        unsigned as_nregions;
+        vaddr_t as_stackbase;           /* lowest address of stack region */
+        vaddr_t as_heapbase;            /* start of heap (page-aligned) */
+        vaddr_t as_heaptop;             /* current break */
+        bool as_loading;                /* ignore permissions while loading */
+        uint32_t as_asid[MAXCPUS];      /* TLB ASID on each cpu (see vm) */
+        struct vnode *as_vnode;         /* executable backing the regions */
 #else
 
 #endif
@@ -98,6 +122,11 @@ struct addrspace {
  *    as_define_region - set up a region of memory within the address
  *                space.
  *
+ *    as_define_file - make the first FILESIZE bytes of the region
+ *                starting at VADDR come from offset OFFSET of V. They
+ *                are read in a page at a time as they are touched.
+ *                The address space keeps a reference to V.
+ *
  *    as_prepare_load - this is called before actually loading from an
  *                executable into the address space.
  *
@@ -108,6 +137,11 @@ struct addrspace {
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
  *
+ *    as_sbrk   - move the heap break by AMOUNT bytes, handing back the
+ *                old break. The heap starts empty just above the
+ *                highest region. Pages freed by shrinking are released
+ *                at once.
+ *
  * Note that when using dumbvm, addrspace.c is not used and these
  * functions are found in dumbvm.c.
  */
@@ -123,9 +157,14 @@ int               as_define_region(struct addrspace *as,
                                    int readable,
                                    int writeable,
                                    int executable);
+int               as_define_file(struct addrspace *as, vaddr_t vaddr,
+                                 size_t filesize, struct vnode *v,
+                                 off_t offset);
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
+int               as_sbrk(struct addrspace *as, intptr_t amount,
+                          vaddr_t *oldbreak);
 
 
 /*
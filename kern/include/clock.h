@@ -56,6 +56,18 @@
 void hardclock_bootstrap(void);
 void hardclock(void);
 
+/*
+ * Tickless idle. hardclock_idle() is called by the idle loop just
+ * before it idles the CPU: it stops the periodic tick, leaving only a
+ * timer interrupt for when the next timeout on this CPU comes due.
+ * From then on the CPU is woken by IPIs when it's given a thread to
+ * run. hardclock_unidle() starts the tick again when the CPU has a
+ * thread to run, and brings c_hardclocks up to date. Both are called
+ * with interrupts off.
+ */
+void hardclock_idle(void);
+void hardclock_unidle(void);
+
 /*
  * timerclock() is called on one CPU once a second to allow simple
  * timed operations. (This is a fairly simpleminded interface.)
@@ -87,5 +99,49 @@ void timespec_sub(const struct timespec *t1,
  */
 void clocksleep(int seconds);
 
+/*
+ * thread_sleep_until() suspends the current thread until the time of
+ * day given by DEADLINE. The deadline is to the nanosecond, but the
+ * wakeup comes from the first hardclock after it, so it may be up to
+ * 1/HZ late.
+ */
+void thread_sleep_until(const struct timespec *deadline);
+
+/*
+ * Timeouts: call a function at (the first hardclock after) a given
+ * time of day. Each CPU keeps a hashed timer wheel with one bucket
+ * per hardclock tick; a timeout goes on the wheel of the CPU that
+ * sets it and its function is called from that CPU's hardclock, in
+ * interrupt context, so it must not sleep.
+ *
+ *     timeout_init   - set up TO to call FUNC(ARG). TO must not
+ *                      be pending when it is reused or freed.
+ *     timeout_set    - arrange for TO to fire at DEADLINE. TO must
+ *                      not be pending. A deadline already past fires
+ *                      on the next hardclock.
+ *     timeout_cancel - stop TO from firing. Returns true if it was
+ *                      still pending; false if it was never set or
+ *                      has already fired. If the function is running
+ *                      right now on another CPU, waits for it to
+ *                      finish, so don't call this while holding a
+ *                      lock the function takes, or from the function.
+ *
+ * The struct is public so timeouts can live on the stack; don't look
+ * inside it.
+ */
+struct timeout {
+	struct timeout *to_next;	/* link in wheel bucket */
+	uint64_t to_deadline;		/* nanoseconds */
+	void (*to_func)(void *);
+	void *to_arg;
+	unsigned to_cpu;		/* wheel it was set on */
+	unsigned to_bucket;		/* bucket on that wheel */
+	volatile int to_state;		/* TO_IDLE, TO_PENDING, TO_FIRING */
+};
+
+void timeout_init(struct timeout *to, void (*func)(void *), void *arg);
+void timeout_set(struct timeout *to, const struct timespec *deadline);
+bool timeout_cancel(struct timeout *to);
+
 
 #endif /* _CLOCK_H_ */
@@ -0,0 +1,100 @@
+#ifndef _COREMAP_H_
+#define _COREMAP_H_
+
+/*
+ * Physical memory management ("coremap").
+ *
+ * There is one coremap entry for every physical page of RAM. The
+ * coremap is sized at boot from ram_getsize() and placed at the start
+ * of free memory, so all of physical memory can be handed out.
+ *
+ * Free pages are managed by a binary buddy allocator: free memory is
+ * split into naturally aligned blocks of 2^k pages, with one free
+ * list per order k. Allocating or freeing a block costs O(log n) in
+ * the number of pages of RAM.
+ *
+ * User pages are single pages that can be evicted to swap. While a
+ * user page is being evicted, read in, or otherwise worked on it is
+ * "pinned"; the clock never picks pinned pages, and coremap_pin waits
+ * for them. Each unshared user page remembers the address space,
+ * virtual address and PTE it is mapped through, so the evictor can
+ * unmap it and record the swap slot in the PTE.
+ *
+ * Functions:
+ *     coremap_bootstrap    - set up the coremap. Must be called right
+ *                            after ram_bootstrap(), before anything
+ *                            calls kmalloc.
+ *     coremap_enablepaging - allow eviction. Called from vm_bootstrap.
+ *     coremap_alloc        - allocate NPAGES physically contiguous
+ *                            kernel pages. Returns 0 if no suitable
+ *                            run is free and none can be made.
+ *     coremap_alloc_user   - allocate a user page for VADDR in AS,
+ *                            mapped through PTE. Returned pinned;
+ *                            0 if out of memory and swap.
+ *     coremap_free         - drop a reference to a run. The whole run
+ *                            is released when the last reference
+ *                            goes. User pages must be pinned, and the
+ *                            pin is released.
+ *     coremap_incref       - add a reference to an allocated run, so
+ *                            that it can be shared (e.g. copy-on-
+ *                            write). User pages must be pinned.
+ *     coremap_refcount     - return the number of references to a run.
+ *     coremap_runlength    - return the length of a run in pages.
+ *     coremap_pin          - pin the user page PTE refers to. Returns
+ *                            false if PTE is not resident.
+ *     coremap_unpin        - release a pin.
+ *     coremap_wire         - keep a pinned user page from being
+ *                            evicted even after it is unpinned, so it
+ *                            stays at the same physical address (for
+ *                            futexes). Wirings nest.
+ *     coremap_unwire       - undo one coremap_wire.
+ *     coremap_map          - note that a pinned user page is going
+ *                            into the TLB; see coremap.c.
+ *     coremap_setswapslot  - note that a pinned user page was just
+ *                            read in from swap slot SLOT.
+ *     coremap_setprivate   - attach a pointer to a page of an
+ *                            allocated kernel run for its allocator's
+ *                            own use.
+ *     coremap_getprivate   - fetch it again, without locking; the
+ *                            caller must own the page.
+ *     coremap_cpudrain     - give the pages in this CPU's free page
+ *                            cache back; for ipi_drainpages.
+ *     coremap_printstats   - print free memory and per-CPU free page
+ *                            cache hits and misses.
+ *
+ * Allocations return a run with one reference.
+ *
+ * Each CPU keeps a small cache of free single pages in front of the
+ * buddy allocator, so most one-page allocations and frees don't take
+ * the coremap lock. Pages in those caches don't count as free; when
+ * the buddy allocator runs dry they are called back before anything
+ * is evicted.
+ */
+
+#include <machine/vm.h>
+
+struct addrspace;
+
+void coremap_bootstrap(void);
+void coremap_enablepaging(void);
+paddr_t coremap_alloc(unsigned npages);
+paddr_t coremap_alloc_user(struct addrspace *as, vaddr_t vaddr,
+			   uint32_t *pte);
+void coremap_free(paddr_t paddr);
+void coremap_incref(paddr_t paddr);
+unsigned coremap_refcount(paddr_t paddr);
+unsigned coremap_runlength(paddr_t paddr);
+bool coremap_pin(uint32_t *pte);
+void coremap_unpin(paddr_t paddr);
+void coremap_wire(paddr_t paddr);
+void coremap_unwire(paddr_t paddr);
+bool coremap_map(paddr_t paddr, struct addrspace *as, vaddr_t vaddr,
+		 uint32_t *pte, bool write);
+void coremap_setswapslot(paddr_t paddr, unsigned slot);
+void coremap_setprivate(paddr_t paddr, void *priv);
+void *coremap_getprivate(paddr_t paddr);
+void coremap_cpudrain(void);
+void coremap_printstats(void);
+
+
+#endif /* _COREMAP_H_ */
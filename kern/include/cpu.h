@@ -35,6 +35,8 @@
 #include <threadlist.h>
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
 
+/* Free pages each cpu may keep for itself (see coremap.c). */
+#define CPU_FREEPAGES 16
 
 /*
  * Per-cpu structure
@@ -59,8 +61,23 @@ struct cpu {
 	 */
 	struct thread *c_curthread;	/* Current thread on cpu */
 	struct threadlist c_zombies;	/* List of exited threads */
+	struct threadlist c_threadcache; /* Dead threads to reuse (splhigh) */
+	struct thread *c_rehome;	/* Thread to move off once switched out */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
+	bool c_tickless;		/* Periodic tick stopped while idle */
+	uint64_t c_tickstopped;		/* ...since this time, in ns */
 	unsigned c_spinlocks;		/* Counter of spinlocks held */
+	unsigned c_tlbrefills;		/* Counter of TLB refills */
+	unsigned c_tlbevictions;	/* Refills that replaced a valid entry */
+
+	/*
+	 * Free single pages kept in front of the coremap (see
+	 * coremap.c). Touched only by this cpu at splhigh.
+	 */
+	paddr_t c_freepages[CPU_FREEPAGES];
+	unsigned c_nfreepages;
+	unsigned c_freepagehits;	/* Page allocations served from cache */
+	unsigned c_freepagemisses;	/* ...and ones that had to refill */
 
 	/*
 	 * Accessed by other cpus.
@@ -83,10 +100,19 @@ struct cpu {
 	 * struct tlbshootdown is machine-dependent and might
 	 * reasonably be either an address space and vaddr pair, or a
 	 * paddr, or something else.
+	 *
+	 * Senders take a ticket from c_shootdown_seq; c_shootdown_ack
+	 * is the last ticket whose mappings have been invalidated.
+	 * c_drainpages_seq and c_drainpages_ack do the same for
+	 * requests to empty c_freepages.
 	 */
 	uint32_t c_ipi_pending;		/* One bit for each IPI number */
 	struct tlbshootdown c_shootdown[TLBSHOOTDOWN_MAX];
 	int c_numshootdown;
+	unsigned c_shootdown_seq;	/* Shootdown batches queued */
+	unsigned c_shootdown_ack;	/* Shootdown batches done */
+	unsigned c_drainpages_seq;	/* Page cache drains requested */
+	unsigned c_drainpages_ack;	/* Page cache drains done */
 	struct spinlock c_ipi_lock;
 };
 
@@ -110,6 +136,15 @@ void cpu_machdep_init(struct cpu *);
 /*ASMLINKAGE*/ void cpu_start_secondary(void);
 void cpu_hatch(unsigned software_number);
 
+/*
+ * Access to the list of all CPUs, for collecting statistics.
+ *
+ * cpu_numcpus returns how many CPUs there are; cpu_getcpu returns
+ * the one with software number NUM.
+ */
+unsigned cpu_numcpus(void);
+struct cpu *cpu_getcpu(unsigned num);
+
 /*
  * Produce a string describing the CPU type.
  */
@@ -153,6 +188,11 @@ void cpu_halt(void);
  * ipi_send sends an IPI to one CPU.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
  * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
+ * ipi_tlbshootdown_batch sends several mappings with a single IPI and
+ * hands back a ticket; ipi_tlbshootdown_wait waits until the target
+ * has acknowledged that ticket.
+ * ipi_drainpages asks the target to give back its cached free pages
+ * and waits until it has.
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -163,10 +203,16 @@ void cpu_halt(void);
 #define IPI_OFFLINE		1	/* CPU is requested to go offline */
 #define IPI_UNIDLE		2	/* Runnable threads are available */
 #define IPI_TLBSHOOTDOWN	3	/* MMU mapping(s) need invalidation */
+#define IPI_DRAINPAGES		4	/* Free page cache should be emptied */
 
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
 void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
+void ipi_tlbshootdown_batch(struct cpu *target,
+			    const struct tlbshootdown *mappings, unsigned n,
+			    unsigned *ticket);
+void ipi_tlbshootdown_wait(struct cpu *target, unsigned ticket);
+void ipi_drainpages(struct cpu *target);
 
 void interprocessor_interrupt(void);
 
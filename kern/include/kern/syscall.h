@@ -196,6 +196,11 @@
 #define SYS_sync         118
 #define SYS_reboot       119
 //#define SYS___sysctl   120
+//                              (user-level synchronization)
+#define SYS_futex_wait   121
+#define SYS_futex_wake   122
+//                              (scheduling)
+#define SYS_setaffinity  123
 
 /*CALLEND*/
 
@@ -123,15 +123,25 @@ uint32_t random(void);
  * Kernel heap memory allocation. Like malloc/free.
  * If out of memory, kmalloc returns NULL.
  *
+ * kheap_bootstrap is called once, early in boot.
+ *
  * kheap_nextgeneration, dump, and dumpall do nothing unless heap
  * labeling (for leak detection) in kmalloc.c (q.v.) is enabled.
+ *
+ * kheap_getstats writes the per-size-class counters and the sampled
+ * per-caller histogram into a buffer as text, and returns the length
+ * needed like snprintf. kheap_setsamplerate starts sampling every
+ * RATE'th allocation (0 turns it off) and clears the histogram.
  */
+void kheap_bootstrap(void);
 void *kmalloc(size_t size);
 void kfree(void *ptr);
 void kheap_printstats(void);
 void kheap_nextgeneration(void);
 void kheap_dump(void);
 void kheap_dumpall(void);
+size_t kheap_getstats(char *buf, size_t maxlen);
+void kheap_setsamplerate(unsigned rate);
 
 /*
  * C string functions.
@@ -0,0 +1,62 @@
+#ifndef _LOCKPROF_H_
+#define _LOCKPROF_H_
+
+/*
+ * Lock contention profiler, compiled in with "options lockprof".
+ *
+ * Statistics are kept per name, not per lock, so that all the locks
+ * made with the same name (e.g. one per vnode) are added up together.
+ * Sleeping locks and CVs with the same name are kept apart. For each
+ * name we count:
+ *
+ *     acquires   - times a lock was taken / times a CV was waited on
+ *     contended  - how many of those had to wait (for a CV, all)
+ *     spins      - times a waiter spun on a running holder (locks)
+ *     sleeps     - times a waiter went to sleep (for a CV, one per
+ *                  wait)
+ *     wait       - total time spent waiting, in nanoseconds
+ *     max hold   - longest time a lock was held (not kept for CVs)
+ *
+ * Times are taken with gettime, so nothing is timed until the clock
+ * device has been attached and lockprof_bootstrap has been called.
+ *
+ * Functions:
+ *     lockprof_get       - find or make the record for NAME. Returns
+ *                          NULL, and the lock goes unprofiled, if the
+ *                          table is full.
+ *     lockprof_now       - current time in nanoseconds, or 0 if the
+ *                          clock isn't available yet.
+ *     lockprof_acquired  - count one acquire, which spun SPINS times
+ *                          and slept SLEEPS times. If CONTENDED,
+ *                          WAITSTART is when the waiting began; NOW is
+ *                          when the lock was got.
+ *     lockprof_released  - count one release of a lock got at
+ *                          ACQUIREDAT.
+ *     lockprof_print     - print the N names with the most total wait
+ *                          time, then zero all the counters.
+ */
+
+#include "opt-lockprof.h"
+
+#if OPT_LOCKPROF
+
+#define LOCKPROF_LOCK	0
+#define LOCKPROF_CV	1
+
+struct lockprof;
+
+void lockprof_bootstrap(void);
+
+struct lockprof *lockprof_get(int kind, const char *name);
+uint64_t lockprof_now(void);
+void lockprof_acquired(struct lockprof *lp, bool contended,
+		       unsigned spins, unsigned sleeps,
+		       uint64_t waitstart, uint64_t now);
+void lockprof_released(struct lockprof *lp, uint64_t acquiredat,
+		       uint64_t now);
+void lockprof_print(unsigned n);
+
+#endif /* OPT_LOCKPROF */
+
+
+#endif /* _LOCKPROF_H_ */
@@ -55,6 +55,14 @@ size_t mainbus_ramsize(void);
 /* Switch on an inter-processor interrupt. (Low-level.) */
 void mainbus_send_ipi(struct cpu *target);
 
+/*
+ * Stop the current CPU's periodic timer interrupt, arranging for just
+ * one more after NSECS (or as long as the hardware can wait, if
+ * that's less); or start it again at HZ. For tickless idle.
+ */
+void mainbus_tick_stop(uint64_t nsecs);
+void mainbus_tick_start(void);
+
 /*
  * The various ways to shut down the system. (These are very low-level
  * and should generally not be called directly - md_poweroff, for
@@ -0,0 +1,42 @@
+#ifndef _OBJCACHE_H_
+#define _OBJCACHE_H_
+
+/*
+ * Object caches.
+ *
+ * An object cache hands out objects of one fixed size, carved out of
+ * whole pages ("slabs"), so there is no size-class rounding. Free
+ * objects are kept in their constructed state: the constructor runs
+ * once when a slab is made and the destructor once when it is given
+ * back, not on every allocation. Anything the constructor sets up
+ * (locks, wait channels, arrays) must be left in the same state when
+ * an object is freed.
+ *
+ * Functions:
+ *     objcache_create  - make a cache for objects of SIZE bytes with
+ *                        the given ALIGN (a power of two, or 0 for
+ *                        the kmalloc alignment). CTOR, if not NULL,
+ *                        sets up a new object and returns 0 or an
+ *                        error; DTOR, if not NULL, undoes it. NAME
+ *                        should be a string constant. Returns NULL on
+ *                        out-of-memory. An object, plus one word of
+ *                        bookkeeping, must fit in a page.
+ *     objcache_destroy - destroy a cache. All its objects must have
+ *                        been freed.
+ *     objcache_alloc   - get a constructed object. Returns NULL on
+ *                        out-of-memory.
+ *     objcache_free    - give an object back to the cache it came
+ *                        from.
+ */
+
+struct objcache;
+
+struct objcache *objcache_create(const char *name, size_t size, size_t align,
+				 int (*ctor)(void *obj),
+				 void (*dtor)(void *obj));
+void objcache_destroy(struct objcache *oc);
+void *objcache_alloc(struct objcache *oc);
+void objcache_free(struct objcache *oc, void *obj);
+
+
+#endif /* _OBJCACHE_H_ */
@@ -67,5 +67,8 @@ int openfile_open(char *filename, int openflags, mode_t mode,
 void openfile_incref(struct openfile *);
 void openfile_decref(struct openfile *);
 
+/* set up the openfile allocator (called during boot) */
+void openfile_bootstrap(void);
+
 
 #endif /* _OPENFILE_H_ */
@@ -0,0 +1,55 @@
+#ifndef _PAGETABLE_H_
+#define _PAGETABLE_H_
+
+/*
+ * Two-level page table.
+ *
+ * A user virtual address is split into a 10-bit first-level index, a
+ * 10-bit second-level index, and the 12-bit page offset. The first
+ * level is an array of pointers to second-level tables; each
+ * second-level table is one page of PTEs and is only allocated once
+ * something in the 4M of address space it covers is touched.
+ *
+ * A PTE is a 32-bit word. When PTE_VALID is set, the page is resident
+ * and the top 20 bits hold its physical frame. When PTE_SWAPPED is
+ * set instead, the page has been paged out and the top 20 bits hold
+ * its swap slot. A PTE of 0 means the page has never been touched; it
+ * will be zero-filled on first fault.
+ *
+ * Functions:
+ *     pt_create  - allocate an empty page table. Returns NULL on
+ *                  out-of-memory.
+ *     pt_destroy - free the table structure. Does not touch the
+ *                  frames the PTEs refer to; the caller does that.
+ *     pt_lookup  - return a pointer to the PTE for VADDR. If CREATE
+ *                  is set the second-level table is allocated when
+ *                  missing; otherwise NULL is returned for addresses
+ *                  no table covers. NULL with CREATE set means
+ *                  out-of-memory.
+ */
+
+#include <vm.h>
+
+#define PT_L1_INDEX(va)   (((va) >> 22) & 0x3ff)
+#define PT_L2_INDEX(va)   (((va) >> 12) & 0x3ff)
+#define PT_VADDR(i, j)    (((vaddr_t)(i) << 22) | ((vaddr_t)(j) << 12))
+#define PT_NENTRIES       1024
+
+/* PTE fields */
+#define PTE_FRAME         0xfffff000	/* physical frame, if PTE_VALID */
+#define PTE_VALID         0x00000001	/* page is resident */
+#define PTE_SWAPPED       0x00000002	/* page is in swap */
+
+#define PTE_SWAPSLOT(pte) ((pte) >> 12)
+#define PTE_MKSWAP(slot)  (((uint32_t)(slot) << 12) | PTE_SWAPPED)
+
+struct pagetable {
+	uint32_t *pt_l2[PT_NENTRIES];
+};
+
+struct pagetable *pt_create(void);
+void pt_destroy(struct pagetable *pt);
+uint32_t *pt_lookup(struct pagetable *pt, vaddr_t vaddr, bool create);
+
+
+#endif /* _PAGETABLE_H_ */
@@ -50,19 +50,30 @@
  *
  * Note that spinlocks are held by CPUs, not by threads.
  *
+ * These are ticket locks, so CPUs get the lock in the order they
+ * asked for it: each waiter takes a number from splk_next and waits
+ * for splk_serving to reach it. The holder also keeps count of how
+ * often the lock was taken, how often that meant waiting, and how
+ * many times waiters polled in all.
+ *
  * This structure is made public so spinlocks do not have to be
  * malloc'd; however, code that uses spinlocks should not look inside
  * the structure directly but always use the spinlock API functions.
  */
 struct spinlock {
-	volatile spinlock_data_t splk_lock; /* Memory word where we spin. */
+	volatile spinlock_data_t splk_next; /* Next ticket to hand out. */
+	volatile spinlock_data_t splk_serving; /* Ticket that has the lock. */
 	struct cpu *splk_holder;	    /* CPU holding this lock. */
+	unsigned splk_acquires;		    /* Times taken. */
+	unsigned splk_contended;	    /* Times taken after waiting. */
+	uint64_t splk_spins;		    /* Polls while waiting. */
 };
 
 /*
  * Initializer for cases where a spinlock needs to be static or global.
  */
-#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, NULL }
+#define SPINLOCK_INITIALIZER \
+	{ SPINLOCK_DATA_INITIALIZER, SPINLOCK_DATA_INITIALIZER, NULL, 0, 0, 0 }
 
 /*
  * Spinlock functions.
@@ -71,18 +82,29 @@ struct spinlock {
  * cleanup	Opposite of init. Lock must be unlocked.
  *
  * acquire	Get the lock, spinning as necessary. Also disables interrupts.
+ * acquire_spins Same, and return how many times we polled while waiting.
+ * tryacquire	Get the lock only if it is free; returns true if we got it.
  * release	Release the lock. May re-enable interrupts.
  *
  * do_i_hold	Check if the current CPU holds the lock.
+ *
+ * register	Give the lock a name and list it in the table printed by
+ *		printstats. Meant for a handful of hot global locks.
+ * printstats	Print the counters of the registered locks.
  */
 
 void spinlock_init(struct spinlock *lk);
 void spinlock_cleanup(struct spinlock *lk);
 
 void spinlock_acquire(struct spinlock *lk);
+unsigned spinlock_acquire_spins(struct spinlock *lk);
+bool spinlock_tryacquire(struct spinlock *lk);
 void spinlock_release(struct spinlock *lk);
 
 bool spinlock_do_i_hold(struct spinlock *lk);
 
+void spinlock_register(struct spinlock *lk, const char *name);
+void spinlock_printstats(void);
+
 
 #endif /* _SPINLOCK_H_ */
@@ -0,0 +1,42 @@
+#ifndef _SWAP_H_
+#define _SWAP_H_
+
+/*
+ * Swap space.
+ *
+ * User pages are paged out to a raw disk device (SWAP_DEVICE), one
+ * page per swap slot. Slot N lives at byte offset N * PAGE_SIZE on
+ * the device. Free slots are tracked with a bitmap.
+ *
+ * If the device cannot be opened at boot the system runs without
+ * swap and swap_alloc always fails.
+ *
+ * Functions:
+ *     swap_bootstrap - open the swap device and set up the slot map.
+ *                      Called from vm_bootstrap.
+ *     swap_alloc     - allocate a free slot. Returns ENOSPC if there
+ *                      is none.
+ *     swap_free      - release a slot.
+ *     swap_pagein    - read slot SLOT into the physical page PADDR.
+ *     swap_pageout   - write the physical page PADDR to slot SLOT.
+ *
+ * swap_pagein and swap_pageout sleep, so they must not be called
+ * with spinlocks held or from an interrupt handler.
+ */
+
+#include <machine/vm.h>
+
+/* The raw device used for swapping. */
+#define SWAP_DEVICE	"lhd0raw:"
+
+/* No slot. */
+#define SWAP_NOSLOT	0xffffffff
+
+void swap_bootstrap(void);
+int swap_alloc(unsigned *slot);
+void swap_free(unsigned slot);
+int swap_pagein(paddr_t paddr, unsigned slot);
+int swap_pageout(paddr_t paddr, unsigned slot);
+
+
+#endif /* _SWAP_H_ */
@@ -36,6 +36,9 @@
 
 
 #include <spinlock.h>
+#include <lockprof.h>
+
+struct timespec; /* in kern/time.h */
 
 /*
  * Dijkstra-style semaphore.
@@ -58,9 +61,13 @@ void sem_destroy(struct semaphore *);
  *     P (proberen): decrement count. If the count is 0, block until
  *                   the count is 1 again before decrementing.
  *     V (verhogen): increment count.
+ *
+ * sem_timedP is P that gives up at DEADLINE, a time of day; it
+ * returns 0 if it decremented the count and ETIMEDOUT if not.
  */
 void P(struct semaphore *);
 void V(struct semaphore *);
+int sem_timedP(struct semaphore *, const struct timespec *deadline);
 
 
 /*
@@ -71,12 +78,24 @@ void V(struct semaphore *);
  *
  * The name field is for easier debugging. A copy of the name is
  * (should be) made internally.
+ *
+ * Locks are adaptive: a thread that finds the lock held by a thread
+ * running on another CPU spins for a while, expecting it to be let
+ * go soon, before going to sleep. With "options lockprof", how often
+ * each happens is counted in the lock's profiler record.
+ *
+ * With "options lockprof", lk_prof is the profiler's record for the
+ * lock's name and lk_acquiredat is when the holder got the lock.
  */
 struct lock {
         char *lk_name;
 	struct wchan *lk_wchan;
 	struct spinlock lk_lock;
 	struct thread *volatile lk_holder;
+#if OPT_LOCKPROF
+	struct lockprof *lk_prof;
+	uint64_t lk_acquiredat;
+#endif
 };
 
 struct lock *lock_create(const char *name);
@@ -116,6 +135,9 @@ struct cv {
         char *cv_name;
 	struct wchan *cv_wchan;
 	struct spinlock cv_wchanlock;
+#if OPT_LOCKPROF
+	struct lockprof *cv_prof;
+#endif
 };
 
 struct cv *cv_create(const char *name);
@@ -127,17 +149,71 @@ void cv_destroy(struct cv *);
  *                   waking up again, re-acquire the lock.
  *    cv_signal    - Wake up one thread that's sleeping on this CV.
  *    cv_broadcast - Wake up all threads sleeping on this CV.
+ *    cv_timedwait - Like cv_wait, but stop sleeping at DEADLINE, a
+ *                   time of day. Returns ETIMEDOUT if it did, or 0.
+ *                   The lock is re-acquired either way.
  *
- * For all three operations, the current thread must hold the lock passed
+ * For all four operations, the current thread must hold the lock passed
  * in. Note that under normal circumstances the same lock should be used
  * on all operations with any particular CV.
  *
  * These operations must be atomic. You get to write them.
  */
 void cv_wait(struct cv *cv, struct lock *lock);
+int cv_timedwait(struct cv *cv, struct lock *lock,
+		 const struct timespec *deadline);
 void cv_signal(struct cv *cv, struct lock *lock);
 void cv_broadcast(struct cv *cv, struct lock *lock);
 
 
+/*
+ * Reader-writer lock.
+ *
+ * Any number of readers can hold the lock at once, or one writer.
+ * Writers are preferred: once a writer is waiting, new readers wait
+ * behind it, so a steady stream of readers can't starve writers.
+ *
+ * When the lock is created, no thread should be holding it. Likewise,
+ * when the lock is destroyed, no thread should be holding it.
+ *
+ * The name field is for easier debugging. A copy of the name is
+ * made internally.
+ */
+
+struct rwlock {
+        char *rwlock_name;
+	struct wchan *rw_readwchan;	/* readers waiting */
+	struct wchan *rw_writewchan;	/* writers waiting */
+	struct spinlock rw_lock;	/* protects the rest */
+	unsigned rw_readers;		/* readers holding the lock */
+	unsigned rw_waitingwriters;	/* writers sleeping */
+	struct thread *rw_writer;	/* writer holding the lock */
+};
+
+struct rwlock *rwlock_create(const char *name);
+void rwlock_destroy(struct rwlock *);
+
+/*
+ * Operations:
+ *    rwlock_acquire_read  - Get the lock for reading, sharing it with
+ *                           other readers.
+ *    rwlock_acquire_write - Get the lock for writing, alone.
+ *    rwlock_release       - Give up the lock, either kind.
+ *    rwlock_downgrade     - Turn a write hold into a read hold without
+ *                           letting any other writer in between.
+ */
+void rwlock_acquire_read(struct rwlock *);
+void rwlock_acquire_write(struct rwlock *);
+void rwlock_release(struct rwlock *);
+void rwlock_downgrade(struct rwlock *);
+
+
+/*
+ * Set up the allocator for locks. Called early in boot, before
+ * anything creates a lock.
+ */
+void synch_bootstrap(void);
+
+
 #endif /* _SYNCH_H_ */
 
@@ -46,6 +46,16 @@ void syscall(struct trapframe *tf);
 /* Helper for fork(). You write this. */
 void enter_forked_process(struct trapframe *tf);
 
+/*
+ * Copy a trapframe for a forked child. The copy is freed by
+ * enter_forked_process, or with trapframe_free if the fork fails.
+ */
+struct trapframe *trapframe_dup(const struct trapframe *tf);
+void trapframe_free(struct trapframe *tf);
+
+/* Set up the trapframe allocator (called during boot). */
+void syscall_bootstrap(void);
+
 /* Enter user mode. Does not return. */
 __DEAD void enter_new_process(int argc, userptr_t argv, userptr_t env,
 		       vaddr_t stackptr, vaddr_t entrypoint);
@@ -71,9 +81,15 @@ int sys_lseek(int fd, off_t offset, int code, off_t *retval);
 int sys_chdir(const_userptr_t path);
 int sys___getcwd(userptr_t buf, size_t buflen, int *retval);
 int sys_getpid(int *retval);
+int sys_setaffinity(unsigned mask);
 int sys___fork( struct trapframe *tf, int *retval);
 int sys_execv(const char *program, char **args);
+int sys_sbrk(intptr_t amount, int *retval);
 
 int sys_waitpid(pid_t pid, userptr_t status, int options, int *retval);
 void sys_exit(int exitcode);
+
+void futex_bootstrap(void);
+int sys_futex_wait(userptr_t uaddr, int val);
+int sys_futex_wake(userptr_t uaddr, int n, int *retval);
 #endif /* _SYSCALL_H_ */
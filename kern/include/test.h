@@ -52,10 +52,15 @@ int threadlisttest(int, char **);
 int threadtest(int, char **);
 int threadtest2(int, char **);
 int threadtest3(int, char **);
+int threadtest4(int, char **);
+int threadtest5(int, char **);
+int threadtest6(int, char **);
 int semtest(int, char **);
 int locktest(int, char **);
 int cvtest(int, char **);
 int cvtest2(int, char **);
+int rwtest(int, char **);
+int futextest(int, char **);
 
 /* filesystem tests */
 int fstest(int, char **);
@@ -64,6 +64,9 @@ typedef enum {
 	S_ZOMBIE,	/* zombie; exited but not yet deleted */
 } threadstate_t;
 
+/* Names up to this long (with the terminator) are kept in the thread. */
+#define THREAD_NAMELEN 32
+
 /* Thread structure. */
 struct thread {
 	/*
@@ -73,6 +76,7 @@ struct thread {
 	char *t_name;			/* Name of this thread */
 	const char *t_wchan_name;	/* Name of wait channel, if sleeping */
 	threadstate_t t_state;		/* State this thread is in */
+	char t_namebuf[THREAD_NAMELEN];	/* t_name, unless it's longer */
 
 	/*
 	 * Thread subsystem internal fields.
@@ -84,6 +88,17 @@ struct thread {
 	struct cpu *t_cpu;		/* CPU thread runs on */
 	struct proc *t_proc;		/* Process thread belongs to */
 
+	/*
+	 * Scheduling fields (see schedule() in thread.c). Protected
+	 * by the runqueue lock of t_cpu while the thread is on a run
+	 * queue; otherwise touched only by the thread itself.
+	 */
+	unsigned t_priority;		/* Level, 0 (highest) and up */
+	unsigned t_ticks;		/* Ticks used of current slice */
+	uint32_t t_affinity;		/* CPUs allowed, by c_number */
+	struct cpu *t_lastcpu;		/* CPU it last ran on, or NULL */
+	unsigned t_lastran;		/* t_lastcpu's c_hardclocks then */
+
 	/*
 	 * Interrupt state fields.
 	 *
@@ -158,15 +173,43 @@ __DEAD void thread_exit(void);
 void thread_yield(void);
 
 /*
- * Reshuffle the run queue. Called from the timer interrupt.
+ * Reshuffle the run queue: give every thread on it, and the current
+ * thread, top priority again, so that nothing starves. Called from the
+ * timer interrupt.
  */
 void schedule(void);
 
 /*
- * Potentially migrate ready threads to other CPUs. Called from the
- * timer interrupt.
+ * Charge the current thread for one timer tick. Returns true if it
+ * should yield: because it has used up its time slice of QUANTUM
+ * ticks (and has been moved down a priority level), or because a
+ * higher priority thread is waiting. Called from the timer interrupt.
+ */
+bool thread_tick(unsigned quantum);
+
+/*
+ * Restrict the current thread to the CPUs in MASK (bit N is the CPU
+ * with c_number N; THREAD_AFFINITY_ALL means any CPU). New threads
+ * inherit the mask of the thread that forks them. If the current CPU
+ * isn't in MASK, the thread moves before this returns. Fails with
+ * EINVAL if MASK names no CPU that exists.
+ */
+#define THREAD_AFFINITY_ALL	0xffffffff
+int thread_setaffinity(uint32_t mask);
+
+/*
+ * Turn the per-CPU caches of exited threads (see thread_fork) on or
+ * off. They are on by default; this is for measuring what they save.
+ */
+void thread_cache_enable(bool enable);
+
+/*
+ * Even out run queue lengths across CPUs, by pulling a thread from a
+ * much busier CPU or poking an idle one. Idle CPUs also pull threads
+ * for themselves as soon as they run out. Called from the timer
+ * interrupt.
  */
-void thread_consider_migration(void);
+void thread_balance(void);
 
 
 #endif /* _THREAD_H_ */
@@ -59,5 +59,26 @@ void free_kpages(vaddr_t addr);
 void vm_tlbshootdown_all(void);
 void vm_tlbshootdown(const struct tlbshootdown *);
 
+/*
+ * Remove any TLB entries for the N (at most TLBSHOOTDOWN_MAX) mappings
+ * in TS on every CPU, waiting until the other CPUs have done so. Only
+ * CPUs the address spaces may have TLB entries on are interrupted, and
+ * each of those gets a single IPI for the whole batch. The pages must
+ * be pinned so they can't be faulted back in meanwhile (called by the
+ * page evictor).
+ */
+void vm_unmap(const struct tlbshootdown *ts, unsigned n);
+
+/*
+ * Keep the page holding user address VADDR of the current process in
+ * memory, at a fixed physical address, until vm_unwire. *RET gets the
+ * physical address of VADDR. (Used by futexes.)
+ */
+int vm_wire(vaddr_t vaddr, paddr_t *ret);
+void vm_unwire(paddr_t paddr);
+
+/* Print VM statistics (TLB refills per CPU) */
+void vm_printstats(void);
+
 
 #endif /* _VM_H_ */
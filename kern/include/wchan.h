@@ -36,6 +36,8 @@
 
 
 struct spinlock; /* in spinlock.h */
+struct timespec; /* in kern/time.h */
+struct thread; /* in thread.h */
 struct wchan; /* Opaque */
 
 /*
@@ -45,6 +47,12 @@ struct wchan; /* Opaque */
  */
 struct wchan *wchan_create(const char *name);
 
+/*
+ * Change the name of a wait channel that nobody is waiting on. The
+ * same rules apply to NAME as for wchan_create.
+ */
+void wchan_setname(struct wchan *wc, const char *name);
+
 /*
  * Destroy a wait channel. Must be empty and unlocked.
  */
@@ -66,6 +74,17 @@ bool wchan_isempty(struct wchan *wc, struct spinlock *lk);
  */
 void wchan_sleep(struct wchan *wc, struct spinlock *lk);
 
+/*
+ * Same, but wake up anyway at the time of day DEADLINE. Returns 0 if
+ * awakened by someone else and ETIMEDOUT if the deadline came first
+ * (including if it had already passed, in which case we don't sleep).
+ *
+ * The lock may be released and reacquired one extra time on the way
+ * out, so recheck whatever condition you were waiting for.
+ */
+int wchan_sleep_until(struct wchan *wc, struct spinlock *lk,
+		      const struct timespec *deadline);
+
 /*
  * Wake up one thread, or all threads, sleeping on a wait channel.
  * The associated spinlock should be locked.
@@ -76,5 +95,12 @@ void wchan_sleep(struct wchan *wc, struct spinlock *lk);
 void wchan_wakeone(struct wchan *wc, struct spinlock *lk);
 void wchan_wakeall(struct wchan *wc, struct spinlock *lk);
 
+/*
+ * Wake up thread T, if it is sleeping on the wait channel; returns
+ * true if it was. The associated spinlock should be locked.
+ */
+bool wchan_wakethread(struct wchan *wc, struct spinlock *lk,
+		      struct thread *t);
+
 
 #endif /* _WCHAN_H_ */
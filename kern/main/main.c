@@ -42,11 +42,14 @@
 #include <proc.h>
 #include <current.h>
 #include <synch.h>
+#include <lockprof.h>
 #include <vm.h>
+#include <coremap.h>
 #include <mainbus.h>
 #include <vfs.h>
 #include <device.h>
 #include <syscall.h>
+#include <openfile.h>
 #include <test.h>
 #include <version.h>
 #include "autoconf.h"  // for pseudoconfig
@@ -107,10 +110,16 @@ boot(void)
 
 	/* Early initialization. */
 	ram_bootstrap();
+	kheap_bootstrap();
+	coremap_bootstrap();
+	synch_bootstrap();
 	proc_bootstrap();
 	thread_bootstrap();
 	hardclock_bootstrap();
 	vfs_bootstrap();
+	openfile_bootstrap();
+	syscall_bootstrap();
+	futex_bootstrap();
 	kheap_nextgeneration();
 
 	/* Probe and initialize devices. Interrupts should come on. */
@@ -118,6 +127,10 @@ boot(void)
 	KASSERT(curthread->t_curspl > 0);
 	mainbus_bootstrap();
 	KASSERT(curthread->t_curspl == 0);
+#if OPT_LOCKPROF
+	/* The clock is attached now, so lock waits can be timed. */
+	lockprof_bootstrap();
+#endif
 	/* Now do pseudo-devices. */
 	pseudoconfig();
 	kprintf("\n");
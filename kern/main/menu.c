@@ -37,6 +37,8 @@
 #include <clock.h>
 #include <thread.h>
 #include <proc.h>
+#include <vm.h>
+#include <coremap.h>
 #include <vfs.h>
 #include <sfs.h>
 #include <syscall.h>
@@ -44,6 +46,7 @@
 #include "opt-synchprobs.h"
 #include "opt-sfs.h"
 #include "opt-net.h"
+#include "opt-lockprof.h"
 #include "pid.h"
 #include <synch.h>
 /*
@@ -390,6 +393,7 @@ cmd_kheapstats(int nargs, char **args)
 	(void)args;
 
 	kheap_printstats();
+	coremap_printstats();
 
 	return 0;
 }
@@ -423,6 +427,95 @@ cmd_kheapdump(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_kheapclassstats(int nargs, char **args)
+{
+	char *buf;
+	size_t len;
+
+	(void)nargs;
+	(void)args;
+
+	len = kheap_getstats(NULL, 0) + 1;
+	buf = kmalloc(len);
+	if (buf == NULL) {
+		return ENOMEM;
+	}
+	kheap_getstats(buf, len);
+	kprintf("%s", buf);
+	kfree(buf);
+
+	return 0;
+}
+
+static
+int
+cmd_kheapsample(int nargs, char **args)
+{
+	if (nargs != 2) {
+		kprintf("Usage: khsample rate (0 for off)\n");
+		return EINVAL;
+	}
+
+	kheap_setsamplerate(atoi(args[1]));
+
+	return 0;
+}
+
+static
+int
+cmd_spinlockstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	spinlock_printstats();
+
+	return 0;
+}
+
+#if OPT_LOCKPROF
+/*
+ * Command for printing the most contended locks. This also resets
+ * the profile, so each run covers the time since the last one.
+ */
+static
+int
+cmd_lockprof(int nargs, char **args)
+{
+	int n = 10;
+
+	if (nargs > 2) {
+		kprintf("Usage: lkprof [count]\n");
+		return EINVAL;
+	}
+	if (nargs == 2) {
+		n = atoi(args[1]);
+		if (n <= 0) {
+			kprintf("lkprof: count must be positive\n");
+			return EINVAL;
+		}
+	}
+
+	lockprof_print(n);
+
+	return 0;
+}
+#endif
+
+static
+int
+cmd_vmstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	vm_printstats();
+
+	return 0;
+}
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -489,6 +582,9 @@ static const char *testmenu[] = {
 	"[tt1] Thread test 1                 ",
 	"[tt2] Thread test 2                 ",
 	"[tt3] Thread test 3                 ",
+	"[tt4] Scheduler latency test        ",
+	"[tt5] Fork latency benchmark        ",
+	"[tt6] CPU affinity test             ",
 #if OPT_NET
 	"[net] Network test                  ",
 #endif
@@ -496,6 +592,8 @@ static const char *testmenu[] = {
 	"[sy2] Lock test             (1)     ",
 	"[sy3] CV test               (1)     ",
 	"[sy4] CV test #2            (1)     ",
+	"[sy5] RW lock test          (1)     ",
+	"[fx1] Futex test                    ",
 	"[fs1] Filesystem test               ",
 	"[fs2] FS read stress                ",
 	"[fs3] FS write stress               ",
@@ -529,6 +627,13 @@ static const char *mainmenu[] = {
 	"[kh] Kernel heap stats              ",
 	"[khgen] Next kernel heap generation ",
 	"[khdump] Dump kernel heap           ",
+	"[khstat] Kernel heap class stats    ",
+	"[khsample] Sample kmalloc callers   ",
+	"[vm] VM stats                       ",
+	"[splk] Spinlock stats               ",
+#if OPT_LOCKPROF
+	"[lkprof] Lock profile (and reset)   ",
+#endif
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -583,6 +688,13 @@ static struct {
 	{ "kh",         cmd_kheapstats },
 	{ "khgen",      cmd_kheapgeneration },
 	{ "khdump",     cmd_kheapdump },
+	{ "khstat",     cmd_kheapclassstats },
+	{ "khsample",   cmd_kheapsample },
+	{ "vm",         cmd_vmstats },
+	{ "splk",       cmd_spinlockstats },
+#if OPT_LOCKPROF
+	{ "lkprof",     cmd_lockprof },
+#endif
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -598,12 +710,17 @@ static struct {
 	{ "tt1",	threadtest },
 	{ "tt2",	threadtest2 },
 	{ "tt3",	threadtest3 },
+	{ "tt4",	threadtest4 },
+	{ "tt5",	threadtest5 },
+	{ "tt6",	threadtest6 },
 	{ "sy1",	semtest },
 
 	/* synchronization assignment tests */
 	{ "sy2",	locktest },
 	{ "sy3",	cvtest },
 	{ "sy4",	cvtest2 },
+	{ "sy5",	rwtest },
+	{ "fx1",	futextest },
 
 	/* file system assignment tests */
 	{ "fs1",	fstest },
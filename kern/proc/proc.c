@@ -52,12 +52,54 @@
 #include <filetable.h>
 #include <pid.h>
 #include <synch.h>
+#include <objcache.h>
 
 /*
  * The process for the kernel; this holds all the kernel-only threads.
  */
 struct proc *kproc;
 
+/*
+ * Where proc structures come from. The wait lock and CV, the thread
+ * array and p_lock are set up once by proc_ctor and survive between
+ * uses of the structure.
+ */
+static struct objcache *proc_cache;
+
+static
+int
+proc_ctor(void *obj)
+{
+	struct proc *proc = obj;
+
+	proc->waitlock = lock_create("waitlock");
+	if (proc->waitlock == NULL) {
+		return ENOMEM;
+	}
+
+	proc->waitcv = cv_create("waitcv");
+	if (proc->waitcv == NULL) {
+		lock_destroy(proc->waitlock);
+		return ENOMEM;
+	}
+
+	threadarray_init(&proc->p_threads);
+	spinlock_init(&proc->p_lock);
+	return 0;
+}
+
+static
+void
+proc_dtor(void *obj)
+{
+	struct proc *proc = obj;
+
+	lock_destroy(proc->waitlock);
+	cv_destroy(proc->waitcv);
+	threadarray_cleanup(&proc->p_threads);
+	spinlock_cleanup(&proc->p_lock);
+}
+
 /*
  * Create a proc structure.
  */
@@ -67,32 +109,18 @@ proc_create(const char *name)
 {
 	struct proc *proc;
 
-	proc = kmalloc(sizeof(*proc));
+	proc = objcache_alloc(proc_cache);
 	if (proc == NULL) {
 		return NULL;
 	}
 
 	proc->p_name = kstrdup(name);
 	if (proc->p_name == NULL) {
-		kfree(proc);
-		return NULL;
-	}
-
-	proc->waitlock = lock_create("waitlock");
-	if(	proc->waitlock == NULL) {
-		kfree(proc);
-		return NULL;
-	}
-
-	proc->waitcv = cv_create("waitcv");
-	if(	proc->waitcv == NULL) {
-		lock_destroy(proc->waitlock);
-		kfree(proc);
+		objcache_free(proc_cache, proc);
 		return NULL;
 	}
 
-	threadarray_init(&proc->p_threads);
-	spinlock_init(&proc->p_lock);
+	KASSERT(threadarray_num(&proc->p_threads) == 0);
 
 	/* VM fields */
 	proc->p_addrspace = NULL;
@@ -136,8 +164,6 @@ proc_destroy(struct proc *proc)
 	 * hang around beyond process exit. Some wait/exit designs
 	 * do, some don't.
 	 */
-	lock_destroy(proc->waitlock);
-	cv_destroy(proc->waitcv);
 	pid_destroy();
 	if(proc->parent_table != NULL){
 		lock_destroy(proc->parent_table->parent_lock);
@@ -210,11 +236,11 @@ proc_destroy(struct proc *proc)
 		}
 		as_destroy(as);
 	}
-	threadarray_cleanup(&proc->p_threads);
-	spinlock_cleanup(&proc->p_lock);
+	/* The thread array, locks and CV go back to the cache as is. */
+	KASSERT(threadarray_num(&proc->p_threads) == 0);
 
 	kfree(proc->p_name);
-	kfree(proc);
+	objcache_free(proc_cache, proc);
 }
 
 /*
@@ -223,6 +249,12 @@ proc_destroy(struct proc *proc)
 void
 proc_bootstrap(void)
 {
+	proc_cache = objcache_create("proc", sizeof(struct proc), 0,
+				     proc_ctor, proc_dtor);
+	if (proc_cache == NULL) {
+		panic("proc_bootstrap: Out of memory\n");
+	}
+
 	kproc = proc_create("[kernel]");
 	if (kproc == NULL) {
 		panic("proc_create for kproc failed\n");
@@ -0,0 +1,171 @@
+/*
+ * Futexes: the kernel half of user-level locks and semaphores.
+ *
+ * A futex is just an aligned int in user memory. User code does the
+ * uncontended cases itself with atomic instructions and only calls
+ * futex_wait, to sleep while the int still holds an expected value,
+ * and futex_wake, to wake sleepers after changing it.
+ *
+ * Waiters are keyed by the physical address of the int, so that the
+ * same word seen through different mappings is the same futex. While
+ * anyone waits on it the page is wired (see vm_wire), so the key
+ * stays good. Waiters hang off one of FUTEX_NBUCKETS hash chains,
+ * each with its own spinlock and wait channel. Reading the int and
+ * going to sleep both happen under the chain's spinlock, and wake
+ * takes the same spinlock, so a wakeup can't slip in between. The int
+ * can be read under a spinlock because the wired page is resident and
+ * reachable through the kernel's direct mapping.
+ *
+ * No two user processes can actually share a futex yet, since there
+ * is no shared memory and fork copies (and futex_wait privatizes) the
+ * page; the sleeping paths are exercised by the kernel test fx1,
+ * with kernel threads sharing an address space.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <thread.h>
+#include <current.h>
+#include <vm.h>
+#include <syscall.h>
+
+#define FUTEX_NBUCKETS 64
+
+struct futex_waiter {
+	paddr_t fw_key;
+	struct thread *fw_thread;
+	struct futex_waiter *fw_next;
+};
+
+struct futex_bucket {
+	struct spinlock fb_lock;
+	struct wchan *fb_wchan;
+	struct futex_waiter *fb_waiters;
+};
+
+static struct futex_bucket futex_buckets[FUTEX_NBUCKETS];
+
+void
+futex_bootstrap(void)
+{
+	unsigned i;
+
+	for (i=0; i<FUTEX_NBUCKETS; i++) {
+		spinlock_init(&futex_buckets[i].fb_lock);
+		futex_buckets[i].fb_wchan = wchan_create("futex");
+		if (futex_buckets[i].fb_wchan == NULL) {
+			panic("futex_bootstrap: Out of memory\n");
+		}
+		futex_buckets[i].fb_waiters = NULL;
+	}
+}
+
+static
+struct futex_bucket *
+futex_bucket(paddr_t key)
+{
+	return &futex_buckets[(key / sizeof(int)) % FUTEX_NBUCKETS];
+}
+
+/*
+ * Sleep if the int at UADDR still contains VAL, until a futex_wake on
+ * it. Returns EAGAIN at once if it doesn't.
+ */
+int
+sys_futex_wait(userptr_t uaddr, int val)
+{
+	struct futex_bucket *fb;
+	struct futex_waiter fw, **fwp;
+	paddr_t key;
+	int result;
+
+	if ((vaddr_t)uaddr % sizeof(int) != 0) {
+		return EINVAL;
+	}
+	if ((vaddr_t)uaddr >= USERSPACETOP) {
+		return EFAULT;
+	}
+
+	result = vm_wire((vaddr_t)uaddr, &key);
+	if (result) {
+		return result;
+	}
+
+	fb = futex_bucket(key);
+	spinlock_acquire(&fb->fb_lock);
+	if (*(volatile int *)PADDR_TO_KVADDR(key) != val) {
+		spinlock_release(&fb->fb_lock);
+		vm_unwire(key);
+		return EAGAIN;
+	}
+
+	/* Go on the end, so waiters are woken in order. */
+	fw.fw_key = key;
+	fw.fw_thread = curthread;
+	fw.fw_next = NULL;
+	for (fwp = &fb->fb_waiters; *fwp != NULL; fwp = &(*fwp)->fw_next) {
+		/* nothing */
+	}
+	*fwp = &fw;
+
+	/* futex_wake takes us off the list before waking us. */
+	do {
+		wchan_sleep(fb->fb_wchan, &fb->fb_lock);
+	} while (fw.fw_thread != NULL);
+	spinlock_release(&fb->fb_lock);
+
+	vm_unwire(key);
+	return 0;
+}
+
+/*
+ * Wake up to N threads waiting on the int at UADDR. Returns the
+ * number woken.
+ */
+int
+sys_futex_wake(userptr_t uaddr, int n, int *retval)
+{
+	struct futex_bucket *fb;
+	struct futex_waiter *fw, **fwp;
+	struct thread *t;
+	paddr_t key;
+	int result, woken;
+
+	if ((vaddr_t)uaddr % sizeof(int) != 0 || n < 0) {
+		return EINVAL;
+	}
+	if ((vaddr_t)uaddr >= USERSPACETOP) {
+		return EFAULT;
+	}
+
+	/* Wiring makes sure we see the same page the waiters do. */
+	result = vm_wire((vaddr_t)uaddr, &key);
+	if (result) {
+		return result;
+	}
+
+	woken = 0;
+	fb = futex_bucket(key);
+	spinlock_acquire(&fb->fb_lock);
+	fwp = &fb->fb_waiters;
+	while (woken < n && (fw = *fwp) != NULL) {
+		if (fw->fw_key != key) {
+			fwp = &fw->fw_next;
+			continue;
+		}
+		*fwp = fw->fw_next;
+		t = fw->fw_thread;
+		/* It can't look at this until we let go of fb_lock. */
+		fw->fw_thread = NULL;
+		wchan_wakethread(fb->fb_wchan, &fb->fb_lock, t);
+		woken++;
+	}
+	spinlock_release(&fb->fb_lock);
+
+	vm_unwire(key);
+	*retval = woken;
+	return 0;
+}
@@ -59,6 +59,7 @@
 #include <addrspace.h>
 #include <vnode.h>
 #include <elf.h>
+#include <kern/stat.h>
 
 /*
  * Load a segment at virtual address VADDR. The segment in memory
@@ -73,6 +74,10 @@
  * executable whose load address is in kernel space. If you should
  * change this code to not use uiomove, be sure to check for this case
  * explicitly.
+ *
+ * With averagevm nothing is read here: the segment is attached to the
+ * file and vm_fault reads in each page when it is first touched, so
+ * the kernel space check and the truncation check are done up front.
  */
 static
 int
@@ -90,6 +95,31 @@ load_segment(struct addrspace *as, struct vnode *v,
 		filesize = memsize;
 	}
 
+#if OPT_AVERAGEVM
+	{
+		struct stat st;
+
+		if (vaddr >= USERSPACETOP || memsize > USERSPACETOP - vaddr) {
+			return EFAULT;
+		}
+
+		result = VOP_STAT(v, &st);
+		if (result) {
+			return result;
+		}
+		if (offset < 0 || offset + (off_t)filesize > st.st_size) {
+			kprintf("ELF: segment past end of file - "
+				"file truncated?\n");
+			return ENOEXEC;
+		}
+
+		DEBUG(DB_EXEC, "ELF: Mapping %lu bytes at 0x%lx\n",
+		      (unsigned long) filesize, (unsigned long) vaddr);
+
+		return as_define_file(as, vaddr, filesize, v, offset);
+	}
+#endif
+
 	DEBUG(DB_EXEC, "ELF: Loading %lu bytes to 0x%lx\n",
 	      (unsigned long) filesize, (unsigned long) vaddr);
 
@@ -38,6 +38,37 @@
 #include <synch.h>
 #include <vfs.h>
 #include <openfile.h>
+#include <objcache.h>
+
+/*
+ * Where openfiles come from. The offset lock and refcount spinlock
+ * are set up once per structure by openfile_ctor.
+ */
+static struct objcache *openfile_cache;
+
+static
+int
+openfile_ctor(void *obj)
+{
+	struct openfile *file = obj;
+
+	file->of_offsetlock = lock_create("openfile");
+	if (file->of_offsetlock == NULL) {
+		return ENOMEM;
+	}
+	spinlock_init(&file->of_reflock);
+	return 0;
+}
+
+static
+void
+openfile_dtor(void *obj)
+{
+	struct openfile *file = obj;
+
+	spinlock_cleanup(&file->of_reflock);
+	lock_destroy(file->of_offsetlock);
+}
 
 /*
  * Constructor for struct openfile.
@@ -53,19 +84,11 @@ openfile_create(struct vnode *vn, int accmode)
 		accmode == O_WRONLY ||
 		accmode == O_RDWR);
 
-	file = kmalloc(sizeof(struct openfile));
+	file = objcache_alloc(openfile_cache);
 	if (file == NULL) {
 		return NULL;
 	}
 
-	file->of_offsetlock = lock_create("openfile");
-	if (file->of_offsetlock == NULL) {
-		kfree(file);
-		return NULL;
-	}
-
-	spinlock_init(&file->of_reflock);
-
 	file->of_vnode = vn;
 	file->of_accmode = accmode;
 	file->of_offset = 0;
@@ -85,9 +108,7 @@ openfile_destroy(struct openfile *file)
 	/* balance vfs_open with vfs_close (not VOP_DECREF) */
 	vfs_close(file->of_vnode);
 
-	spinlock_cleanup(&file->of_reflock);
-	lock_destroy(file->of_offsetlock);
-	kfree(file);
+	objcache_free(openfile_cache, file);
 }
 
 /*
@@ -147,3 +168,16 @@ openfile_decref(struct openfile *file)
 		spinlock_release(&file->of_reflock);
 	}
 }
+
+/*
+ * Set up the openfile allocator.
+ */
+void
+openfile_bootstrap(void)
+{
+	openfile_cache = objcache_create("openfile", sizeof(struct openfile),
+					 0, openfile_ctor, openfile_dtor);
+	if (openfile_cache == NULL) {
+		panic("openfile_bootstrap: Out of memory\n");
+	}
+}
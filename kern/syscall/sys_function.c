@@ -395,6 +395,15 @@ sys_getpid(int *retval) {
 	return 0; 
 }
 
+/*
+ * Restrict the calling thread to the CPUs in MASK (bit N for CPU N).
+ */
+int
+sys_setaffinity(unsigned mask)
+{
+	return thread_setaffinity(mask);
+}
+
 int
 sys___fork( struct trapframe *tf, int *retval) {
 	struct proc *newproc;
@@ -425,55 +434,17 @@ sys___fork( struct trapframe *tf, int *retval) {
 	}
 
 	//copy trapframe
-	struct trapframe *newtf = kmalloc(sizeof(struct trapframe));
+	struct trapframe *newtf = trapframe_dup(tf);
 	if(newtf == NULL){
 		proc_destroy(newproc);
 		return ENOMEM;
 	}
-	
-	newtf->tf_vaddr = tf->tf_vaddr;/* coprocessor 0 vaddr register */
-	newtf->tf_status = tf->tf_status;/* coprocessor 0 status register */
-	newtf->tf_cause = tf->tf_cause;/* coprocessor 0 cause register */
-	newtf->tf_lo = tf->tf_lo;
-	newtf->tf_hi = tf->tf_hi;
-	newtf->tf_ra = tf->tf_ra;		/* Saved register 31 */
-	newtf->tf_at = tf->tf_at;		/* Saved register 1 (AT) */
-	newtf->tf_v0 = tf->tf_v0;		/* Saved register 2 (v0) */
-	newtf->tf_v1 = tf->tf_v1;		/* etc. */
-	newtf->tf_a0 = tf->tf_a0;
-	newtf->tf_a1 = tf->tf_a1;
-	newtf->tf_a2 = tf->tf_a2;
-	newtf->tf_a3 = tf->tf_a3;
-	newtf->tf_t0 = tf->tf_t0;
-	newtf->tf_t1 = tf->tf_t1;
-	newtf->tf_t2 = tf->tf_t2;
-	newtf->tf_t3 = tf->tf_t3;
-	newtf->tf_t4 = tf->tf_t4;
-	newtf->tf_t5 = tf->tf_t5;
-	newtf->tf_t6 = tf->tf_t6;
-	newtf->tf_t7 = tf->tf_t7;
-	newtf->tf_s0 = tf->tf_s0;
-	newtf->tf_s1 = tf->tf_s1;
-	newtf->tf_s2 = tf->tf_s2;
-	newtf->tf_s3 = tf->tf_s3;
-	newtf->tf_s4 = tf->tf_s4;
-	newtf->tf_s5 = tf->tf_s5;
-	newtf->tf_s6 = tf->tf_s6;
-	newtf->tf_s7 = tf->tf_s7;
-	newtf->tf_t8 = tf->tf_t8;
-	newtf->tf_t9 = tf->tf_t9;
-	newtf->tf_k0 = tf->tf_k0;		/* dummy (see exception-mips1.S comments) */
-	newtf->tf_k1 = tf->tf_k1;		/* dummy */
-	newtf->tf_gp = tf->tf_gp;
-	newtf->tf_sp = tf->tf_sp;
-	newtf->tf_s8 = tf->tf_s8;
-	newtf->tf_epc = tf->tf_epc;
 
 	//copy kernel thread
 	err = thread_fork("Child thread", newproc, childthread, (void *)newtf, 0); // need to figure this out
 	if (err) {
 		proc_destroy(newproc);
-		kfree(newtf);
+		trapframe_free(newtf);
 		return err;
 	}
 	//proc_destroy(newproc);
@@ -595,6 +566,7 @@ sys_execv(const char *program, char **args)
 		kfree(argv);
 		as_destroy(as);
 		proc_setas(oldas);
+		as_activate();
 		return err;
 	}
 
@@ -608,6 +580,7 @@ sys_execv(const char *program, char **args)
 		kfree(argv);
 		as_destroy(as);
 		proc_setas(oldas);
+		as_activate();
 		return err;
 	}
 	vfs_close(v);
@@ -622,6 +595,7 @@ sys_execv(const char *program, char **args)
 		kfree(argv);
 		as_destroy(as);
 		proc_setas(oldas);
+		as_activate();
 		return err;
 	}
 
@@ -644,6 +618,7 @@ sys_execv(const char *program, char **args)
 			kfree(argv);
 			as_destroy(as);
 			proc_setas(oldas);
+			as_activate();
 			return err;
 		}
 		temp[i] = stackptr;
@@ -662,6 +637,7 @@ sys_execv(const char *program, char **args)
 		if (err) {
 			as_destroy(as);
 			proc_setas(oldas);
+			as_activate();
 			return err;
 		}
 	}
@@ -751,3 +727,21 @@ sys_exit(int exitcode){
 	//kprintf("exit dapid: %i", exitcode);
 	thread_exit();
 }
+
+int
+sys_sbrk(intptr_t amount, int *retval)
+{
+	struct addrspace *as;
+	vaddr_t oldbreak;
+	int err;
+
+	as = proc_getas();
+	KASSERT(as != NULL);
+
+	err = as_sbrk(as, amount, &oldbreak);
+	if (err) {
+		return err;
+	}
+	*retval = (int)oldbreak;
+	return 0;
+}
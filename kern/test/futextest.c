@@ -0,0 +1,199 @@
+/*
+ * Futex test.
+ *
+ * User processes can't share memory in this system yet, so no user
+ * program can ever get as far as sleeping in futex_wait and being
+ * woken by someone else. Here kernel threads stand in for the user
+ * threads: they all belong to the kernel process, which is given a
+ * small address space for the duration, and they call the system
+ * call functions directly on a word in it.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <thread.h>
+#include <synch.h>
+#include <proc.h>
+#include <addrspace.h>
+#include <copyinout.h>
+#include <syscall.h>
+#include <test.h>
+
+#define FUTEXTEST_VADDR		0x10000000
+#define FUTEXTEST_NWAITERS	4
+
+/* Rounds of futex_wake before giving up on the waiters. */
+#define FUTEXTEST_MAXPOLLS	100000
+
+static struct semaphore *fxdone;
+static volatile int fxresults[FUTEXTEST_NWAITERS];
+
+/* Set if waiters were left asleep, still using the address space. */
+static bool fxstranded;
+
+static
+void
+fxwaiter(void *junk, unsigned long num)
+{
+	(void)junk;
+
+	fxresults[num] = sys_futex_wait((userptr_t)FUTEXTEST_VADDR, 0);
+	V(fxdone);
+}
+
+static
+int
+fxsetword(int val)
+{
+	return copyout(&val, (userptr_t)FUTEXTEST_VADDR, sizeof(val));
+}
+
+/*
+ * Wake the waiters one at a time until NWAITERS have been woken,
+ * yielding in between so they get a chance to go to sleep.
+ */
+static
+int
+fxwakeall(unsigned nwaiters)
+{
+	unsigned total, polls;
+	int n, result;
+
+	total = 0;
+	for (polls = 0; total < nwaiters; polls++) {
+		if (polls == FUTEXTEST_MAXPOLLS) {
+			kprintf("futextest: only %u of %u waiters woken\n",
+				total, nwaiters);
+			return ETIMEDOUT;
+		}
+		result = sys_futex_wake((userptr_t)FUTEXTEST_VADDR, 1, &n);
+		if (result) {
+			kprintf("futextest: futex_wake: %s\n",
+				strerror(result));
+			return result;
+		}
+		if (n > 1) {
+			kprintf("futextest: futex_wake(1) woke %d\n", n);
+			return EINVAL;
+		}
+		total += n;
+		thread_yield();
+	}
+	return 0;
+}
+
+static
+int
+fxrun(void)
+{
+	char name[16];
+	unsigned i;
+	int n, result;
+
+	result = fxsetword(0);
+	if (result) {
+		kprintf("futextest: copyout: %s\n", strerror(result));
+		return result;
+	}
+
+	/* Wrong value: must not sleep. */
+	result = sys_futex_wait((userptr_t)FUTEXTEST_VADDR, 1);
+	if (result != EAGAIN) {
+		kprintf("futextest: futex_wait on a mismatch gave %d\n",
+			result);
+		return EINVAL;
+	}
+
+	/* Misaligned. */
+	result = sys_futex_wait((userptr_t)(FUTEXTEST_VADDR + 1), 0);
+	if (result != EINVAL) {
+		kprintf("futextest: misaligned futex_wait gave %d\n", result);
+		return EINVAL;
+	}
+
+	/* Nobody waiting. */
+	result = sys_futex_wake((userptr_t)FUTEXTEST_VADDR, 1, &n);
+	if (result || n != 0) {
+		kprintf("futextest: futex_wake with no waiters gave %d/%d\n",
+			result, n);
+		return EINVAL;
+	}
+
+	/* Now some that really sleep. */
+	for (i=0; i<FUTEXTEST_NWAITERS; i++) {
+		fxresults[i] = -1;
+		snprintf(name, sizeof(name), "fxwaiter%u", i);
+		result = thread_fork(name, NULL, fxwaiter, NULL, i);
+		if (result) {
+			panic("futextest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+
+	result = fxwakeall(FUTEXTEST_NWAITERS);
+	if (result) {
+		/* Leave the waiters be; we can't clean up after them. */
+		fxstranded = true;
+		return result;
+	}
+	for (i=0; i<FUTEXTEST_NWAITERS; i++) {
+		P(fxdone);
+	}
+	for (i=0; i<FUTEXTEST_NWAITERS; i++) {
+		if (fxresults[i] != 0) {
+			kprintf("futextest: waiter %u got %d\n", i,
+				fxresults[i]);
+			return EINVAL;
+		}
+	}
+	return 0;
+}
+
+int
+futextest(int nargs, char **args)
+{
+	struct addrspace *as, *oldas;
+	int result;
+
+	(void)nargs;
+	(void)args;
+
+	if (fxdone == NULL) {
+		fxdone = sem_create("fxdone", 0);
+		if (fxdone == NULL) {
+			panic("futextest: sem_create failed\n");
+		}
+	}
+
+	if (fxstranded) {
+		kprintf("futextest: an earlier run failed; reboot first\n");
+		return EBUSY;
+	}
+
+	kprintf("Starting futex test...\n");
+
+	as = as_create();
+	if (as == NULL) {
+		return ENOMEM;
+	}
+	result = as_define_region(as, FUTEXTEST_VADDR, PAGE_SIZE, 1, 1, 0);
+	if (result) {
+		as_destroy(as);
+		return result;
+	}
+
+	oldas = proc_setas(as);
+	KASSERT(oldas == NULL);
+	as_activate();
+
+	result = fxrun();
+
+	if (!fxstranded) {
+		proc_setas(NULL);
+		as_deactivate();
+		as_destroy(as);
+	}
+	kprintf("Futex test %s.\n", result ? "failed" : "done");
+	return result;
+}
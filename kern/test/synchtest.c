@@ -34,6 +34,7 @@
 #include <types.h>
 #include <lib.h>
 #include <clock.h>
+#include <cpu.h>
 #include <thread.h>
 #include <synch.h>
 #include <test.h>
@@ -399,3 +400,173 @@ cvtest2(int nargs, char **args)
 	kprintf("cvtest2 done\n");
 	return 0;
 }
+
+////////////////////////////////////////////////////////////
+//
+// Reader-writer lock test.
+//
+// First a mix of readers and writers checks that writers are alone
+// in the lock and that readers always see a consistent set of test
+// values. Then, for 1 up to the number of CPUs, that many threads do
+// nothing but take and drop a read lock, to show how well the read
+// side scales.
+//
+
+#define NRWLOOPS      200
+#define NRWWRITEEVERY 8
+#define NRWREADS      4000
+
+static struct rwlock *testrwlock;
+static struct spinlock rwcountlock = SPINLOCK_INITIALIZER;
+static volatile unsigned rwreaders;
+static volatile unsigned rwwriters;
+
+static
+void
+rwfail(unsigned long num, const char *msg)
+{
+	kprintf("thread %lu: %s\n", num, msg);
+	kprintf("Test failed\n");
+
+	rwlock_release(testrwlock);
+
+	V(donesem);
+	thread_exit();
+}
+
+static
+void
+rwtestthread(void *junk, unsigned long num)
+{
+	bool writer;
+	int i;
+
+	(void)junk;
+
+	for (i=0; i<NRWLOOPS; i++) {
+		writer = (num + i) % NRWWRITEEVERY == 0;
+		if (writer) {
+			rwlock_acquire_write(testrwlock);
+		}
+		else {
+			rwlock_acquire_read(testrwlock);
+		}
+
+		spinlock_acquire(&rwcountlock);
+		if (writer) {
+			rwwriters++;
+		}
+		else {
+			rwreaders++;
+		}
+		if (rwwriters > 1 || (rwwriters > 0 && rwreaders > 0)) {
+			spinlock_release(&rwcountlock);
+			rwfail(num, "Writer not alone in the lock");
+		}
+		spinlock_release(&rwcountlock);
+
+		if (writer) {
+			testval1 = num;
+			thread_yield();
+			testval2 = num*num;
+			testval3 = num%3;
+		}
+		else {
+			thread_yield();
+			if (testval2 != testval1*testval1 ||
+			    testval3 != testval1%3) {
+				rwfail(num, "Reader saw a partial write");
+			}
+		}
+
+		spinlock_acquire(&rwcountlock);
+		if (writer) {
+			rwwriters--;
+		}
+		else {
+			rwreaders--;
+		}
+		spinlock_release(&rwcountlock);
+
+		rwlock_release(testrwlock);
+	}
+	V(donesem);
+}
+
+static
+void
+rwreadthread(void *junk, unsigned long num)
+{
+	int i;
+
+	(void)junk;
+	(void)num;
+
+	for (i=0; i<NRWREADS; i++) {
+		rwlock_acquire_read(testrwlock);
+		(void)testval1;
+		rwlock_release(testrwlock);
+	}
+	V(donesem);
+}
+
+int
+rwtest(int nargs, char **args)
+{
+	struct timespec before, after, diff;
+	unsigned ncpus, n, i;
+	unsigned long ms;
+	int result;
+
+	(void)nargs;
+	(void)args;
+
+	inititems();
+	testrwlock = rwlock_create("testrwlock");
+	if (testrwlock == NULL) {
+		panic("rwtest: rwlock_create failed\n");
+	}
+
+	kprintf("Starting rwlock test...\n");
+
+	testval1 = testval2 = testval3 = 0;
+	for (i=0; i<NTHREADS; i++) {
+		result = thread_fork("rwtest", NULL, rwtestthread, NULL, i);
+		if (result) {
+			panic("rwtest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<NTHREADS; i++) {
+		P(donesem);
+	}
+
+	kprintf("Read-side scaling, %u acquires per thread:\n", NRWREADS);
+	ncpus = cpu_numcpus();
+	for (n=1; n<=ncpus; n++) {
+		gettime(&before);
+		for (i=0; i<n; i++) {
+			result = thread_fork("rwtest", NULL, rwreadthread,
+					     NULL, i);
+			if (result) {
+				panic("rwtest: thread_fork failed: %s\n",
+				      strerror(result));
+			}
+		}
+		for (i=0; i<n; i++) {
+			P(donesem);
+		}
+		gettime(&after);
+
+		timespec_sub(&after, &before, &diff);
+		ms = diff.tv_sec * 1000 + diff.tv_nsec / 1000000;
+		kprintf("    %2u threads: %5lu ms, %lu acquires/s\n", n, ms,
+			n * NRWREADS * 1000UL / (ms > 0 ? ms : 1));
+	}
+
+	rwlock_destroy(testrwlock);
+	testrwlock = NULL;
+
+	kprintf("rwlock test done.\n");
+	return 0;
+}
@@ -31,7 +31,12 @@
  * Thread test code.
  */
 #include <types.h>
+#include <kern/errno.h>
+#include <kern/time.h>
 #include <lib.h>
+#include <cpu.h>
+#include <current.h>
+#include <clock.h>
 #include <thread.h>
 #include <synch.h>
 #include <test.h>
@@ -144,3 +149,236 @@ threadtest2(int nargs, char **args)
 
 	return 0;
 }
+
+/*
+ * Scheduler latency test: with every CPU kept busy by two threads that
+ * never block, see how soon a thread that sleeps gets to run again
+ * after its timer goes off. With a working feedback scheduler the
+ * sleeper stays at a high priority and the hogs sink, so this should
+ * be about a clock tick, not a multiple of the time slice.
+ */
+
+#define LATENCY_SAMPLES	20
+#define LATENCY_NAPNS	20000000	/* 20 ms */
+
+static volatile bool hogs_stop;
+
+static
+void
+hogthread(void *junk, unsigned long num)
+{
+	(void)junk;
+	(void)num;
+
+	while (!hogs_stop) {
+		/* spin */
+	}
+	V(tsem);
+}
+
+int
+threadtest4(int nargs, char **args)
+{
+	struct timespec nap, deadline, now, late;
+	uint64_t latens, totalns, maxns;
+	unsigned i, nhogs;
+	char name[16];
+	int result;
+
+	(void)nargs;
+	(void)args;
+
+	init_sem();
+	kprintf("Starting scheduler latency test...\n");
+
+	hogs_stop = false;
+	nhogs = 2 * cpu_numcpus();
+	for (i=0; i<nhogs; i++) {
+		snprintf(name, sizeof(name), "hog%u", i);
+		result = thread_fork(name, NULL, hogthread, NULL, i);
+		if (result) {
+			panic("threadtest4: thread_fork failed %s)\n",
+			      strerror(result));
+		}
+	}
+
+	nap.tv_sec = 0;
+	nap.tv_nsec = LATENCY_NAPNS;
+	totalns = maxns = 0;
+	for (i=0; i<LATENCY_SAMPLES; i++) {
+		gettime(&now);
+		timespec_add(&now, &nap, &deadline);
+		thread_sleep_until(&deadline);
+		gettime(&now);
+		timespec_sub(&now, &deadline, &late);
+		latens = (uint64_t)late.tv_sec * 1000000000ULL + late.tv_nsec;
+		totalns += latens;
+		if (latens > maxns) {
+			maxns = latens;
+		}
+	}
+
+	hogs_stop = true;
+	for (i=0; i<nhogs; i++) {
+		P(tsem);
+	}
+
+	kprintf("%u hogs, %u samples: wakeup latency avg %llu us, "
+		"max %llu us\n", nhogs, LATENCY_SAMPLES,
+		(unsigned long long)(totalns / LATENCY_SAMPLES / 1000),
+		(unsigned long long)(maxns / 1000));
+	kprintf("Scheduler latency test done.\n");
+
+	return 0;
+}
+
+/*
+ * Fork latency benchmark: time thread_fork of a thread that exits at
+ * once, plus waiting for it to be done, first with the per-CPU thread
+ * caches turned off and then with them on.
+ */
+
+#define FORKBENCH_ROUNDS	1000
+
+static
+void
+forkbenchthread(void *junk, unsigned long num)
+{
+	(void)junk;
+	(void)num;
+
+	V(tsem);
+}
+
+static
+uint64_t
+forkbench(unsigned rounds)
+{
+	struct timespec start, end, diff;
+	unsigned i;
+	int result;
+
+	gettime(&start);
+	for (i=0; i<rounds; i++) {
+		result = thread_fork("forkbench", NULL, forkbenchthread,
+				     NULL, i);
+		if (result) {
+			panic("threadtest5: thread_fork failed %s)\n",
+			      strerror(result));
+		}
+		P(tsem);
+	}
+	gettime(&end);
+
+	timespec_sub(&end, &start, &diff);
+	return ((uint64_t)diff.tv_sec * 1000000000ULL + diff.tv_nsec) / rounds;
+}
+
+int
+threadtest5(int nargs, char **args)
+{
+	uint64_t uncached, cached;
+	unsigned rounds;
+
+	rounds = FORKBENCH_ROUNDS;
+	if (nargs > 1) {
+		rounds = atoi(args[1]);
+		if (rounds == 0) {
+			kprintf("Usage: tt5 [rounds]\n");
+			return EINVAL;
+		}
+	}
+
+	init_sem();
+	kprintf("Starting fork latency benchmark...\n");
+
+	thread_cache_enable(false);
+	uncached = forkbench(rounds);
+	thread_cache_enable(true);
+	/* One round first, so there's something in the cache. */
+	forkbench(1);
+	cached = forkbench(rounds);
+
+	kprintf("%u forks: %llu ns each without thread cache, "
+		"%llu ns with\n", rounds,
+		(unsigned long long)uncached, (unsigned long long)cached);
+	kprintf("Fork latency benchmark done.\n");
+
+	return 0;
+}
+
+/*
+ * Affinity test: move ourselves to each CPU in turn with
+ * thread_setaffinity and check that we got there and that a thread we
+ * fork from there runs there too.
+ */
+
+static volatile unsigned affinity_childcpu;
+
+static
+void
+affinitythread(void *junk, unsigned long num)
+{
+	(void)junk;
+	(void)num;
+
+	affinity_childcpu = curcpu->c_number;
+	V(tsem);
+}
+
+int
+threadtest6(int nargs, char **args)
+{
+	unsigned i, numcpus, here;
+	int result, status;
+
+	(void)nargs;
+	(void)args;
+
+	init_sem();
+	kprintf("Starting affinity test...\n");
+
+	status = 0;
+	numcpus = cpu_numcpus();
+	if (numcpus < 32) {
+		result = thread_setaffinity(1U << numcpus);
+		if (result != EINVAL) {
+			kprintf("Mask with no CPUs: got %d, not EINVAL\n",
+				result);
+			status = EINVAL;
+		}
+	}
+
+	for (i=0; i<numcpus; i++) {
+		result = thread_setaffinity(1U << i);
+		if (result) {
+			kprintf("setaffinity(cpu %u): %s\n", i,
+				strerror(result));
+			status = result;
+			continue;
+		}
+		here = curcpu->c_number;
+		if (here != i) {
+			kprintf("Asked for cpu %u, running on %u\n", i, here);
+			status = EINVAL;
+		}
+
+		result = thread_fork("affinity", NULL, affinitythread,
+				     NULL, i);
+		if (result) {
+			panic("threadtest6: thread_fork failed %s)\n",
+			      strerror(result));
+		}
+		P(tsem);
+		if (affinity_childcpu != i) {
+			kprintf("Child of cpu %u ran on %u\n", i,
+				affinity_childcpu);
+			status = EINVAL;
+		}
+	}
+
+	thread_setaffinity(THREAD_AFFINITY_ALL);
+	kprintf("Affinity test %s.\n", status ? "failed" : "done");
+
+	return status;
+}
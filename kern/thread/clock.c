@@ -30,17 +30,21 @@
 #include <types.h>
 #include <lib.h>
 #include <cpu.h>
+#include <spl.h>
+#include <spinlock.h>
 #include <wchan.h>
 #include <clock.h>
 #include <thread.h>
 #include <current.h>
+#include <mainbus.h>
+#include <platform/maxcpus.h>
 
 /*
  * Time handling.
  *
- * This is pretty primitive. A real kernel will typically have some
- * kind of support for scheduling callbacks to happen at specific
- * points in the future, usually with more resolution that one second.
+ * Callbacks can be scheduled for specific points in the future with
+ * timeouts, which are run from hardclock and so have a resolution of
+ * 1/HZ. (See below.)
  *
  * A real kernel also has to maintain the time of day; in OS/161 we
  * skimp on that because we have a known-good hardware clock.
@@ -50,8 +54,9 @@
  * Timing constants. These should be tuned along with any work done on
  * the scheduler.
  */
-#define SCHEDULE_HARDCLOCKS	4	/* Reschedule every 4 hardclocks. */
-#define MIGRATE_HARDCLOCKS	16	/* Migrate every 16 hardclocks. */
+#define SCHEDULE_HARDCLOCKS	4	/* Time slice is 4 hardclocks. */
+#define BALANCE_HARDCLOCKS	16	/* Balance every 16 hardclocks. */
+#define BOOST_HARDCLOCKS	100	/* Boost priorities every 100. */
 
 /*
  * Once a second, everything waiting on lbolt is awakened by CPU 0.
@@ -59,17 +64,322 @@
 static struct wchan *lbolt;
 static struct spinlock lbolt_lock;
 
+/*
+ * Threads in thread_sleep_until sleep here. Nobody ever wakes the
+ * channel as a whole; each sleeper is woken by its own timeout.
+ */
+static struct wchan *timedsleep;
+static struct spinlock timedsleep_lock;
+
+/*
+ * Timer wheels, one per CPU.
+ *
+ * Time is cut into slots of one hardclock period, counted from the
+ * epoch of gettime. A timeout whose deadline falls in slot S goes in
+ * bucket (S + 1) % TIMER_NSLOTS, so that by the time that slot has
+ * begun the deadline is surely past. Each hardclock runs the buckets
+ * of all slots that have begun since the last one (there may be
+ * several, if ticks were missed); timeouts in them that are not yet
+ * due belong to a later trip around the wheel and are left alone.
+ *
+ * tw_lastslot is only meaningful while tw_count is nonzero; with an
+ * empty wheel, hardclock doesn't even read the clock.
+ */
+#define TIMER_NSLOTS	64
+#define TIMER_SLOTNS	(1000000000ULL / HZ)
+
+#define TO_IDLE		0	/* not on a wheel */
+#define TO_PENDING	1	/* on a wheel, waiting */
+#define TO_FIRING	2	/* taken off, function being called */
+
+struct timerwheel {
+	struct spinlock tw_lock;
+	uint64_t tw_lastslot;			/* last slot run */
+	unsigned tw_count;			/* pending timeouts */
+	struct timeout *tw_buckets[TIMER_NSLOTS];
+};
+
+static struct timerwheel timerwheels[MAXCPUS];
+
 /*
  * Setup.
  */
 void
 hardclock_bootstrap(void)
 {
+	unsigned i, j;
+
 	spinlock_init(&lbolt_lock);
 	lbolt = wchan_create("lbolt");
 	if (lbolt == NULL) {
 		panic("Couldn't create lbolt\n");
 	}
+
+	spinlock_init(&timedsleep_lock);
+	timedsleep = wchan_create("timedsleep");
+	if (timedsleep == NULL) {
+		panic("Couldn't create timedsleep\n");
+	}
+
+	for (i=0; i<MAXCPUS; i++) {
+		spinlock_init(&timerwheels[i].tw_lock);
+		timerwheels[i].tw_lastslot = 0;
+		timerwheels[i].tw_count = 0;
+		for (j=0; j<TIMER_NSLOTS; j++) {
+			timerwheels[i].tw_buckets[j] = NULL;
+		}
+	}
+}
+
+static
+uint64_t
+timespec_to_ns(const struct timespec *ts)
+{
+	return (uint64_t)ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+static
+uint64_t
+timeout_now(void)
+{
+	struct timespec ts;
+
+	gettime(&ts);
+	return timespec_to_ns(&ts);
+}
+
+void
+timeout_init(struct timeout *to, void (*func)(void *), void *arg)
+{
+	to->to_next = NULL;
+	to->to_deadline = 0;
+	to->to_func = func;
+	to->to_arg = arg;
+	to->to_cpu = 0;
+	to->to_bucket = 0;
+	to->to_state = TO_IDLE;
+}
+
+void
+timeout_set(struct timeout *to, const struct timespec *deadline)
+{
+	struct timerwheel *tw;
+	uint64_t slot, now;
+	int spl;
+
+	KASSERT(to->to_state == TO_IDLE);
+
+	to->to_deadline = timespec_to_ns(deadline);
+	now = timeout_now();
+
+	/* Pick the CPU at splhigh so we don't migrate in between. */
+	spl = splhigh();
+	tw = &timerwheels[curcpu->c_number];
+	spinlock_acquire(&tw->tw_lock);
+	if (tw->tw_count == 0) {
+		tw->tw_lastslot = now / TIMER_SLOTNS;
+	}
+	slot = to->to_deadline / TIMER_SLOTNS + 1;
+	if (slot <= tw->tw_lastslot) {
+		/* Already due; run it with the next slot. */
+		slot = tw->tw_lastslot + 1;
+	}
+	to->to_cpu = curcpu->c_number;
+	to->to_bucket = slot % TIMER_NSLOTS;
+	to->to_state = TO_PENDING;
+	to->to_next = tw->tw_buckets[to->to_bucket];
+	tw->tw_buckets[to->to_bucket] = to;
+	tw->tw_count++;
+	spinlock_release(&tw->tw_lock);
+	splx(spl);
+}
+
+bool
+timeout_cancel(struct timeout *to)
+{
+	struct timerwheel *tw;
+	struct timeout **pp;
+
+	/* to_cpu doesn't change until the owner (our caller) resets TO. */
+	tw = &timerwheels[to->to_cpu];
+	while (1) {
+		spinlock_acquire(&tw->tw_lock);
+		if (to->to_state != TO_FIRING) {
+			break;
+		}
+		/* Its function is running on that CPU; wait for it. */
+		spinlock_release(&tw->tw_lock);
+	}
+
+	if (to->to_state == TO_IDLE) {
+		spinlock_release(&tw->tw_lock);
+		return false;
+	}
+
+	pp = &tw->tw_buckets[to->to_bucket];
+	while (*pp != to) {
+		KASSERT(*pp != NULL);
+		pp = &(*pp)->to_next;
+	}
+	*pp = to->to_next;
+	to->to_next = NULL;
+	to->to_state = TO_IDLE;
+	tw->tw_count--;
+	spinlock_release(&tw->tw_lock);
+	return true;
+}
+
+/*
+ * Run the timeouts on this CPU's wheel that have come due. Called
+ * from hardclock.
+ */
+static
+void
+timeout_run(void)
+{
+	struct timerwheel *tw;
+	struct timeout *due, *to, **pp;
+	uint64_t now, slot, endslot;
+
+	tw = &timerwheels[curcpu->c_number];
+	if (tw->tw_count == 0) {
+		/* Only this CPU adds to its wheel, so no lock needed. */
+		return;
+	}
+
+	now = timeout_now();
+	due = NULL;
+
+	spinlock_acquire(&tw->tw_lock);
+	endslot = now / TIMER_SLOTNS;
+	slot = tw->tw_lastslot + 1;
+	if (endslot >= slot + TIMER_NSLOTS) {
+		/* Missed a whole trip around; just do every bucket once. */
+		slot = endslot - TIMER_NSLOTS + 1;
+	}
+	for (; slot <= endslot; slot++) {
+		pp = &tw->tw_buckets[slot % TIMER_NSLOTS];
+		while ((to = *pp) != NULL) {
+			if (to->to_deadline < now) {
+				*pp = to->to_next;
+				to->to_state = TO_FIRING;
+				to->to_next = due;
+				due = to;
+				tw->tw_count--;
+			}
+			else {
+				pp = &to->to_next;
+			}
+		}
+	}
+	if (endslot > tw->tw_lastslot) {
+		tw->tw_lastslot = endslot;
+	}
+	spinlock_release(&tw->tw_lock);
+
+	/*
+	 * Call the functions without the wheel lock, so they can use
+	 * timeouts themselves. Once a timeout is marked idle its owner
+	 * may free it, so get the next one first.
+	 */
+	while (due != NULL) {
+		to = due;
+		due = to->to_next;
+		to->to_func(to->to_arg);
+
+		spinlock_acquire(&tw->tw_lock);
+		to->to_next = NULL;
+		to->to_state = TO_IDLE;
+		spinlock_release(&tw->tw_lock);
+	}
+}
+
+/*
+ * Return the time at which the earliest timeout on this CPU's wheel
+ * can run, or 0 if there aren't any. That's the start of the slot
+ * after the one with its deadline (see above).
+ */
+static
+uint64_t
+timeout_next(void)
+{
+	struct timerwheel *tw;
+	struct timeout *to;
+	uint64_t first;
+	unsigned i;
+
+	tw = &timerwheels[curcpu->c_number];
+	if (tw->tw_count == 0) {
+		return 0;
+	}
+
+	first = 0;
+	spinlock_acquire(&tw->tw_lock);
+	for (i=0; i<TIMER_NSLOTS; i++) {
+		for (to = tw->tw_buckets[i]; to != NULL; to = to->to_next) {
+			if (first == 0 || to->to_deadline < first) {
+				first = to->to_deadline;
+			}
+		}
+	}
+	spinlock_release(&tw->tw_lock);
+
+	if (first == 0) {
+		return 0;
+	}
+	return (first / TIMER_SLOTNS + 1) * TIMER_SLOTNS;
+}
+
+void
+hardclock_idle(void)
+{
+	uint64_t now, next;
+
+	KASSERT(curthread->t_curspl > 0);
+
+	/*
+	 * Until this CPU has taken a tick, the clock may not be
+	 * attached yet (and the timer isn't ticking anyway).
+	 */
+	if (curcpu->c_hardclocks == 0) {
+		return;
+	}
+
+	now = timeout_now();
+	if (!curcpu->c_tickless) {
+		curcpu->c_tickless = true;
+		curcpu->c_tickstopped = now;
+	}
+
+	next = timeout_next();
+	if (next == 0) {
+		/* Nothing to wake up for but IPIs and devices. */
+		mainbus_tick_stop(~(uint64_t)0);
+	}
+	else {
+		mainbus_tick_stop(next > now ? next - now : 0);
+	}
+}
+
+void
+hardclock_unidle(void)
+{
+	uint64_t now;
+
+	KASSERT(curthread->t_curspl > 0);
+
+	if (!curcpu->c_tickless) {
+		return;
+	}
+
+	/* Count the ticks we skipped, so c_hardclocks still tells time. */
+	now = timeout_now();
+	if (now > curcpu->c_tickstopped) {
+		curcpu->c_hardclocks +=
+			(now - curcpu->c_tickstopped) / TIMER_SLOTNS;
+	}
+	curcpu->c_tickless = false;
+	mainbus_tick_start();
 }
 
 /*
@@ -92,18 +402,31 @@ timerclock(void)
 void
 hardclock(void)
 {
+	if (curcpu->c_tickless) {
+		/*
+		 * Idle, and woken only to run a timeout (see
+		 * hardclock_idle). There's no thread to charge or
+		 * balance; the idle loop stops the tick again.
+		 */
+		timeout_run();
+		return;
+	}
+
 	/*
 	 * Collect statistics here as desired.
 	 */
 
 	curcpu->c_hardclocks++;
-	if ((curcpu->c_hardclocks % MIGRATE_HARDCLOCKS) == 0) {
-		thread_consider_migration();
+	timeout_run();
+	if ((curcpu->c_hardclocks % BALANCE_HARDCLOCKS) == 0) {
+		thread_balance();
 	}
-	if ((curcpu->c_hardclocks % SCHEDULE_HARDCLOCKS) == 0) {
+	if ((curcpu->c_hardclocks % BOOST_HARDCLOCKS) == 0) {
 		schedule();
 	}
-	thread_yield();
+	if (thread_tick(SCHEDULE_HARDCLOCKS)) {
+		thread_yield();
+	}
 }
 
 /*
@@ -119,3 +442,17 @@ clocksleep(int num_secs)
 	}
 	spinlock_release(&lbolt_lock);
 }
+
+/*
+ * Suspend execution until DEADLINE.
+ */
+void
+thread_sleep_until(const struct timespec *deadline)
+{
+	spinlock_acquire(&timedsleep_lock);
+	while (wchan_sleep_until(timedsleep, &timedsleep_lock,
+				 deadline) == 0) {
+		/* Nobody else wakes timedsleep; go back to sleep. */
+	}
+	spinlock_release(&timedsleep_lock);
+}
@@ -0,0 +1,238 @@
+/*
+ * Lock contention profiler (see lockprof.h).
+ *
+ * Records live in a fixed hash table keyed by kind and name, with
+ * linear probing. A record is claimed, under lockprof_tablelock, the
+ * first time a lock or CV with its name is created and is never
+ * given back; the counters in it are protected by its own spinlock so
+ * that profiling one busy lock doesn't serialize all the others.
+ */
+
+#include <types.h>
+#include <kern/time.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <clock.h>
+#include <lockprof.h>
+
+/* Number of distinct names we can keep track of. */
+#define LOCKPROF_NSLOTS 256
+
+/* Longer names are cut short (and may then share a record). */
+#define LOCKPROF_NAMELEN 24
+
+struct lockprof {
+	int lp_kind;			/* LOCKPROF_LOCK or LOCKPROF_CV */
+	char lp_name[LOCKPROF_NAMELEN];	/* empty if the slot is free */
+	struct spinlock lp_lock;	/* protects the counters */
+	unsigned lp_acquires;
+	unsigned lp_contended;
+	unsigned lp_spins;
+	unsigned lp_sleeps;
+	uint64_t lp_waitns;
+	uint64_t lp_maxholdns;
+};
+
+static struct spinlock lockprof_tablelock = SPINLOCK_INITIALIZER;
+static struct lockprof lockprof_table[LOCKPROF_NSLOTS];
+static unsigned lockprof_nslots;	/* slots in use */
+static unsigned lockprof_dropped;	/* names that didn't fit */
+
+/* Set once gettime can be called. */
+static volatile bool lockprof_clockready;
+
+/*
+ * Call once the clock device has been attached.
+ */
+void
+lockprof_bootstrap(void)
+{
+	unsigned i;
+
+	for (i=0; i<LOCKPROF_NSLOTS; i++) {
+		spinlock_init(&lockprof_table[i].lp_lock);
+	}
+	lockprof_clockready = true;
+}
+
+static
+unsigned
+lockprof_hash(int kind, const char *name)
+{
+	unsigned h = kind;
+
+	for (; *name != 0; name++) {
+		h = h*33 + (unsigned char)*name;
+	}
+	return h % LOCKPROF_NSLOTS;
+}
+
+struct lockprof *
+lockprof_get(int kind, const char *name)
+{
+	char key[LOCKPROF_NAMELEN];
+	struct lockprof *lp;
+	unsigned i, n;
+
+	KASSERT(kind == LOCKPROF_LOCK || kind == LOCKPROF_CV);
+
+	for (i=0; i<LOCKPROF_NAMELEN-1 && name[i] != 0; i++) {
+		key[i] = name[i];
+	}
+	key[i] = 0;
+	if (key[0] == 0) {
+		return NULL;
+	}
+
+	spinlock_acquire(&lockprof_tablelock);
+	i = lockprof_hash(kind, key);
+	for (n=0; n<LOCKPROF_NSLOTS; n++) {
+		lp = &lockprof_table[(i + n) % LOCKPROF_NSLOTS];
+		if (lp->lp_name[0] == 0) {
+			lp->lp_kind = kind;
+			strcpy(lp->lp_name, key);
+			lockprof_nslots++;
+			break;
+		}
+		if (lp->lp_kind == kind && !strcmp(lp->lp_name, key)) {
+			break;
+		}
+	}
+	if (n == LOCKPROF_NSLOTS) {
+		lockprof_dropped++;
+		lp = NULL;
+	}
+	spinlock_release(&lockprof_tablelock);
+	return lp;
+}
+
+uint64_t
+lockprof_now(void)
+{
+	struct timespec ts;
+
+	if (!lockprof_clockready) {
+		return 0;
+	}
+	gettime(&ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void
+lockprof_acquired(struct lockprof *lp, bool contended,
+		  unsigned spins, unsigned sleeps,
+		  uint64_t waitstart, uint64_t now)
+{
+	if (lp == NULL || !lockprof_clockready) {
+		return;
+	}
+
+	spinlock_acquire(&lp->lp_lock);
+	lp->lp_acquires++;
+	lp->lp_spins += spins;
+	lp->lp_sleeps += sleeps;
+	if (contended) {
+		lp->lp_contended++;
+		/* Not timed if the wait began before the clock was up. */
+		if (waitstart != 0 && now > waitstart) {
+			lp->lp_waitns += now - waitstart;
+		}
+	}
+	spinlock_release(&lp->lp_lock);
+}
+
+void
+lockprof_released(struct lockprof *lp, uint64_t acquiredat, uint64_t now)
+{
+	if (lp == NULL || acquiredat == 0 || now <= acquiredat) {
+		return;
+	}
+
+	spinlock_acquire(&lp->lp_lock);
+	if (now - acquiredat > lp->lp_maxholdns) {
+		lp->lp_maxholdns = now - acquiredat;
+	}
+	spinlock_release(&lp->lp_lock);
+}
+
+/*
+ * Print the N records with the most wait time, and reset everything.
+ * The counters of each record are copied and zeroed in one step, so
+ * nothing counted in between is lost; the printing is done from the
+ * copies, without any spinlocks held.
+ */
+void
+lockprof_print(unsigned n)
+{
+	struct lockprof *snap, *lp, *best;
+	unsigned i, j, nsnap, dropped;
+
+	if (!lockprof_clockready) {
+		kprintf("lockprof: not started yet\n");
+		return;
+	}
+
+	snap = kmalloc(LOCKPROF_NSLOTS * sizeof(*snap));
+	if (snap == NULL) {
+		kprintf("lockprof: out of memory\n");
+		return;
+	}
+
+	nsnap = 0;
+	for (i=0; i<LOCKPROF_NSLOTS; i++) {
+		lp = &lockprof_table[i];
+		spinlock_acquire(&lp->lp_lock);
+		if (lp->lp_name[0] != 0 && lp->lp_acquires > 0) {
+			snap[nsnap].lp_kind = lp->lp_kind;
+			strcpy(snap[nsnap].lp_name, lp->lp_name);
+			snap[nsnap].lp_acquires = lp->lp_acquires;
+			snap[nsnap].lp_contended = lp->lp_contended;
+			snap[nsnap].lp_spins = lp->lp_spins;
+			snap[nsnap].lp_sleeps = lp->lp_sleeps;
+			snap[nsnap].lp_waitns = lp->lp_waitns;
+			snap[nsnap].lp_maxholdns = lp->lp_maxholdns;
+			nsnap++;
+		}
+		lp->lp_acquires = 0;
+		lp->lp_contended = 0;
+		lp->lp_spins = 0;
+		lp->lp_sleeps = 0;
+		lp->lp_waitns = 0;
+		lp->lp_maxholdns = 0;
+		spinlock_release(&lp->lp_lock);
+	}
+
+	spinlock_acquire(&lockprof_tablelock);
+	dropped = lockprof_dropped;
+	j = lockprof_nslots;
+	spinlock_release(&lockprof_tablelock);
+
+	kprintf("lockprof: %u names in use, %u turned away\n", j, dropped);
+	kprintf("%-4s %-23s %9s %9s %8s %8s %11s %11s\n", "kind", "name",
+		"acquires", "contended", "spins", "sleeps", "wait(us)",
+		"maxhold(us)");
+
+	/* Selection by wait time; N is small. */
+	for (i=0; i<n && i<nsnap; i++) {
+		best = &snap[i];
+		for (j=i+1; j<nsnap; j++) {
+			if (snap[j].lp_waitns > best->lp_waitns) {
+				best = &snap[j];
+			}
+		}
+		if (best != &snap[i]) {
+			struct lockprof tmp = snap[i];
+			snap[i] = *best;
+			*best = tmp;
+		}
+		lp = &snap[i];
+		kprintf("%-4s %-23s %9u %9u %8u %8u %11llu %11llu\n",
+			lp->lp_kind == LOCKPROF_CV ? "cv" : "lock",
+			lp->lp_name, lp->lp_acquires, lp->lp_contended,
+			lp->lp_spins, lp->lp_sleeps,
+			(unsigned long long)(lp->lp_waitns / 1000),
+			(unsigned long long)(lp->lp_maxholdns / 1000));
+	}
+
+	kfree(snap);
+}
@@ -50,8 +50,12 @@
 void
 spinlock_init(struct spinlock *splk)
 {
-	spinlock_data_set(&splk->splk_lock, 0);
+	spinlock_data_set(&splk->splk_next, 0);
+	spinlock_data_set(&splk->splk_serving, 0);
 	splk->splk_holder = NULL;
+	splk->splk_acquires = 0;
+	splk->splk_contended = 0;
+	splk->splk_spins = 0;
 }
 
 /*
@@ -61,20 +65,41 @@ void
 spinlock_cleanup(struct spinlock *splk)
 {
 	KASSERT(splk->splk_holder == NULL);
-	KASSERT(spinlock_data_get(&splk->splk_lock) == 0);
+	KASSERT(spinlock_data_get(&splk->splk_next) ==
+		spinlock_data_get(&splk->splk_serving));
 }
 
 /*
- * Get the lock.
+ * Note that we now hold the lock, after polling it SPINS times.
+ */
+static
+void
+spinlock_gotit(struct spinlock *splk, struct cpu *mycpu, unsigned spins)
+{
+	membar_store_any();
+	splk->splk_holder = mycpu;
+
+	/* The lock protects its own counters. */
+	splk->splk_acquires++;
+	if (spins > 0) {
+		splk->splk_contended++;
+		splk->splk_spins += spins;
+	}
+}
+
+/*
+ * Get the lock, returning how many times we polled it while waiting.
  *
  * First disable interrupts (otherwise, if we get a timer interrupt we
- * might come back to this lock and deadlock), then use a machine-level
- * atomic operation to wait for the lock to be free.
+ * might come back to this lock and deadlock), then take a ticket and
+ * wait for it to come up.
  */
-void
-spinlock_acquire(struct spinlock *splk)
+unsigned
+spinlock_acquire_spins(struct spinlock *splk)
 {
 	struct cpu *mycpu;
+	spinlock_data_t ticket;
+	unsigned spins;
 
 	splraise(IPL_NONE, IPL_HIGH);
 
@@ -90,32 +115,73 @@ spinlock_acquire(struct spinlock *splk)
 		mycpu = NULL;
 	}
 
-	while (1) {
-		/*
-		 * Do test-test-and-set, that is, read first before
-		 * doing test-and-set, to reduce bus contention.
-		 *
-		 * Test-and-set is a machine-level atomic operation
-		 * that writes 1 into the lock word and returns the
-		 * previous value. If that value was 0, the lock was
-		 * previously unheld and we now own it. If it was 1,
-		 * we don't.
-		 */
-		if (spinlock_data_get(&splk->splk_lock) != 0) {
-			continue;
-		}
-		if (spinlock_data_testandset(&splk->splk_lock) != 0) {
-			continue;
+	/*
+	 * Taking a ticket is the only atomic operation; after that
+	 * each waiter only reads splk_serving, which changes just once
+	 * per release.
+	 */
+	ticket = spinlock_data_fetchinc(&splk->splk_next);
+	spins = 0;
+	while (spinlock_data_get(&splk->splk_serving) != ticket) {
+		spins++;
+	}
+
+	spinlock_gotit(splk, mycpu, spins);
+	return spins;
+}
+
+/*
+ * Get the lock.
+ */
+void
+spinlock_acquire(struct spinlock *splk)
+{
+	(void)spinlock_acquire_spins(splk);
+}
+
+/*
+ * Get the lock if it's free right now; return false without waiting
+ * if it isn't. The lock is free when no ticket beyond the one being
+ * served has been handed out, and we take it by handing out the next
+ * ticket to ourselves.
+ */
+bool
+spinlock_tryacquire(struct spinlock *splk)
+{
+	struct cpu *mycpu;
+	spinlock_data_t serving;
+
+	splraise(IPL_NONE, IPL_HIGH);
+
+	/* this must work before curcpu initialization */
+	if (CURCPU_EXISTS()) {
+		mycpu = curcpu->c_self;
+		if (splk->splk_holder == mycpu) {
+			panic("Deadlock on spinlock %p\n", splk);
 		}
-		break;
+	}
+	else {
+		mycpu = NULL;
 	}
 
-	membar_store_any();
-	splk->splk_holder = mycpu;
+	serving = spinlock_data_get(&splk->splk_serving);
+	if (spinlock_data_get(&splk->splk_next) != serving ||
+	    !spinlock_data_compareandset(&splk->splk_next, serving,
+					 serving + 1)) {
+		spllower(IPL_HIGH, IPL_NONE);
+		return false;
+	}
+
+	if (mycpu != NULL) {
+		mycpu->c_spinlocks++;
+	}
+	spinlock_gotit(splk, mycpu, 0);
+	return true;
 }
 
 /*
- * Release the lock.
+ * Release the lock, letting in the next ticket. Only the holder
+ * writes splk_serving, so it needs no atomic operation.
  */
 void
 spinlock_release(struct spinlock *splk)
@@ -129,7 +195,8 @@ spinlock_release(struct spinlock *splk)
 
 	splk->splk_holder = NULL;
 	membar_any_store();
-	spinlock_data_set(&splk->splk_lock, 0);
+	spinlock_data_set(&splk->splk_serving,
+			  spinlock_data_get(&splk->splk_serving) + 1);
 	spllower(IPL_HIGH, IPL_NONE);
 }
 
@@ -146,3 +213,57 @@ spinlock_do_i_hold(struct spinlock *splk)
 	/* Assume we can read splk_holder atomically enough for this to work */
 	return (splk->splk_holder == curcpu->c_self);
 }
+
+/*
+ * Table of named spinlocks whose counters spinlock_printstats shows.
+ */
+#define SPINLOCK_MAXREG 32
+#define SPINLOCK_NAMELEN 16
+
+static struct {
+	struct spinlock *sr_lock;
+	char sr_name[SPINLOCK_NAMELEN];
+} spinlock_reg[SPINLOCK_MAXREG];
+static unsigned spinlock_nreg;
+static struct spinlock spinlock_reglock = SPINLOCK_INITIALIZER;
+
+/*
+ * Add a lock to the table. If the table is full the lock just isn't
+ * listed.
+ */
+void
+spinlock_register(struct spinlock *splk, const char *name)
+{
+	spinlock_acquire(&spinlock_reglock);
+	if (spinlock_nreg < SPINLOCK_MAXREG) {
+		spinlock_reg[spinlock_nreg].sr_lock = splk;
+		snprintf(spinlock_reg[spinlock_nreg].sr_name,
+			 SPINLOCK_NAMELEN, "%s", name);
+		spinlock_nreg++;
+	}
+	spinlock_release(&spinlock_reglock);
+}
+
+/*
+ * Print the counters of the registered locks. They are read without
+ * the locks themselves, so each line may be slightly out of date.
+ */
+void
+spinlock_printstats(void)
+{
+	struct spinlock *splk;
+	unsigned i, n;
+
+	spinlock_acquire(&spinlock_reglock);
+	n = spinlock_nreg;
+	spinlock_release(&spinlock_reglock);
+
+	kprintf("%-16s %10s %10s %14s\n", "spinlock", "acquires",
+		"contended", "spins");
+	for (i=0; i<n; i++) {
+		splk = spinlock_reg[i].sr_lock;
+		kprintf("%-16s %10u %10u %14llu\n", spinlock_reg[i].sr_name,
+			splk->splk_acquires, splk->splk_contended,
+			(unsigned long long)splk->splk_spins);
+	}
+}
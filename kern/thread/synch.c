@@ -33,12 +33,15 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <spinlock.h>
 #include <wchan.h>
 #include <thread.h>
+#include <cpu.h>
 #include <current.h>
 #include <synch.h>
+#include <objcache.h>
 
 ////////////////////////////////////////////////////////////
 //
@@ -120,6 +123,29 @@ P(struct semaphore *sem)
 	spinlock_release(&sem->sem_lock);
 }
 
+int
+sem_timedP(struct semaphore *sem, const struct timespec *deadline)
+{
+	int result = 0;
+
+        KASSERT(sem != NULL);
+        KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&sem->sem_lock);
+        while (sem->sem_count == 0 && result == 0) {
+		result = wchan_sleep_until(sem->sem_wchan, &sem->sem_lock,
+					   deadline);
+        }
+	/* Take it even if the deadline passed, if it's there now. */
+	if (sem->sem_count > 0) {
+		sem->sem_count--;
+		result = 0;
+	}
+	spinlock_release(&sem->sem_lock);
+
+	return result;
+}
+
 void
 V(struct semaphore *sem)
 {
@@ -138,30 +164,59 @@ V(struct semaphore *sem)
 //
 // Lock.
 
+/*
+ * Locks come from an object cache, so the wait channel and spinlock
+ * are only set up once per lock structure, not once per lock_create.
+ * A free lock is unheld and its wait channel is named "lock".
+ */
+static struct objcache *lock_cache;
+
+static
+int
+lock_ctor(void *obj)
+{
+	struct lock *lock = obj;
+
+	lock->lk_name = NULL;
+	lock->lk_wchan = wchan_create("lock");
+	if (lock->lk_wchan == NULL) {
+		return ENOMEM;
+	}
+	spinlock_init(&lock->lk_lock);
+	lock->lk_holder = NULL;
+	return 0;
+}
+
+static
+void
+lock_dtor(void *obj)
+{
+	struct lock *lock = obj;
+
+	spinlock_cleanup(&lock->lk_lock);
+	wchan_destroy(lock->lk_wchan);
+}
+
 struct lock *
 lock_create(const char *name)
 {
         struct lock *lock;
 
-        lock = kmalloc(sizeof(struct lock));
+        lock = objcache_alloc(lock_cache);
         if (lock == NULL) {
                 return NULL;
         }
 
         lock->lk_name = kstrdup(name);
         if (lock->lk_name == NULL) {
-                kfree(lock);
+                objcache_free(lock_cache, lock);
                 return NULL;
         }
-
-	lock->lk_wchan = wchan_create(lock->lk_name);
-	if (lock->lk_wchan == NULL) {
-		kfree(lock->lk_name);
-		kfree(lock);
-		return NULL;
-	}
-	spinlock_init(&lock->lk_lock);
-	lock->lk_holder = NULL;
+	wchan_setname(lock->lk_wchan, lock->lk_name);
+#if OPT_LOCKPROF
+	lock->lk_prof = lockprof_get(LOCKPROF_LOCK, lock->lk_name);
+	lock->lk_acquiredat = 0;
+#endif
 
         return lock;
 }
@@ -172,26 +227,98 @@ lock_destroy(struct lock *lock)
         KASSERT(lock != NULL);
 
 	KASSERT(lock->lk_holder == NULL);
-	spinlock_cleanup(&lock->lk_lock);
-	wchan_destroy(lock->lk_wchan);
+	wchan_setname(lock->lk_wchan, "lock");
 
         kfree(lock->lk_name);
-        kfree(lock);
+        lock->lk_name = NULL;
+        objcache_free(lock_cache, lock);
 }
 
+/*
+ * How many times lock_acquire polls a held lock, in all, before it
+ * gives up on spinning and sleeps.
+ */
+#define LOCK_MAXSPIN 1000
+
+/*
+ * Check if HOLDER, last seen running on CPU C, is still running there
+ * right now, so that it may well let go of the lock soon. Being C's
+ * c_curthread isn't enough: a thread that has gone to sleep stays
+ * c_curthread while its CPU sits in the idle loop.
+ *
+ * This is called without the lock's spinlock held, when HOLDER may
+ * already have exited and been freed, so it looks only at C, which
+ * lives forever, and never dereferences HOLDER. The fields are read
+ * through volatile so the polling loop sees them change.
+ */
+static
+bool
+lock_holder_running(struct cpu *c, struct thread *holder)
+{
+	return !*(volatile bool *)&c->c_isidle &&
+		*(struct thread *volatile *)&c->c_curthread == holder;
+}
 void
 lock_acquire(struct lock *lock)
 {
+	struct thread *holder;
+	struct cpu *c;
+	unsigned spins;
+#if OPT_LOCKPROF
+	bool contended = false;
+	uint64_t waitstart = 0, now;
+	unsigned nspins = 0, nsleeps = 0;
+#endif
+
 	DEBUGASSERT(lock != NULL);
         KASSERT(curthread->t_in_interrupt == false);
 	spinlock_acquire(&lock->lk_lock);
 	KASSERT(lock->lk_holder != curthread);
+	spins = LOCK_MAXSPIN;
 	while (lock->lk_holder != NULL) {
+#if OPT_LOCKPROF
+		if (!contended) {
+			contended = true;
+			waitstart = lockprof_now();
+		}
+#endif
+		/*
+		 * HOLDER can't go away while we hold lk_lock, so this
+		 * is the only place it's safe to look inside it.
+		 */
+		holder = lock->lk_holder;
+		c = holder->t_cpu;
+		if (spins > 0 && holder->t_state == S_RUN &&
+		    c != curcpu->c_self && lock_holder_running(c, holder)) {
+			/*
+			 * Poll without the spinlock so the holder can
+			 * let go, and stop if it goes to sleep.
+			 */
+#if OPT_LOCKPROF
+			nspins++;
+#endif
+			spinlock_release(&lock->lk_lock);
+			while (spins > 0 && lock->lk_holder == holder &&
+			       lock_holder_running(c, holder)) {
+				spins--;
+			}
+			spinlock_acquire(&lock->lk_lock);
+			continue;
+		}
 		/* As in the semaphore. */
+#if OPT_LOCKPROF
+		nsleeps++;
+#endif
                 wchan_sleep(lock->lk_wchan, &lock->lk_lock);
 	}
 	lock->lk_holder = curthread;
 	spinlock_release(&lock->lk_lock);
+#if OPT_LOCKPROF
+	now = lockprof_now();
+	lock->lk_acquiredat = now;
+	lockprof_acquired(lock->lk_prof, contended, nspins, nsleeps,
+			  waitstart, now);
+#endif
 }
 
 void
@@ -199,6 +326,10 @@ lock_release(struct lock *lock)
 {
 	DEBUGASSERT(lock != NULL);
 
+#if OPT_LOCKPROF
+	KASSERT(lock->lk_holder == curthread);
+	lockprof_released(lock->lk_prof, lock->lk_acquiredat, lockprof_now());
+#endif
 	spinlock_acquire(&lock->lk_lock);
 	KASSERT(lock->lk_holder == curthread);
 	lock->lk_holder = NULL;
@@ -249,6 +380,9 @@ cv_create(const char *name)
 	}
 
 	spinlock_init(&cv->cv_wchanlock);
+#if OPT_LOCKPROF
+	cv->cv_prof = lockprof_get(LOCKPROF_CV, cv->cv_name);
+#endif
         return cv;
 }
 
@@ -267,6 +401,10 @@ cv_destroy(struct cv *cv)
 void
 cv_wait(struct cv *cv, struct lock *lock)
 {
+#if OPT_LOCKPROF
+	uint64_t waitstart = lockprof_now();
+#endif
+
 	spinlock_acquire(&cv->cv_wchanlock);
 	lock_release(lock);
 	wchan_sleep(cv->cv_wchan, &cv->cv_wchanlock);
@@ -279,9 +417,33 @@ cv_wait(struct cv *cv, struct lock *lock)
 	 * logic to make that work cleanly.
 	 */
 	spinlock_release(&cv->cv_wchanlock);
+#if OPT_LOCKPROF
+	lockprof_acquired(cv->cv_prof, true, 0, 1, waitstart, lockprof_now());
+#endif
 	lock_acquire(lock);
 }
 
+int
+cv_timedwait(struct cv *cv, struct lock *lock,
+	     const struct timespec *deadline)
+{
+	int result;
+#if OPT_LOCKPROF
+	uint64_t waitstart = lockprof_now();
+#endif
+
+	spinlock_acquire(&cv->cv_wchanlock);
+	lock_release(lock);
+	result = wchan_sleep_until(cv->cv_wchan, &cv->cv_wchanlock, deadline);
+	spinlock_release(&cv->cv_wchanlock);
+#if OPT_LOCKPROF
+	lockprof_acquired(cv->cv_prof, true, 0, 1, waitstart, lockprof_now());
+#endif
+	lock_acquire(lock);
+
+	return result;
+}
+
 void
 cv_signal(struct cv *cv, struct lock *lock)
 {
@@ -300,3 +462,160 @@ cv_broadcast(struct cv *cv, struct lock *lock)
 	spinlock_release(&cv->cv_wchanlock);
 }
 
+////////////////////////////////////////////////////////////
+//
+// Reader-writer lock.
+
+struct rwlock *
+rwlock_create(const char *name)
+{
+	struct rwlock *rw;
+
+	rw = kmalloc(sizeof(struct rwlock));
+	if (rw == NULL) {
+		return NULL;
+	}
+
+	rw->rwlock_name = kstrdup(name);
+	if (rw->rwlock_name == NULL) {
+		kfree(rw);
+		return NULL;
+	}
+
+	rw->rw_readwchan = wchan_create(rw->rwlock_name);
+	if (rw->rw_readwchan == NULL) {
+		kfree(rw->rwlock_name);
+		kfree(rw);
+		return NULL;
+	}
+
+	rw->rw_writewchan = wchan_create(rw->rwlock_name);
+	if (rw->rw_writewchan == NULL) {
+		wchan_destroy(rw->rw_readwchan);
+		kfree(rw->rwlock_name);
+		kfree(rw);
+		return NULL;
+	}
+
+	spinlock_init(&rw->rw_lock);
+	rw->rw_readers = 0;
+	rw->rw_waitingwriters = 0;
+	rw->rw_writer = NULL;
+
+	return rw;
+}
+
+void
+rwlock_destroy(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+	KASSERT(rw->rw_readers == 0);
+	KASSERT(rw->rw_writer == NULL);
+	KASSERT(rw->rw_waitingwriters == 0);
+
+	/* wchan_destroy will assert if anyone's waiting on them */
+	spinlock_cleanup(&rw->rw_lock);
+	wchan_destroy(rw->rw_writewchan);
+	wchan_destroy(rw->rw_readwchan);
+	kfree(rw->rwlock_name);
+	kfree(rw);
+}
+
+void
+rwlock_acquire_read(struct rwlock *rw)
+{
+	DEBUGASSERT(rw != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_writer != curthread);
+	/* Wait behind waiting writers too; that's the writer preference. */
+	while (rw->rw_writer != NULL || rw->rw_waitingwriters > 0) {
+		wchan_sleep(rw->rw_readwchan, &rw->rw_lock);
+	}
+	rw->rw_readers++;
+	spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_acquire_write(struct rwlock *rw)
+{
+	DEBUGASSERT(rw != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_writer != curthread);
+	while (rw->rw_writer != NULL || rw->rw_readers > 0) {
+		rw->rw_waitingwriters++;
+		wchan_sleep(rw->rw_writewchan, &rw->rw_lock);
+		rw->rw_waitingwriters--;
+	}
+	rw->rw_writer = curthread;
+	spinlock_release(&rw->rw_lock);
+}
+
+/*
+ * Let in whoever should come next: a writer if one is waiting and the
+ * lock is free, otherwise, if no writer is waiting, all the readers.
+ */
+static
+void
+rwlock_wakeup(struct rwlock *rw)
+{
+	KASSERT(spinlock_do_i_hold(&rw->rw_lock));
+
+	if (rw->rw_waitingwriters > 0) {
+		if (rw->rw_writer == NULL && rw->rw_readers == 0) {
+			wchan_wakeone(rw->rw_writewchan, &rw->rw_lock);
+		}
+	}
+	else {
+		wchan_wakeall(rw->rw_readwchan, &rw->rw_lock);
+	}
+}
+
+void
+rwlock_release(struct rwlock *rw)
+{
+	DEBUGASSERT(rw != NULL);
+
+	spinlock_acquire(&rw->rw_lock);
+	if (rw->rw_writer != NULL) {
+		KASSERT(rw->rw_writer == curthread);
+		KASSERT(rw->rw_readers == 0);
+		rw->rw_writer = NULL;
+	}
+	else {
+		KASSERT(rw->rw_readers > 0);
+		rw->rw_readers--;
+	}
+	rwlock_wakeup(rw);
+	spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_downgrade(struct rwlock *rw)
+{
+	DEBUGASSERT(rw != NULL);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_writer == curthread);
+	rw->rw_writer = NULL;
+	rw->rw_readers = 1;
+	rwlock_wakeup(rw);
+	spinlock_release(&rw->rw_lock);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Setup
+
+void
+synch_bootstrap(void)
+{
+	lock_cache = objcache_create("lock", sizeof(struct lock), 0,
+				     lock_ctor, lock_dtor);
+	if (lock_cache == NULL) {
+		panic("synch_bootstrap: Out of memory\n");
+	}
+}
@@ -44,12 +44,15 @@
 #include <thread.h>
 #include <threadlist.h>
 #include <threadprivate.h>
+#include <clock.h>
 #include <proc.h>
 #include <current.h>
 #include <synch.h>
 #include <addrspace.h>
 #include <mainbus.h>
 #include <vnode.h>
+#include <objcache.h>
+#include <coremap.h>
 
 #include "opt-synchprobs.h"
 
@@ -75,6 +78,19 @@ DEFARRAY(wchan, static __UNUSED inline);
 static struct spinlock allwchans_lock;
 static struct wchanarray allwchans;
 
+/* Used by the idle loop in thread_switch; see below. */
+static struct thread *thread_steal(void);
+
+/* Where struct threads come from. */
+static struct objcache *thread_cache;
+
+/*
+ * Exited threads, stacks and all, that each CPU keeps to reuse. See
+ * thread_fork.
+ */
+#define THREAD_CACHE_MAX 8
+static volatile bool thread_cache_on = true;
+
 /* Used to wait for secondary CPUs to come online. */
 static struct semaphore *cpu_startup_sem;
 
@@ -118,44 +134,92 @@ thread_checkstack(struct thread *thread)
 }
 
 /*
- * Create a thread. This is used both to create a first thread
- * for each CPU and to create subsequent forked threads.
+ * Name a thread. Short names are kept in the thread itself, so most
+ * threads don't need a separate allocation.
  */
 static
-struct thread *
-thread_create(const char *name)
+int
+thread_setname(struct thread *thread, const char *name)
 {
-	struct thread *thread;
-
 	DEBUGASSERT(name != NULL);
 
-	thread = kmalloc(sizeof(*thread));
-	if (thread == NULL) {
-		return NULL;
+	if (strlen(name) < sizeof(thread->t_namebuf)) {
+		strcpy(thread->t_namebuf, name);
+		thread->t_name = thread->t_namebuf;
+	}
+	else {
+		thread->t_name = kstrdup(name);
+		if (thread->t_name == NULL) {
+			return ENOMEM;
+		}
 	}
+	return 0;
+}
 
-	thread->t_name = kstrdup(name);
-	if (thread->t_name == NULL) {
-		kfree(thread);
-		return NULL;
+static
+void
+thread_freename(struct thread *thread)
+{
+	if (thread->t_name != thread->t_namebuf) {
+		kfree(thread->t_name);
 	}
+	thread->t_name = NULL;
+}
+
+/*
+ * Set up the fields of a new or reused thread, except for the name
+ * and the stack.
+ */
+static
+void
+thread_init(struct thread *thread)
+{
 	thread->t_wchan_name = "NEW";
 	thread->t_state = S_READY;
 
 	/* Thread subsystem fields */
 	thread_machdep_init(&thread->t_machdep);
 	threadlistnode_init(&thread->t_listnode, thread);
-	thread->t_stack = NULL;
 	thread->t_context = NULL;
 	thread->t_cpu = NULL;
 	thread->t_proc = NULL;
 
+	/* Scheduling fields; new threads start at the top. */
+	thread->t_priority = 0;
+	thread->t_ticks = 0;
+	thread->t_affinity = THREAD_AFFINITY_ALL;
+	thread->t_lastcpu = NULL;
+	thread->t_lastran = 0;
+
 	/* Interrupt state fields */
 	thread->t_in_interrupt = false;
 	thread->t_curspl = IPL_HIGH;
 	thread->t_iplhigh_count = 1; /* corresponding to t_curspl */
 
 	/* If you add to struct thread, be sure to initialize here */
+}
+
+/*
+ * Create a thread. This is used both to create a first thread
+ * for each CPU and to create subsequent forked threads.
+ */
+static
+struct thread *
+thread_create(const char *name)
+{
+	struct thread *thread;
+
+	thread = objcache_alloc(thread_cache);
+	if (thread == NULL) {
+		return NULL;
+	}
+
+	if (thread_setname(thread, name)) {
+		objcache_free(thread_cache, thread);
+		return NULL;
+	}
+	thread_init(thread);
+	thread->t_stack = NULL;
 
 	return thread;
 }
@@ -185,8 +249,17 @@ cpu_create(unsigned hardware_number)
 
 	c->c_curthread = NULL;
 	threadlist_init(&c->c_zombies);
+	threadlist_init(&c->c_threadcache);
+	c->c_rehome = NULL;
 	c->c_hardclocks = 0;
+	c->c_tickless = false;
+	c->c_tickstopped = 0;
 	c->c_spinlocks = 0;
+	c->c_tlbrefills = 0;
+	c->c_tlbevictions = 0;
+	c->c_nfreepages = 0;
+	c->c_freepagehits = 0;
+	c->c_freepagemisses = 0;
 
 	c->c_isidle = false;
 	threadlist_init(&c->c_runqueue);
@@ -194,6 +267,10 @@ cpu_create(unsigned hardware_number)
 
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
+	c->c_shootdown_seq = 0;
+	c->c_shootdown_ack = 0;
+	c->c_drainpages_seq = 0;
+	c->c_drainpages_ack = 0;
 	spinlock_init(&c->c_ipi_lock);
 
 	result = cpuarray_add(&allcpus, c, &c->c_number);
@@ -201,6 +278,9 @@ cpu_create(unsigned hardware_number)
 		panic("cpu_create: array_add: %s\n", strerror(result));
 	}
 
+	snprintf(namebuf, sizeof(namebuf), "runqueue %d", c->c_number);
+	spinlock_register(&c->c_runqueue_lock, namebuf);
+
 	snprintf(namebuf, sizeof(namebuf), "<boot #%d>", c->c_number);
 	c->c_curthread = thread_create(namebuf);
 	if (c->c_curthread == NULL) {
@@ -234,6 +314,24 @@ cpu_create(unsigned hardware_number)
 	return c;
 }
 
+/*
+ * Return the number of CPUs.
+ */
+unsigned
+cpu_numcpus(void)
+{
+	return cpuarray_num(&allcpus);
+}
+
+/*
+ * Return the CPU with software number NUM.
+ */
+struct cpu *
+cpu_getcpu(unsigned num)
+{
+	return cpuarray_get(&allcpus, num);
+}
+
 /*
  * Destroy a thread.
  *
@@ -265,13 +363,75 @@ thread_destroy(struct thread *thread)
 	/* sheer paranoia */
 	thread->t_wchan_name = "DESTROYED";
 
-	kfree(thread->t_name);
-	kfree(thread);
+	thread_freename(thread);
+	objcache_free(thread_cache, thread);
+}
+
+/*
+ * Put a zombie in this CPU's thread cache instead of destroying it,
+ * if there's room. Only threads with their own stacks qualify. The
+ * struct thread is set up again from scratch when it's reused, but
+ * the stack is kept as it is; that saves the kfree and kmalloc, and
+ * the stack is likely still warm in the cache.
+ */
+static
+bool
+thread_recycle(struct thread *z)
+{
+	if (!thread_cache_on || z->t_stack == NULL ||
+	    curcpu->c_threadcache.tl_count >= THREAD_CACHE_MAX) {
+		return false;
+	}
+
+	KASSERT(z->t_proc == NULL);
+	thread_checkstack(z);
+	thread_machdep_cleanup(&z->t_machdep);
+	thread_freename(z);
+	z->t_wchan_name = "CACHED";
+	/* Last in, first out: the most recently used stack goes next. */
+	threadlist_addhead(&curcpu->c_threadcache, z);
+	return true;
+}
+
+/*
+ * Get a thread from this CPU's cache of exited ones, if there is one,
+ * and set it up as a new thread named NAME. It comes with its stack,
+ * whose guard band is still intact (exorcise checked it).
+ */
+static
+struct thread *
+thread_reuse(const char *name)
+{
+	struct thread *thread;
+	int spl;
+
+	if (!thread_cache_on) {
+		return NULL;
+	}
+
+	spl = splhigh();
+	thread = threadlist_remhead(&curcpu->c_threadcache);
+	splx(spl);
+	if (thread == NULL) {
+		return NULL;
+	}
+
+	threadlistnode_cleanup(&thread->t_listnode);
+	if (thread_setname(thread, name)) {
+		/* Probably out of memory; don't hang on to anything. */
+		thread_init(thread);
+		thread_destroy(thread);
+		return NULL;
+	}
+	thread_init(thread);
+	KASSERT(thread->t_stack != NULL);
+	return thread;
 }
 
 /*
  * Clean up zombies. (Zombies are threads that have exited but still
- * need to have thread_destroy called on them.)
+ * need to have thread_destroy called on them.) Some are kept in the
+ * thread cache for thread_fork to reuse instead.
  *
  * The list of zombies is per-cpu.
  */
@@ -284,7 +444,9 @@ exorcise(void)
 	while ((z = threadlist_remhead(&curcpu->c_zombies)) != NULL) {
 		KASSERT(z != curthread);
 		KASSERT(z->t_state == S_ZOMBIE);
-		thread_destroy(z);
+		if (!thread_recycle(z)) {
+			thread_destroy(z);
+		}
 	}
 }
 
@@ -358,6 +520,12 @@ thread_bootstrap(void)
 
 	cpuarray_init(&allcpus);
 
+	thread_cache = objcache_create("thread", sizeof(struct thread), 0,
+				       NULL, NULL);
+	if (thread_cache == NULL) {
+		panic("thread_bootstrap: Out of memory\n");
+	}
+
 	/*
 	 * Create the cpu structure for the bootup CPU, the one we're
 	 * currently running on. Assume the hardware number is 0; that
@@ -442,16 +610,150 @@ thread_start_cpus(void)
 	cpu_startup_sem = NULL;
 }
 
+/*
+ * Length of C's run queue, read without the lock.
+ */
+static
+unsigned
+thread_queuelen(struct cpu *c)
+{
+	return *(volatile unsigned *)&c->c_runqueue.tl_count;
+}
+
+/*
+ * True if thread T may run on cpu C.
+ */
+#define THREAD_CANRUN(t, c) (((t)->t_affinity & (1U << (c)->c_number)) != 0)
+
+/*
+ * Put T on C's run queue, which must be locked. The queue is kept in
+ * priority order, highest (lowest t_priority) first; T goes after
+ * every thread of its own level, so each level is round-robin. Most
+ * threads are usually at the same few levels, so search from the end.
+ */
+static
+void
+thread_enqueue(struct cpu *c, struct thread *t)
+{
+	struct thread *prev;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	THREADLIST_FORALL_REV(prev, c->c_runqueue) {
+		if (prev->t_priority <= t->t_priority) {
+			threadlist_insertafter(&c->c_runqueue, prev, t);
+			return;
+		}
+	}
+	threadlist_addhead(&c->c_runqueue, t);
+}
+
+/*
+ * Choose the CPU a thread being woken up (or just created) should run
+ * on. Two CPUs are likely to have useful things in their caches: the
+ * one it last ran on, which has its stack and working set, and the
+ * one waking it, which has just touched whatever it's being woken
+ * for (think of a producer handing work to a consumer).
+ *
+ * - Stay on the last CPU if it's idle, or it's the waker anyway.
+ * - Otherwise go to the waker's CPU, unless that has a longer queue.
+ * - Otherwise stay put.
+ * All of these only if the thread's affinity mask allows; if it
+ * allows neither, take the allowed CPU with the shortest queue.
+ * And if the thread would have to wait behind others where it's put,
+ * while some CPU it may use is idle, use the idle one instead: idle
+ * CPUs don't take clock ticks, so they won't notice queued work
+ * by themselves for a while.
+ *
+ * Nothing here is locked; queue lengths are only hints.
+ */
+static
+struct cpu *
+thread_idlecpu(struct thread *t)
+{
+	struct cpu *c;
+	unsigned i, numcpus;
+
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c->c_isidle && THREAD_CANRUN(t, c)) {
+			return c;
+		}
+	}
+	return NULL;
+}
+
+static
+struct cpu *
+thread_placecpu(struct thread *t)
+{
+	struct cpu *prev, *waker, *c, *best;
+	unsigned i, numcpus, count, bestcount;
+
+	prev = t->t_cpu;
+	waker = curcpu->c_self;
+
+	if (THREAD_CANRUN(t, prev) && (prev->c_isidle || prev == waker)) {
+		return prev;
+	}
+	if (THREAD_CANRUN(t, waker) &&
+	    (!THREAD_CANRUN(t, prev) ||
+	     thread_queuelen(waker) <= thread_queuelen(prev))) {
+		return waker;
+	}
+	if (THREAD_CANRUN(t, prev)) {
+		return prev;
+	}
+
+	best = NULL;
+	bestcount = 0;
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (!THREAD_CANRUN(t, c)) {
+			continue;
+		}
+		count = thread_queuelen(c);
+		if (best == NULL || count < bestcount) {
+			best = c;
+			bestcount = count;
+		}
+	}
+	/* thread_setaffinity doesn't allow masks with no CPUs in them. */
+	KASSERT(best != NULL);
+	return best;
+}
+
+static
+struct cpu *
+thread_wakecpu(struct thread *t)
+{
+	struct cpu *c, *idle;
+
+	c = thread_placecpu(t);
+	if (!c->c_isidle && thread_queuelen(c) > 0) {
+		idle = thread_idlecpu(t);
+		if (idle != NULL) {
+			return idle;
+		}
+	}
+	return c;
+}
+
 /*
  * Make a thread runnable.
  *
- * targetcpu might be curcpu; it might not be, too.
+ * If we don't already have the lock, the thread is placed with
+ * thread_wakecpu, so targetcpu might be curcpu; it might not be, too.
+ * (With the lock, the caller is thread_switch putting curthread back
+ * on its own CPU.)
  */
 static
 void
 thread_make_runnable(struct thread *target, bool already_have_lock)
 {
-	struct cpu *targetcpu;
+	struct cpu *targetcpu, *newcpu;
 
 	/* Lock the run queue of the target thread's cpu. */
 	targetcpu = target->t_cpu;
@@ -462,11 +764,30 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 	}
 	else {
 		spinlock_acquire(&targetcpu->c_runqueue_lock);
+
+		/*
+		 * Holding its old cpu's run queue lock guarantees
+		 * that the thread has finished switching out there,
+		 * because that lock is held across thread switches;
+		 * so it's now safe to send it elsewhere. Except if it
+		 * is still that cpu's curthread: that happens if the
+		 * cpu went idle right after the thread went to sleep.
+		 * Then it has to stay.
+		 */
+		if (target != targetcpu->c_curthread) {
+			newcpu = thread_wakecpu(target);
+			if (newcpu != targetcpu) {
+				spinlock_release(&targetcpu->c_runqueue_lock);
+				target->t_cpu = newcpu;
+				targetcpu = newcpu;
+				spinlock_acquire(&targetcpu->c_runqueue_lock);
+			}
+		}
 	}
 
 	/* Target thread is now ready to run; put it on the run queue. */
 	target->t_state = S_READY;
-	threadlist_addtail(&targetcpu->c_runqueue, target);
+	thread_enqueue(targetcpu, target);
 
 	if (targetcpu->c_isidle) {
 		/*
@@ -481,6 +802,27 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 	}
 }
 
+/*
+ * Move the thread this cpu just switched away from, if thread_switch
+ * left it in c_rehome because it may no longer run here. Now that
+ * it's fully switched out, thread_make_runnable can place it on a cpu
+ * it's allowed on. Called after every switch, at splhigh.
+ */
+static
+void
+thread_rehome(void)
+{
+	struct thread *t;
+
+	t = curcpu->c_rehome;
+	if (t == NULL) {
+		return;
+	}
+	curcpu->c_rehome = NULL;
+	KASSERT(t != curthread);
+	thread_make_runnable(t, false);
+}
+
 /*
  * Create a new thread based on an existing one.
  *
@@ -500,18 +842,22 @@ thread_fork(const char *name,
 	struct thread *newthread;
 	int result;
 
-	newthread = thread_create(name);
+	/* Reuse an exited thread and its stack if we can. */
+	newthread = thread_reuse(name);
 	if (newthread == NULL) {
-		return ENOMEM;
-	}
+		newthread = thread_create(name);
+		if (newthread == NULL) {
+			return ENOMEM;
+		}
 
-	/* Allocate a stack */
-	newthread->t_stack = kmalloc(STACK_SIZE);
-	if (newthread->t_stack == NULL) {
-		thread_destroy(newthread);
-		return ENOMEM;
+		/* Allocate a stack */
+		newthread->t_stack = kmalloc(STACK_SIZE);
+		if (newthread->t_stack == NULL) {
+			thread_destroy(newthread);
+			return ENOMEM;
+		}
+		thread_checkstack_init(newthread);
 	}
-	thread_checkstack_init(newthread);
 
 	/*
 	 * Now we clone various fields from the parent thread.
@@ -519,6 +865,7 @@ thread_fork(const char *name,
 
 	/* Thread subsystem fields */
 	newthread->t_cpu = curthread->t_cpu;
+	newthread->t_affinity = curthread->t_affinity;
 
 	/* Attach the new thread to its process */
 	if (proc == NULL) {
@@ -587,8 +934,13 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	/* Lock the run queue. */
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 
+	/* Remember when we last ran, for cache-warmth decisions. */
+	cur->t_lastcpu = curcpu->c_self;
+	cur->t_lastran = curcpu->c_hardclocks;
+
 	/* Micro-optimization: if nothing to do, just return */
-	if (newstate == S_READY && threadlist_isempty(&curcpu->c_runqueue)) {
+	if (newstate == S_READY && threadlist_isempty(&curcpu->c_runqueue) &&
+	    THREAD_CANRUN(cur, curcpu)) {
 		spinlock_release(&curcpu->c_runqueue_lock);
 		splx(spl);
 		return;
@@ -599,9 +951,24 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	    case S_RUN:
 		panic("Illegal S_RUN in thread_switch\n");
 	    case S_READY:
+		if (!THREAD_CANRUN(cur, curcpu)) {
+			/*
+			 * Not allowed here any more (see
+			 * thread_setaffinity). Whoever we switch to
+			 * sends us elsewhere, once we're off this cpu.
+			 */
+			KASSERT(curcpu->c_rehome == NULL);
+			curcpu->c_rehome = cur;
+			break;
+		}
 		thread_make_runnable(cur, true /*have lock*/);
 		break;
 	    case S_SLEEP:
+		/* Blocking before the slice is up earns a level. */
+		if (cur->t_priority > 0) {
+			cur->t_priority--;
+		}
+		cur->t_ticks = 0;
 		cur->t_wchan_name = wc->wc_name;
 		/*
 		 * Add the thread to the list in the wait channel, and
@@ -622,7 +989,11 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	cur->t_state = newstate;
 
 	/*
-	 * Get the next thread. While there isn't one, call md_idle().
+	 * Get the next thread. While there isn't one, try to take one
+	 * from another cpu, and if that fails too, stop the clock tick
+	 * and call md_idle(). A stolen thread is run directly without
+	 * going on our run queue. Once we have a thread, restart the
+	 * tick.
 	 * curcpu->c_isidle must be true when md_idle is
 	 * called. Unlock the runqueue while idling too, to make sure
 	 * things can be added to it.
@@ -636,6 +1007,8 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	 * Note that c_isidle becomes true briefly even if we don't go
 	 * idle. However, because one is supposed to hold the runqueue
 	 * lock to look at it, this should not be visible or matter.
+	 * (thread_balance peeks at it without the lock, but the worst
+	 * that can come of that is a needless IPI.)
 	 */
 
 	/* The current cpu is now idle. */
@@ -644,11 +1017,16 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 		next = threadlist_remhead(&curcpu->c_runqueue);
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			next = thread_steal();
+			if (next == NULL) {
+				hardclock_idle();
+				cpu_idle();
+			}
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
 	curcpu->c_isidle = false;
+	hardclock_unidle();
 
 	/*
 	 * Note that curcpu->c_curthread may be the same variable as
@@ -717,6 +1095,9 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	/* Unlock the run queue. */
 	spinlock_release(&curcpu->c_runqueue_lock);
 
+	/* Send the thread we switched from elsewhere, if need be. */
+	thread_rehome();
+
 	/* Activate our address space in the MMU. */
 	as_activate();
 
@@ -750,6 +1131,9 @@ thread_startup(void (*entrypoint)(void *data1, unsigned long data2),
 	/* Release the runqueue lock acquired in thread_switch. */
 	spinlock_release(&curcpu->c_runqueue_lock);
 
+	/* Send the thread we switched from elsewhere, if need be. */
+	thread_rehome();
+
 	/* Activate our address space in the MMU. */
 	as_activate();
 
@@ -823,139 +1207,315 @@ thread_yield(void)
 /*
  * Scheduler.
  *
- * This is called periodically from hardclock(). It should reshuffle
- * the current CPU's run queue by job priority.
+ * This is a multi-level feedback queue. Each thread has a priority
+ * level, t_priority, from 0 (highest) to SCHED_NLEVELS-1, and each
+ * CPU's run queue is kept sorted by level (see thread_enqueue), so
+ * thread_switch always picks the first thread of the highest level
+ * with anything in it, round-robin within the level.
+ *
+ * - A thread that runs through a whole time slice (thread_tick) is
+ *   moved down a level. CPU-bound threads thus sink.
+ * - A thread that blocks (thread_switch with S_SLEEP) is moved up a
+ *   level. Threads that mostly wait, such as the shell or anything
+ *   reading the console, rise and run promptly when they wake.
+ * - A thread that becomes runnable at a higher level than the one
+ *   running takes over at the next tick.
+ * - Every so often schedule() puts everyone back at the top, so that
+ *   threads stuck at the bottom behind busier ones can't starve.
  */
 
+#define SCHED_NLEVELS 4
+
+/*
+ * This is called periodically from hardclock() to boost all the
+ * threads on this CPU's run queue, and the current thread, to the top
+ * level. (Threads asleep get there soon enough by waking up.) Order
+ * within the queue is kept, so it stays sorted.
+ */
 void
 schedule(void)
 {
-	/*
-	 * You can write this. If we do nothing, threads will run in
-	 * round-robin fashion.
-	 */
+	struct thread *t;
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	THREADLIST_FORALL(t, curcpu->c_runqueue) {
+		t->t_priority = 0;
+		t->t_ticks = 0;
+	}
+	if (!curcpu->c_isidle) {
+		curthread->t_priority = 0;
+		curthread->t_ticks = 0;
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
+}
+
+/*
+ * Called from hardclock() on every tick.
+ */
+bool
+thread_tick(unsigned quantum)
+{
+	struct thread *cur, *next;
+	bool preempt;
+
+	if (curcpu->c_isidle) {
+		/* Nothing is running; the idle loop checks the queue. */
+		return false;
+	}
+
+	cur = curthread;
+	cur->t_ticks++;
+	if (cur->t_ticks >= quantum) {
+		cur->t_ticks = 0;
+		if (cur->t_priority < SCHED_NLEVELS - 1) {
+			cur->t_priority++;
+		}
+		/* If nothing else is waiting, don't bother switching. */
+		return thread_queuelen(curcpu->c_self) > 0;
+	}
+
+	/* Preempt if something better is waiting. */
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	preempt = false;
+	if (!threadlist_isempty(&curcpu->c_runqueue)) {
+		next = curcpu->c_runqueue.tl_head.tln_next->tln_self;
+		preempt = next->t_priority < cur->t_priority;
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
+	return preempt;
+}
+
+void
+thread_cache_enable(bool enable)
+{
+	thread_cache_on = enable;
 }
 
 /*
  * Thread migration.
  *
- * This is also called periodically from hardclock(). If the current
- * CPU is busy and other CPUs are idle, or less busy, it should move
- * threads across to those other other CPUs.
+ * Load is balanced by pulling, not pushing: a CPU that has nothing to
+ * run takes a thread from the busiest other CPU (thread_steal), right
+ * away from the idle loop in thread_switch. A CPU never has to lock
+ * anyone else's run queue unless it is actually taking a thread.
+ *
+ * Deciding whom to take from is done by reading the other CPUs' run
+ * queue lengths without locking them. The answer may be stale by the
+ * time we use it, but it is only a hint: the victim's queue is
+ * locked, and checked again, before anything is taken off it.
  *
  * Migrating threads isn't free because of cache affinity; a thread's
  * working cache set will end up having to be moved to the other CPU,
- * which is fairly slow. The tradeoff between this performance loss
- * and the performance loss due to underutilization of some CPUs is
- * something that needs to be tuned and probably is workload-specific.
- *
- * For here and now, because we know we're running on System/161 and
- * System/161 does not (yet) model such cache effects, we'll be very
- * aggressive.
+ * which is fairly slow. So we take the last thread on the victim's
+ * queue, the one that would otherwise wait longest there, and leave
+ * alone any thread that ran there within the last
+ * CACHEWARM_HARDCLOCKS ticks, since its cache lines are probably
+ * still there. Threads whose affinity mask excludes us are skipped
+ * too, of course.
  */
-void
-thread_consider_migration(void)
+
+#define CACHEWARM_HARDCLOCKS	2
+
+/*
+ * Take a thread off VICTIM's run queue for the current CPU. Returns
+ * NULL if there was nothing suitable. Must not be called holding our
+ * own run queue lock, since two run queue locks are never held at
+ * once.
+ */
+static
+struct thread *
+thread_steal_from(struct cpu *victim)
 {
-	unsigned my_count, total_count, one_share, to_send;
-	unsigned i, numcpus;
-	struct cpu *c;
-	struct threadlist victims;
-	struct thread *t;
+	struct thread *t, *found;
+
+	KASSERT(victim != curcpu->c_self);
+	KASSERT(!spinlock_do_i_hold(&curcpu->c_runqueue_lock));
+
+	found = NULL;
+	spinlock_acquire(&victim->c_runqueue_lock);
+	THREADLIST_FORALL_REV(t, victim->c_runqueue) {
+		/*
+		 * Ordinarily, a CPU's current thread does not appear
+		 * on its run queue. However, it can if the thread
+		 * went to sleep, the CPU went idle (so it remained
+		 * curthread), and the thread was woken again before
+		 * the CPU fully unidled. Migrating that thread while
+		 * its context is still in use would be a disaster.
+		 * Every other thread on the queue is fully switched
+		 * out, because the queue lock is held across
+		 * thread switches.
+		 */
+		if (t == victim->c_curthread) {
+			continue;
+		}
+		/*
+		 * Not allowed here, or its cache there is still warm.
+		 * Only a thread that last ran on the victim can be
+		 * warm there; t_lastran is in that cpu's ticks, so
+		 * it's meaningless against any other cpu's.
+		 */
+		if (!THREAD_CANRUN(t, curcpu)) {
+			continue;
+		}
+		if (t->t_lastcpu == victim &&
+		    victim->c_hardclocks - t->t_lastran < CACHEWARM_HARDCLOCKS) {
+			continue;
+		}
+		found = t;
+		break;
+	}
+	if (found != NULL) {
+		threadlist_remove(&victim->c_runqueue, found);
+		found->t_cpu = curcpu->c_self;
+	}
+	spinlock_release(&victim->c_runqueue_lock);
+
+	if (found != NULL) {
+		DEBUG(DB_THREADS, "Migrated thread %s: cpu %u -> %u",
+		      found->t_name, victim->c_number, curcpu->c_number);
+	}
+	return found;
+}
+
+/*
+ * Find the busiest other CPU and take a thread from it. This is
+ * called from the idle loop, so if it returns a thread the caller
+ * runs it directly; it is never put on our run queue, where another
+ * idle CPU could steal it straight back.
+ */
+static
+struct thread *
+thread_steal(void)
+{
+	struct cpu *c, *busiest;
+	unsigned i, numcpus, count, most;
 
-	my_count = total_count = 0;
+	busiest = NULL;
+	most = 0;
 	numcpus = cpuarray_num(&allcpus);
 	for (i=0; i<numcpus; i++) {
 		c = cpuarray_get(&allcpus, i);
-		spinlock_acquire(&c->c_runqueue_lock);
-		total_count += c->c_runqueue.tl_count;
 		if (c == curcpu->c_self) {
-			my_count = c->c_runqueue.tl_count;
+			continue;
+		}
+		count = thread_queuelen(c);
+		if (count > most) {
+			most = count;
+			busiest = c;
 		}
-		spinlock_release(&c->c_runqueue_lock);
 	}
 
-	one_share = DIVROUNDUP(total_count, numcpus);
-	if (my_count < one_share) {
-		return;
+	if (busiest == NULL) {
+		return NULL;
 	}
+	return thread_steal_from(busiest);
+}
 
-	to_send = my_count - one_share;
-	threadlist_init(&victims);
-	spinlock_acquire(&curcpu->c_runqueue_lock);
-	for (i=0; i<to_send; i++) {
-		t = threadlist_remtail(&curcpu->c_runqueue);
-		threadlist_addhead(&victims, t);
+/*
+ * Periodic balancing, called from hardclock(). Idle CPUs steal for
+ * themselves, so all this has to catch is a CPU that is busy but has
+ * a much shorter queue than another one, and idle CPUs that haven't
+ * noticed that we have work for them. It reads counters only; locks
+ * are taken just to move a thread, which shouldn't often be needed.
+ */
+void
+thread_balance(void)
+{
+	struct cpu *c, *busiest, *idle;
+	struct thread *t;
+	unsigned i, numcpus, mine, count, most;
+
+	if (curcpu->c_isidle) {
+		return;
 	}
-	spinlock_release(&curcpu->c_runqueue_lock);
 
-	for (i=0; i < numcpus && to_send > 0; i++) {
+	mine = thread_queuelen(curcpu->c_self);
+	busiest = idle = NULL;
+	most = 0;
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
 		c = cpuarray_get(&allcpus, i);
 		if (c == curcpu->c_self) {
 			continue;
 		}
-		spinlock_acquire(&c->c_runqueue_lock);
-		while (c->c_runqueue.tl_count < one_share && to_send > 0) {
-			t = threadlist_remhead(&victims);
-			/*
-			 * Ordinarily, curthread will not appear on
-			 * the run queue. However, it can under the
-			 * following circumstances:
-			 *   - it went to sleep;
-			 *   - the processor became idle, so it
-			 *     remained curthread;
-			 *   - it was reawakened, so it was put on the
-			 *     run queue;
-			 *   - and the processor hasn't fully unidled
-			 *     yet, so all these things are still true.
-			 *
-			 * If the timer interrupt happens at (almost)
-			 * exactly the proper moment, we can come here
-			 * while things are in this state and see
-			 * curthread. However, *migrating* curthread
-			 * can cause bad things to happen (Exercise:
-			 * Why? And what?) so shuffle it to the end of
-			 * the list and decrement to_send in order to
-			 * skip it. Then it goes back on our own run
-			 * queue below.
-			 */
-			if (t == curthread) {
-				threadlist_addtail(&victims, t);
-				to_send--;
-				continue;
-			}
-
-			t->t_cpu = c;
-			threadlist_addtail(&c->c_runqueue, t);
-			DEBUG(DB_THREADS,
-			      "Migrated thread %s: cpu %u -> %u",
-			      t->t_name, curcpu->c_number, c->c_number);
-			to_send--;
-			if (c->c_isidle) {
-				/*
-				 * Other processor is idle; send
-				 * interrupt to make sure it unidles.
-				 */
-				ipi_send(c, IPI_UNIDLE);
-			}
+		if (c->c_isidle && idle == NULL) {
+			idle = c;
+		}
+		count = thread_queuelen(c);
+		if (count > most) {
+			most = count;
+			busiest = c;
 		}
-		spinlock_release(&c->c_runqueue_lock);
 	}
 
-	/*
-	 * Because the code above isn't atomic, the thread counts may have
-	 * changed while we were working and we may end up with leftovers.
-	 * Don't panic; just put them back on our own run queue.
-	 */
-	if (!threadlist_isempty(&victims)) {
-		spinlock_acquire(&curcpu->c_runqueue_lock);
-		while ((t = threadlist_remhead(&victims)) != NULL) {
-			threadlist_addtail(&curcpu->c_runqueue, t);
+	if (mine > 0 && idle != NULL) {
+		/* Wake it up; it will take something of ours. */
+		ipi_send(idle, IPI_UNIDLE);
+		return;
+	}
+
+	if (busiest != NULL && most >= mine + 2) {
+		t = thread_steal_from(busiest);
+		if (t != NULL) {
+			spinlock_acquire(&curcpu->c_runqueue_lock);
+			thread_enqueue(curcpu->c_self, t);
+			spinlock_release(&curcpu->c_runqueue_lock);
 		}
-		spinlock_release(&curcpu->c_runqueue_lock);
 	}
+}
 
-	KASSERT(threadlist_isempty(&victims));
-	threadlist_cleanup(&victims);
+/*
+ * Does nothing; see thread_setaffinity.
+ */
+static
+void
+thread_rehome_helper(void *junk, unsigned long num)
+{
+	(void)junk;
+	(void)num;
+}
+
+/*
+ * Set the current thread's affinity mask. If we're on a cpu we're no
+ * longer allowed on, we can't just put ourselves on another cpu's run
+ * queue, since it might pick us up before we've finished switching
+ * out here. Instead we yield: thread_switch leaves us in c_rehome,
+ * and the thread it switches to moves us (thread_rehome).
+ *
+ * That needs there to be some other thread to switch to. If our run
+ * queue is empty, the cpu would just idle on our stack and nobody
+ * would ever move us, so first fork a thread that does nothing, tied
+ * to this cpu so it can't be stolen away in the meantime.
+ */
+int
+thread_setaffinity(uint32_t mask)
+{
+	uint32_t valid;
+	unsigned numcpus;
+	int result;
+
+	numcpus = cpuarray_num(&allcpus);
+	valid = numcpus >= 32 ? THREAD_AFFINITY_ALL : (1U << numcpus) - 1;
+	if ((mask & valid) == 0) {
+		return EINVAL;
+	}
+
+	curthread->t_affinity = mask;
+
+	while (!THREAD_CANRUN(curthread, curcpu)) {
+		if (thread_queuelen(curcpu->c_self) == 0) {
+			/* The helper inherits our affinity. */
+			curthread->t_affinity = 1U << curcpu->c_number;
+			result = thread_fork("rehome", NULL,
+					     thread_rehome_helper, NULL, 0);
+			curthread->t_affinity = mask;
+			if (result) {
+				return result;
+			}
+		}
+		thread_yield();
+	}
+	return 0;
 }
 
 ////////////////////////////////////////////////////////////
@@ -999,6 +1559,15 @@ wchan_create(const char *name)
 	return wc;
 }
 
+/*
+ * Rename a wait channel, e.g. when a cached lock is handed out again.
+ */
+void
+wchan_setname(struct wchan *wc, const char *name)
+{
+	wc->wc_name = name;
+}
+
 /*
  * Destroy a wait channel. Must be empty and unlocked.
  * (The corresponding cleanup functions require this.)
@@ -1049,6 +1618,77 @@ wchan_sleep(struct wchan *wc, struct spinlock *lk)
 	spinlock_acquire(lk);
 }
 
+/*
+ * What a timeout set by wchan_sleep_until needs to find its sleeper.
+ */
+struct wchan_timedwait {
+	struct wchan *wt_wchan;
+	struct spinlock *wt_lock;
+	struct thread *wt_thread;
+	bool wt_timedout;
+};
+
+/*
+ * Timeout function for wchan_sleep_until: if the thread is still on
+ * the channel, take it off and wake it. Runs from hardclock.
+ */
+static
+void
+wchan_timeout(void *data)
+{
+	struct wchan_timedwait *wt = data;
+
+	spinlock_acquire(wt->wt_lock);
+	if (wchan_wakethread(wt->wt_wchan, wt->wt_lock, wt->wt_thread)) {
+		wt->wt_timedout = true;
+	}
+	spinlock_release(wt->wt_lock);
+}
+
+/*
+ * Like wchan_sleep, but give up at DEADLINE (a time of day) if not
+ * woken before then. Returns 0 if woken, or ETIMEDOUT.
+ *
+ * The timeout function needs LK, so LK is let go while the timeout is
+ * cancelled and taken again before returning, as in wchan_sleep.
+ */
+int
+wchan_sleep_until(struct wchan *wc, struct spinlock *lk,
+		  const struct timespec *deadline)
+{
+	struct wchan_timedwait wt;
+	struct timeout to;
+	struct timespec now;
+
+	KASSERT(spinlock_do_i_hold(lk));
+
+	gettime(&now);
+	if (now.tv_sec > deadline->tv_sec ||
+	    (now.tv_sec == deadline->tv_sec &&
+	     now.tv_nsec >= deadline->tv_nsec)) {
+		return ETIMEDOUT;
+	}
+
+	wt.wt_wchan = wc;
+	wt.wt_lock = lk;
+	wt.wt_thread = curthread;
+	wt.wt_timedout = false;
+
+	/*
+	 * The timeout can't wake us before we're on the channel,
+	 * because it has to get LK first.
+	 */
+	timeout_init(&to, wchan_timeout, &wt);
+	timeout_set(&to, deadline);
+	wchan_sleep(wc, lk);
+
+	spinlock_release(lk);
+	timeout_cancel(&to);
+	spinlock_acquire(lk);
+
+	return wt.wt_timedout ? ETIMEDOUT : 0;
+}
+
 /*
  * Wake up one thread sleeping on a wait channel.
  */
@@ -1111,6 +1751,26 @@ wchan_wakeall(struct wchan *wc, struct spinlock *lk)
 	threadlist_cleanup(&list);
 }
 
+/*
+ * Wake up thread T if it is sleeping on a wait channel.
+ */
+bool
+wchan_wakethread(struct wchan *wc, struct spinlock *lk, struct thread *t)
+{
+	struct thread *target;
+
+	KASSERT(spinlock_do_i_hold(lk));
+
+	THREADLIST_FORALL(target, wc->wc_threads) {
+		if (target == t) {
+			threadlist_remove(&wc->wc_threads, t);
+			thread_make_runnable(t, false);
+			return true;
+		}
+	}
+	return false;
+}
+
 /*
  * Return nonzero if there are no threads sleeping on the channel.
  * This is meant to be used only for diagnostic purposes.
@@ -1163,18 +1823,42 @@ ipi_broadcast(int code)
 void
 ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 {
-	int n;
+	unsigned ticket;
+
+	ipi_tlbshootdown_batch(target, mapping, 1, &ticket);
+}
+
+/*
+ * Queue N mappings for TARGET and send a single IPI for all of them.
+ * If TARGET's queue fills up it is switched to a full flush instead.
+ *
+ * Each batch gets a ticket, handed back in *TICKET; TARGET bumps its
+ * acknowledgement count past it once it has dealt with everything
+ * queued, which is what ipi_tlbshootdown_wait waits for.
+ */
+void
+ipi_tlbshootdown_batch(struct cpu *target,
+		       const struct tlbshootdown *mappings, unsigned n,
+		       unsigned *ticket)
+{
+	unsigned i;
+	int m;
 
 	spinlock_acquire(&target->c_ipi_lock);
 
-	n = target->c_numshootdown;
-	if (n == TLBSHOOTDOWN_MAX) {
-		target->c_numshootdown = TLBSHOOTDOWN_ALL;
-	}
-	else {
-		target->c_shootdown[n] = *mapping;
-		target->c_numshootdown = n+1;
+	for (i=0; i<n; i++) {
+		m = target->c_numshootdown;
+		if (m == TLBSHOOTDOWN_ALL) {
+			break;
+		}
+		if (m == TLBSHOOTDOWN_MAX) {
+			target->c_numshootdown = TLBSHOOTDOWN_ALL;
+			break;
+		}
+		target->c_shootdown[m] = mappings[i];
+		target->c_numshootdown = m+1;
 	}
+	*ticket = ++target->c_shootdown_seq;
 
 	target->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
 	mainbus_send_ipi(target);
@@ -1182,14 +1866,71 @@ ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 	spinlock_release(&target->c_ipi_lock);
 }
 
+/*
+ * Wait until TARGET has acknowledged the shootdown batch TICKET.
+ *
+ * We can't hold spinlocks while waiting: the other CPU might be
+ * spinning on one of them with interrupts off.
+ */
+void
+ipi_tlbshootdown_wait(struct cpu *target, unsigned ticket)
+{
+	bool done;
+
+	KASSERT(curcpu->c_spinlocks == 0);
+
+	while (1) {
+		spinlock_acquire(&target->c_ipi_lock);
+		done = (int)(target->c_shootdown_ack - ticket) >= 0;
+		spinlock_release(&target->c_ipi_lock);
+		if (done) {
+			break;
+		}
+		thread_yield();
+	}
+}
+
+/*
+ * Have TARGET give back the free pages in its c_freepages cache (see
+ * coremap.c), and wait until it has. As above, no spinlocks may be
+ * held.
+ */
+void
+ipi_drainpages(struct cpu *target)
+{
+	unsigned ticket;
+	bool done;
+
+	KASSERT(curcpu->c_spinlocks == 0);
+	KASSERT(target != curcpu->c_self);
+
+	spinlock_acquire(&target->c_ipi_lock);
+	ticket = ++target->c_drainpages_seq;
+	target->c_ipi_pending |= (uint32_t)1 << IPI_DRAINPAGES;
+	mainbus_send_ipi(target);
+	spinlock_release(&target->c_ipi_lock);
+
+	while (1) {
+		spinlock_acquire(&target->c_ipi_lock);
+		done = (int)(target->c_drainpages_ack - ticket) >= 0;
+		spinlock_release(&target->c_ipi_lock);
+		if (done) {
+			break;
+		}
+		thread_yield();
+	}
+}
+
 void
 interprocessor_interrupt(void)
 {
 	uint32_t bits;
+	unsigned drainticket;
 	int i;
 
 	spinlock_acquire(&curcpu->c_ipi_lock);
 	bits = curcpu->c_ipi_pending;
+	drainticket = curcpu->c_drainpages_seq;
 
 	if (bits & (1U << IPI_PANIC)) {
 		/* panic on another cpu - just stop dead */
@@ -1224,8 +1965,20 @@ interprocessor_interrupt(void)
 			}
 		}
 		curcpu->c_numshootdown = 0;
+		curcpu->c_shootdown_ack = curcpu->c_shootdown_seq;
 	}
 
 	curcpu->c_ipi_pending = 0;
 	spinlock_release(&curcpu->c_ipi_lock);
+
+	if (bits & (1U << IPI_DRAINPAGES)) {
+		/*
+		 * Not under the IPI lock: coremap_lock is sometimes
+		 * held while sending IPIs, so it must come first.
+		 */
+		coremap_cpudrain();
+		spinlock_acquire(&curcpu->c_ipi_lock);
+		curcpu->c_drainpages_ack = drainticket;
+		spinlock_release(&curcpu->c_ipi_lock);
+	}
 }
@@ -0,0 +1,112 @@
+/*
+ * The kernel heap statistics device, "kheap:". Reading it gives the
+ * text from kheap_getstats, as of the moment of each read; it cannot
+ * be written.
+ *
+ * To make it readable with plain read() from start to end it claims
+ * to be a seekable device of KHEAP_STATSMAX one-byte blocks; reads
+ * past the end of the text return EOF.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <lib.h>
+#include <uio.h>
+#include <vfs.h>
+#include <device.h>
+
+/* Longest text we'll produce. */
+#define KHEAP_STATSMAX 8192
+
+/* For open() */
+static
+int
+kheapopen(struct device *dev, int openflags)
+{
+	(void)dev;
+
+	if ((openflags & O_ACCMODE) != O_RDONLY) {
+		return EROFS;
+	}
+	return 0;
+}
+
+/* For d_io() */
+static
+int
+kheapio(struct device *dev, struct uio *uio)
+{
+	char *buf;
+	size_t len;
+	int result;
+
+	(void)dev;
+
+	if (uio->uio_rw != UIO_READ) {
+		return EROFS;
+	}
+
+	buf = kmalloc(KHEAP_STATSMAX);
+	if (buf == NULL) {
+		return ENOMEM;
+	}
+	len = kheap_getstats(buf, KHEAP_STATSMAX);
+	if (len >= KHEAP_STATSMAX) {
+		len = KHEAP_STATSMAX - 1;
+	}
+
+	result = 0;
+	if (uio->uio_offset < (off_t)len) {
+		result = uiomove(buf + uio->uio_offset,
+				 len - uio->uio_offset, uio);
+	}
+	kfree(buf);
+	return result;
+}
+
+/* For ioctl() */
+static
+int
+kheapioctl(struct device *dev, int op, userptr_t data)
+{
+	(void)dev;
+	(void)op;
+	(void)data;
+
+	return EINVAL;
+}
+
+static const struct device_ops kheap_devops = {
+	.devop_eachopen = kheapopen,
+	.devop_io = kheapio,
+	.devop_ioctl = kheapioctl,
+};
+
+/*
+ * Function to create and attach kheap:
+ */
+void
+devkheap_create(void)
+{
+	int result;
+	struct device *dev;
+
+	dev = kmalloc(sizeof(*dev));
+	if (dev==NULL) {
+		panic("Could not add kheap device: out of memory\n");
+	}
+
+	dev->d_ops = &kheap_devops;
+
+	dev->d_blocks = KHEAP_STATSMAX;
+	dev->d_blocksize = 1;
+
+	dev->d_devnumber = 0; /* assigned by vfs_adddev */
+
+	dev->d_data = NULL;
+
+	result = vfs_adddev("kheap", dev, 0);
+	if (result) {
+		panic("Could not add kheap device: %s\n", strerror(result));
+	}
+}
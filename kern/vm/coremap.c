@@ -0,0 +1,1146 @@
+/*
+ * Coremap and buddy allocator for physical pages.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spl.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <cpu.h>
+#include <thread.h>
+#include <current.h>
+#include <vm.h>
+#include <pagetable.h>
+#include <swap.h>
+#include <coremap.h>
+
+/*
+ * Largest block size handled by the buddy allocator is
+ * 2^COREMAP_MAXORDER pages. ram_bootstrap() limits RAM to 512M,
+ * which is 2^17 4K pages, so this covers all of it.
+ */
+#define COREMAP_MAXORDER  17
+#define COREMAP_NORDERS   (COREMAP_MAXORDER + 1)
+
+/*
+ * Pages evicted together, sharing one round of TLB shootdowns. Must
+ * not exceed TLBSHOOTDOWN_MAX.
+ */
+#define COREMAP_EVICTBATCH  8
+
+/*
+ * Pages moved at once between a CPU's free page cache and the buddy
+ * allocator.
+ */
+#define COREMAP_CPUBATCH  (CPU_FREEPAGES / 2)
+
+/* Null page number, for list links. */
+#define CM_NONE        0xffffffff
+
+/* cme_order value for pages that are not the head of a free block. */
+#define CM_NOTHEAD     0xff
+
+/* Page states. */
+#define CME_FREE       0	/* in the buddy allocator */
+#define CME_FIXED      1	/* kernel image, coremap; never freed */
+#define CME_KERNEL     2	/* allocated with coremap_alloc */
+#define CME_USER       3	/* allocated with coremap_alloc_user */
+
+/*
+ * The cme_as, cme_vaddr and cme_pte fields of a user page name the
+ * one mapping of the page that can be evicted. They are NULL while the
+ * page is shared copy-on-write; the page then cannot be evicted until
+ * the last remaining mapping claims it again in coremap_map.
+ */
+struct coremap_entry {
+	uint32_t cme_next;	/* free list link (page number) */
+	uint32_t cme_prev;	/* free list link (page number) */
+	uint32_t cme_npages;	/* length of allocated run (head only) */
+	struct addrspace *cme_as;	/* owner of user page */
+	vaddr_t cme_vaddr;	/* where the owner maps it */
+	uint32_t *cme_pte;	/* the owner's PTE for it */
+	uint32_t cme_swapslot;	/* clean copy in swap, or SWAP_NOSLOT */
+	uint16_t cme_refcount;	/* references to allocated run (head only) */
+	uint16_t cme_wired;	/* user page must not be evicted */
+	uint8_t cme_state;	/* CME_* */
+	uint8_t cme_order;	/* order of free block (head only) */
+	bool cme_busy;		/* user page is pinned */
+	bool cme_ref;		/* user page was mapped since last sweep */
+	bool cme_dirty;		/* user page differs from its swap copy */
+	void *cme_private;	/* kernel page user's data */
+};
+
+/*
+ * The coremap itself, and one free list per block order. Everything
+ * here is protected by coremap_lock.
+ *
+ * Threads wait on coremap_wchan for busy pages. It is created by
+ * coremap_enablepaging; until then nothing is evicted.
+ */
+static struct spinlock coremap_lock = SPINLOCK_INITIALIZER;
+static struct wchan *coremap_wchan;
+static struct coremap_entry *coremap;
+static uint32_t coremap_npages;
+static uint32_t freelists[COREMAP_NORDERS];
+static uint32_t coremap_nfree;
+static uint32_t coremap_clockhand;
+
+/* Set once every CPU's free page cache can be used. */
+static bool coremap_cpucaches;
+
+/*
+ * Reset the allocation-related fields of an entry.
+ */
+static
+void
+coremap_clearentry(struct coremap_entry *cme)
+{
+	cme->cme_npages = 0;
+	cme->cme_as = NULL;
+	cme->cme_vaddr = 0;
+	cme->cme_pte = NULL;
+	cme->cme_swapslot = SWAP_NOSLOT;
+	cme->cme_refcount = 0;
+	cme->cme_wired = 0;
+	cme->cme_busy = false;
+	cme->cme_ref = false;
+	cme->cme_dirty = false;
+	cme->cme_private = NULL;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Free lists
+
+static
+void
+freelist_push(uint32_t page, unsigned order)
+{
+	uint32_t head;
+
+	head = freelists[order];
+	coremap[page].cme_prev = CM_NONE;
+	coremap[page].cme_next = head;
+	if (head != CM_NONE) {
+		coremap[head].cme_prev = page;
+	}
+	freelists[order] = page;
+}
+
+static
+void
+freelist_remove(uint32_t page, unsigned order)
+{
+	uint32_t next, prev;
+
+	next = coremap[page].cme_next;
+	prev = coremap[page].cme_prev;
+	if (prev != CM_NONE) {
+		coremap[prev].cme_next = next;
+	}
+	else {
+		KASSERT(freelists[order] == page);
+		freelists[order] = next;
+	}
+	if (next != CM_NONE) {
+		coremap[next].cme_prev = prev;
+	}
+	coremap[page].cme_next = coremap[page].cme_prev = CM_NONE;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Buddy operations
+
+/*
+ * Return true if PAGE is the head of a free block of exactly ORDER.
+ */
+static
+bool
+buddy_isfreehead(uint32_t page, unsigned order)
+{
+	if (page + ((uint32_t)1 << order) > coremap_npages) {
+		return false;
+	}
+	return coremap[page].cme_state == CME_FREE &&
+		coremap[page].cme_order == order;
+}
+
+/*
+ * Put the block of 2^ORDER pages starting at PAGE on the free lists,
+ * merging it with its buddy for as long as the buddy is free too.
+ * The pages must already be marked CME_FREE.
+ */
+static
+void
+buddy_insert(uint32_t page, unsigned order)
+{
+	uint32_t buddy;
+
+	KASSERT((page & (((uint32_t)1 << order) - 1)) == 0);
+
+	while (order < COREMAP_MAXORDER) {
+		buddy = page ^ ((uint32_t)1 << order);
+		if (!buddy_isfreehead(buddy, order)) {
+			break;
+		}
+		freelist_remove(buddy, order);
+		if (buddy < page) {
+			coremap[page].cme_order = CM_NOTHEAD;
+			page = buddy;
+		}
+		else {
+			coremap[buddy].cme_order = CM_NOTHEAD;
+		}
+		order++;
+	}
+
+	coremap[page].cme_order = order;
+	freelist_push(page, order);
+}
+
+/*
+ * Free the pages [START, END). The range is broken into the largest
+ * naturally aligned blocks that fit, and each is inserted separately.
+ */
+static
+void
+buddy_freerange(uint32_t start, uint32_t end)
+{
+	uint32_t i;
+	unsigned order;
+
+	for (i=start; i<end; i++) {
+		coremap[i].cme_state = CME_FREE;
+		coremap[i].cme_order = CM_NOTHEAD;
+		coremap_clearentry(&coremap[i]);
+	}
+	coremap_nfree += end - start;
+
+	while (start < end) {
+		order = 0;
+		while (order < COREMAP_MAXORDER &&
+		       (start & ((uint32_t)1 << order)) == 0 &&
+		       start + ((uint32_t)2 << order) <= end) {
+			order++;
+		}
+		buddy_insert(start, order);
+		start += (uint32_t)1 << order;
+	}
+}
+
+/*
+ * Take a free block of exactly 2^ORDER pages off the free lists,
+ * splitting a larger one if necessary. Returns CM_NONE if there is
+ * no block large enough.
+ */
+static
+uint32_t
+buddy_remove(unsigned order)
+{
+	unsigned k;
+	uint32_t page, half;
+
+	for (k=order; k<COREMAP_NORDERS; k++) {
+		if (freelists[k] != CM_NONE) {
+			break;
+		}
+	}
+	if (k == COREMAP_NORDERS) {
+		return CM_NONE;
+	}
+
+	page = freelists[k];
+	freelist_remove(page, k);
+	coremap[page].cme_order = CM_NOTHEAD;
+
+	/* Split off and free the upper half until we're the right size. */
+	while (k > order) {
+		k--;
+		half = page + ((uint32_t)1 << k);
+		coremap[half].cme_order = k;
+		freelist_push(half, k);
+	}
+
+	return page;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Bootstrap
+
+/*
+ * Set up the coremap. The coremap array is taken with ram_stealmem
+ * from the start of free memory; everything below the first free
+ * page after that is marked fixed, and the rest is handed to the
+ * buddy allocator.
+ */
+void
+coremap_bootstrap(void)
+{
+	paddr_t lastpaddr, firstpaddr, cmpaddr;
+	uint32_t firstpage, i;
+	unsigned k;
+	size_t cmsize;
+
+	spinlock_register(&coremap_lock, "coremap");
+
+	lastpaddr = ram_getsize();
+	coremap_npages = lastpaddr / PAGE_SIZE;
+
+	cmsize = coremap_npages * sizeof(struct coremap_entry);
+	cmpaddr = ram_stealmem(DIVROUNDUP(cmsize, PAGE_SIZE));
+	if (cmpaddr == 0) {
+		panic("coremap: no memory for %u pages\n", coremap_npages);
+	}
+	coremap = (struct coremap_entry *)PADDR_TO_KVADDR(cmpaddr);
+
+	firstpaddr = ram_getfirstfree();
+	firstpage = DIVROUNDUP(firstpaddr, PAGE_SIZE);
+
+	for (k=0; k<COREMAP_NORDERS; k++) {
+		freelists[k] = CM_NONE;
+	}
+
+	for (i=0; i<coremap_npages; i++) {
+		coremap[i].cme_next = CM_NONE;
+		coremap[i].cme_prev = CM_NONE;
+		coremap_clearentry(&coremap[i]);
+		coremap[i].cme_state = CME_FIXED;
+		coremap[i].cme_order = CM_NOTHEAD;
+	}
+
+	coremap_nfree = 0;
+	buddy_freerange(firstpage, coremap_npages);
+
+	kprintf("coremap: %u pages, %u free\n", coremap_npages, coremap_nfree);
+}
+
+/*
+ * Allow paging. Called from vm_bootstrap, once wait channels can be
+ * created.
+ */
+void
+coremap_enablepaging(void)
+{
+	struct wchan *wc;
+
+	wc = wchan_create("coremap");
+	if (wc == NULL) {
+		panic("coremap: Out of memory creating wait channel\n");
+	}
+
+	spinlock_acquire(&coremap_lock);
+	coremap_wchan = wc;
+	coremap_cpucaches = true;
+	spinlock_release(&coremap_lock);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Per-CPU free page caches
+
+/*
+ * Single kernel pages are by far the most common allocation (kmalloc
+ * takes its subpage pages one at a time), so each CPU keeps a few
+ * free ones in curcpu->c_freepages and only takes coremap_lock to move
+ * COREMAP_CPUBATCH of them at a time to or from the buddy allocator.
+ *
+ * Cached pages stay marked as allocated single kernel pages; they are
+ * simply not in use. A CPU's cache is only touched by that CPU, with
+ * interrupts off, so it needs no lock.
+ */
+
+/*
+ * Take a page from this CPU's cache, refilling it first if it is
+ * empty. Returns 0 if there are no free pages to refill it with; the
+ * caller should then fall back to coremap_alloc's slow path.
+ */
+static
+paddr_t
+coremap_cpualloc(void)
+{
+	struct cpu *c;
+	uint32_t page;
+	paddr_t pa;
+	int spl;
+
+	spl = splhigh();
+	c = curcpu->c_self;
+
+	if (c->c_nfreepages > 0) {
+		c->c_freepagehits++;
+	}
+	else {
+		c->c_freepagemisses++;
+		spinlock_acquire(&coremap_lock);
+		while (c->c_nfreepages < COREMAP_CPUBATCH) {
+			page = buddy_remove(0);
+			if (page == CM_NONE) {
+				break;
+			}
+			coremap_nfree--;
+			coremap[page].cme_state = CME_KERNEL;
+			coremap[page].cme_npages = 1;
+			coremap[page].cme_refcount = 1;
+			c->c_freepages[c->c_nfreepages++] =
+				(paddr_t)page * PAGE_SIZE;
+		}
+		spinlock_release(&coremap_lock);
+	}
+
+	pa = 0;
+	if (c->c_nfreepages > 0) {
+		pa = c->c_freepages[--c->c_nfreepages];
+	}
+	splx(spl);
+	return pa;
+}
+
+/*
+ * Give the oldest N pages in CPU C's cache (which must be this CPU's)
+ * back to the buddy allocator. Call at splhigh.
+ */
+static
+void
+coremap_cpureturn(struct cpu *c, unsigned n)
+{
+	uint32_t page;
+	unsigned i;
+
+	KASSERT(n <= c->c_nfreepages);
+
+	spinlock_acquire(&coremap_lock);
+	for (i=0; i<n; i++) {
+		page = c->c_freepages[i] / PAGE_SIZE;
+		buddy_freerange(page, page + 1);
+	}
+	spinlock_release(&coremap_lock);
+	for (i=n; i<c->c_nfreepages; i++) {
+		c->c_freepages[i - n] = c->c_freepages[i];
+	}
+	c->c_nfreepages -= n;
+}
+
+/*
+ * Put the single kernel page PADDR in this CPU's cache. If the cache
+ * is full, the oldest COREMAP_CPUBATCH pages go back to the buddy
+ * allocator first. The page is handed out again without going
+ * through coremap_clearentry, so whatever coremap_setprivate put on
+ * it is dropped here.
+ */
+static
+void
+coremap_cpufree(paddr_t paddr)
+{
+	struct cpu *c;
+	int spl;
+
+	coremap[paddr / PAGE_SIZE].cme_private = NULL;
+
+	spl = splhigh();
+	c = curcpu->c_self;
+
+	if (c->c_nfreepages == CPU_FREEPAGES) {
+		coremap_cpureturn(c, COREMAP_CPUBATCH);
+	}
+	c->c_freepages[c->c_nfreepages++] = paddr;
+
+	splx(spl);
+}
+
+/*
+ * Give everything in this CPU's cache back to the buddy allocator.
+ * Called on other CPUs' behalf through ipi_drainpages.
+ */
+void
+coremap_cpudrain(void)
+{
+	struct cpu *c;
+	int spl;
+
+	spl = splhigh();
+	c = curcpu->c_self;
+	if (c->c_nfreepages > 0) {
+		coremap_cpureturn(c, c->c_nfreepages);
+	}
+	splx(spl);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Page replacement
+
+/*
+ * Return true if we may evict a page to satisfy an allocation. That
+ * means sleeping for disk I/O and TLB shootdown, so we can't be in an
+ * interrupt handler or holding spinlocks.
+ */
+static
+bool
+coremap_canevict(void)
+{
+	return coremap_wchan != NULL &&
+		!curthread->t_in_interrupt &&
+		curcpu->c_spinlocks == 0;
+}
+
+/*
+ * Out of free blocks: get back the pages sitting idle in every CPU's
+ * cache before anything drastic is done. Other CPUs have to be asked
+ * and waited for, which we can only do if we may sleep; otherwise
+ * just this CPU's cache is emptied.
+ */
+static
+void
+coremap_drainall(void)
+{
+	struct cpu *c;
+	unsigned i;
+
+	if (!coremap_cpucaches) {
+		return;
+	}
+	coremap_cpudrain();
+	if (!coremap_canevict()) {
+		return;
+	}
+	for (i=0; i<cpu_numcpus(); i++) {
+		c = cpu_getcpu(i);
+		/* Unlocked peek; CPUs not yet started have nothing. */
+		if (c == curcpu->c_self || c->c_nfreepages == 0) {
+			continue;
+		}
+		ipi_drainpages(c);
+	}
+}
+
+/*
+ * Choose a victim with the second-chance clock algorithm. Pages get
+ * their reference bit set whenever vm_fault enters them into a TLB;
+ * the sweep clears it, so a page is chosen if it has not been
+ * refilled into any TLB since the hand last passed. Only unshared,
+ * unpinned, unwired user pages are candidates.
+ *
+ * Call with coremap_lock held. Returns CM_NONE if nothing can be
+ * evicted.
+ */
+static
+uint32_t
+coremap_clock(void)
+{
+	struct coremap_entry *cme;
+	uint32_t i, page;
+
+	for (i=0; i<2 * coremap_npages; i++) {
+		page = coremap_clockhand;
+		coremap_clockhand = (coremap_clockhand + 1) % coremap_npages;
+
+		cme = &coremap[page];
+		if (cme->cme_state != CME_USER || cme->cme_busy ||
+		    cme->cme_wired > 0 || cme->cme_as == NULL) {
+			continue;
+		}
+		KASSERT(cme->cme_refcount == 1);
+		if (cme->cme_ref) {
+			cme->cme_ref = false;
+			continue;
+		}
+		return page;
+	}
+	return CM_NONE;
+}
+
+/*
+ * Write one pinned, unmapped victim out and point its owner's PTE at
+ * the swap slot. Swap is skipped if it already holds a clean copy. A
+ * page that has never been written and has no slot still holds what
+ * vm_fault first put there (zeros or part of the executable), so its
+ * PTE is simply cleared and it will be recreated on the next fault.
+ * On failure the page is unpinned and left with its owner.
+ */
+static
+int
+coremap_pageout(uint32_t page)
+{
+	struct coremap_entry *cme = &coremap[page];
+	unsigned slot;
+	bool dirty;
+	int result;
+
+	spinlock_acquire(&coremap_lock);
+	dirty = cme->cme_dirty;
+	slot = cme->cme_swapslot;
+	spinlock_release(&coremap_lock);
+
+	if (slot == SWAP_NOSLOT && !dirty) {
+		spinlock_acquire(&coremap_lock);
+		*cme->cme_pte = 0;
+		goto done;
+	}
+
+	if (slot == SWAP_NOSLOT) {
+		result = swap_alloc(&slot);
+		if (result) {
+			goto fail;
+		}
+		dirty = true;
+	}
+	if (dirty) {
+		result = swap_pageout((paddr_t)page * PAGE_SIZE, slot);
+		if (result) {
+			/* Keep the slot; the page stays dirty. */
+			spinlock_acquire(&coremap_lock);
+			cme->cme_swapslot = slot;
+			spinlock_release(&coremap_lock);
+			goto fail;
+		}
+	}
+
+	spinlock_acquire(&coremap_lock);
+	*cme->cme_pte = PTE_MKSWAP(slot);
+ done:
+	cme->cme_as = NULL;
+	cme->cme_vaddr = 0;
+	cme->cme_pte = NULL;
+	cme->cme_swapslot = SWAP_NOSLOT;
+	cme->cme_ref = false;
+	cme->cme_dirty = false;
+	/* Anyone waiting for the page will now find it in swap. */
+	wchan_wakeall(coremap_wchan, &coremap_lock);
+	spinlock_release(&coremap_lock);
+	return 0;
+
+ fail:
+	spinlock_acquire(&coremap_lock);
+	cme->cme_busy = false;
+	wchan_wakeall(coremap_wchan, &coremap_lock);
+	spinlock_release(&coremap_lock);
+	return result;
+}
+
+/*
+ * Evict up to COREMAP_EVICTBATCH user pages. The victims' mappings
+ * are removed from every TLB with a single round of shootdowns, each
+ * page is written to swap unless swap already holds a clean copy, and
+ * each owner's PTE is changed to point at the swap slot.
+ *
+ * On success one frame is returned in *RET still pinned and with no
+ * owner; the caller either reuses it or frees it. Any other victims
+ * are put on the free lists.
+ */
+static
+int
+coremap_evict(paddr_t *ret)
+{
+	struct tlbshootdown ts[COREMAP_EVICTBATCH];
+	uint32_t pages[COREMAP_EVICTBATCH];
+	struct coremap_entry *cme;
+	unsigned i, n;
+	bool found;
+	int result;
+
+	n = 0;
+	spinlock_acquire(&coremap_lock);
+	while (n < COREMAP_EVICTBATCH) {
+		pages[n] = coremap_clock();
+		if (pages[n] == CM_NONE) {
+			break;
+		}
+		cme = &coremap[pages[n]];
+		cme->cme_busy = true;
+		ts[n].ts_as = cme->cme_as;
+		ts[n].ts_vaddr = cme->cme_vaddr;
+		n++;
+	}
+	spinlock_release(&coremap_lock);
+
+	if (n == 0) {
+		return ENOMEM;
+	}
+
+	/*
+	 * Once the TLBs are clean the owners can only reach the pages by
+	 * faulting, and vm_fault waits for pinned pages; so the dirty
+	 * bits cannot change under us after this.
+	 */
+	vm_unmap(ts, n);
+
+	found = false;
+	result = 0;
+	for (i=0; i<n; i++) {
+		result = coremap_pageout(pages[i]);
+		if (result) {
+			continue;
+		}
+		if (!found) {
+			*ret = (paddr_t)pages[i] * PAGE_SIZE;
+			found = true;
+		}
+		else {
+			spinlock_acquire(&coremap_lock);
+			buddy_freerange(pages[i], pages[i] + 1);
+			spinlock_release(&coremap_lock);
+		}
+	}
+	return found ? 0 : result;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Interface
+
+/*
+ * Allocate NPAGES contiguous pages. The smallest power-of-two block
+ * that fits is taken and the unused tail is given straight back.
+ *
+ * If no block is free, the per-CPU caches are emptied and we look
+ * again. After that a single page can still be had by evicting a user
+ * page, if we are allowed to sleep; but eviction frees scattered
+ * pages that seldom make up a larger block, so bigger requests fail.
+ */
+paddr_t
+coremap_alloc(unsigned npages)
+{
+	unsigned order;
+	uint32_t page, i;
+	paddr_t pa, victim;
+
+	KASSERT(npages > 0);
+
+	if (npages == 1 && coremap_cpucaches) {
+		pa = coremap_cpualloc();
+		if (pa != 0) {
+			return pa;
+		}
+	}
+
+	order = 0;
+	while (((uint32_t)1 << order) < npages) {
+		order++;
+		if (order > COREMAP_MAXORDER) {
+			return 0;
+		}
+	}
+
+	spinlock_acquire(&coremap_lock);
+	page = buddy_remove(order);
+	if (page == CM_NONE) {
+		spinlock_release(&coremap_lock);
+		coremap_drainall();
+		spinlock_acquire(&coremap_lock);
+		page = buddy_remove(order);
+	}
+
+	if (page != CM_NONE) {
+		coremap_nfree -= (uint32_t)1 << order;
+	}
+	else {
+		spinlock_release(&coremap_lock);
+		if (order > 0 || !coremap_canevict() ||
+		    coremap_evict(&victim)) {
+			return 0;
+		}
+		/* The victim comes back allocated; just take it over. */
+		page = victim / PAGE_SIZE;
+		spinlock_acquire(&coremap_lock);
+		coremap_clearentry(&coremap[page]);
+	}
+
+	for (i=page; i<page + npages; i++) {
+		coremap[i].cme_state = CME_KERNEL;
+		coremap[i].cme_npages = 0;
+	}
+	coremap[page].cme_npages = npages;
+	coremap[page].cme_refcount = 1;
+
+	if (npages < ((uint32_t)1 << order)) {
+		buddy_freerange(page + npages, page + ((uint32_t)1 << order));
+	}
+
+	spinlock_release(&coremap_lock);
+
+	return (paddr_t)page * PAGE_SIZE;
+}
+
+/*
+ * Allocate one user page, to be mapped at VADDR in AS through PTE.
+ * The page is returned pinned.
+ */
+paddr_t
+coremap_alloc_user(struct addrspace *as, vaddr_t vaddr, uint32_t *pte)
+{
+	struct coremap_entry *cme;
+	uint32_t page;
+	paddr_t victim;
+
+	spinlock_acquire(&coremap_lock);
+	page = buddy_remove(0);
+	if (page == CM_NONE) {
+		spinlock_release(&coremap_lock);
+		coremap_drainall();
+		spinlock_acquire(&coremap_lock);
+		page = buddy_remove(0);
+	}
+	if (page != CM_NONE) {
+		coremap_nfree--;
+	}
+	spinlock_release(&coremap_lock);
+
+	if (page == CM_NONE) {
+		if (!coremap_canevict() || coremap_evict(&victim)) {
+			return 0;
+		}
+		page = victim / PAGE_SIZE;
+	}
+
+	spinlock_acquire(&coremap_lock);
+	cme = &coremap[page];
+	coremap_clearentry(cme);
+	cme->cme_state = CME_USER;
+	cme->cme_npages = 1;
+	cme->cme_refcount = 1;
+	cme->cme_as = as;
+	cme->cme_vaddr = vaddr;
+	cme->cme_pte = pte;
+	cme->cme_busy = true;
+	cme->cme_ref = true;
+	spinlock_release(&coremap_lock);
+
+	return (paddr_t)page * PAGE_SIZE;
+}
+
+/*
+ * Look up the head entry of an allocated run. Call with coremap_lock
+ * held.
+ */
+static
+uint32_t
+coremap_runhead(paddr_t paddr, const char *func)
+{
+	uint32_t page;
+
+	KASSERT(paddr % PAGE_SIZE == 0);
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+	page = paddr / PAGE_SIZE;
+	KASSERT(page < coremap_npages);
+	if ((coremap[page].cme_state != CME_KERNEL &&
+	     coremap[page].cme_state != CME_USER) ||
+	    coremap[page].cme_npages == 0) {
+		panic("%s: 0x%x is not an allocated run\n", func, paddr);
+	}
+	KASSERT(coremap[page].cme_refcount > 0);
+	return page;
+}
+
+/*
+ * Drop a reference to a run returned by coremap_alloc or
+ * coremap_alloc_user. The whole run is released when the last
+ * reference goes away. User pages must be pinned by the caller; the
+ * pin is released.
+ */
+void
+coremap_free(paddr_t paddr)
+{
+	struct coremap_entry *cme;
+	uint32_t page, npages;
+
+	/*
+	 * A single kernel page with one reference belongs to the
+	 * caller, so it can be looked at without the lock.
+	 */
+	page = paddr / PAGE_SIZE;
+	if (coremap_cpucaches && paddr % PAGE_SIZE == 0 &&
+	    page < coremap_npages &&
+	    coremap[page].cme_state == CME_KERNEL &&
+	    coremap[page].cme_npages == 1 &&
+	    coremap[page].cme_refcount == 1) {
+		coremap_cpufree(paddr);
+		return;
+	}
+
+	spinlock_acquire(&coremap_lock);
+
+	page = coremap_runhead(paddr, "coremap_free");
+	cme = &coremap[page];
+	if (cme->cme_state == CME_USER) {
+		KASSERT(cme->cme_busy);
+		cme->cme_busy = false;
+	}
+
+	cme->cme_refcount--;
+	if (cme->cme_refcount == 0) {
+		if (cme->cme_swapslot != SWAP_NOSLOT) {
+			swap_free(cme->cme_swapslot);
+		}
+		npages = cme->cme_npages;
+		buddy_freerange(page, page + npages);
+	}
+
+	if (coremap_wchan != NULL) {
+		wchan_wakeall(coremap_wchan, &coremap_lock);
+	}
+	spinlock_release(&coremap_lock);
+}
+
+/*
+ * Add a reference to an allocated run. User pages must be pinned;
+ * they lose their owner, as they are now shared.
+ */
+void
+coremap_incref(paddr_t paddr)
+{
+	struct coremap_entry *cme;
+	uint32_t page;
+
+	spinlock_acquire(&coremap_lock);
+
+	page = coremap_runhead(paddr, "coremap_incref");
+	cme = &coremap[page];
+	KASSERT(cme->cme_refcount < 0xffff);
+	cme->cme_refcount++;
+	if (cme->cme_state == CME_USER) {
+		KASSERT(cme->cme_busy);
+		cme->cme_as = NULL;
+		cme->cme_vaddr = 0;
+		cme->cme_pte = NULL;
+	}
+
+	spinlock_release(&coremap_lock);
+}
+
+/*
+ * Return the current reference count of an allocated run. Unless the
+ * caller holds the only reference, the answer may be stale by the
+ * time it is used.
+ */
+unsigned
+coremap_refcount(paddr_t paddr)
+{
+	uint32_t page;
+	unsigned count;
+
+	spinlock_acquire(&coremap_lock);
+
+	page = coremap_runhead(paddr, "coremap_refcount");
+	count = coremap[page].cme_refcount;
+
+	spinlock_release(&coremap_lock);
+	return count;
+}
+
+/*
+ * Return the length in pages of an allocated run. The caller must
+ * hold a reference.
+ */
+unsigned
+coremap_runlength(paddr_t paddr)
+{
+	uint32_t page;
+	unsigned npages;
+
+	spinlock_acquire(&coremap_lock);
+
+	page = coremap_runhead(paddr, "coremap_runlength");
+	npages = coremap[page].cme_npages;
+
+	spinlock_release(&coremap_lock);
+	return npages;
+}
+
+/*
+ * Pin the user page PTE refers to, waiting if someone else has it
+ * pinned. Returns false if PTE is not (or no longer) resident.
+ */
+bool
+coremap_pin(uint32_t *pte)
+{
+	uint32_t page;
+
+	spinlock_acquire(&coremap_lock);
+	while (1) {
+		if ((*pte & PTE_VALID) == 0) {
+			spinlock_release(&coremap_lock);
+			return false;
+		}
+		page = (*pte & PTE_FRAME) / PAGE_SIZE;
+		KASSERT(page < coremap_npages);
+		KASSERT(coremap[page].cme_state == CME_USER);
+		if (!coremap[page].cme_busy) {
+			break;
+		}
+		wchan_sleep(coremap_wchan, &coremap_lock);
+	}
+	coremap[page].cme_busy = true;
+	spinlock_release(&coremap_lock);
+	return true;
+}
+
+void
+coremap_unpin(paddr_t paddr)
+{
+	uint32_t page;
+
+	spinlock_acquire(&coremap_lock);
+	page = coremap_runhead(paddr, "coremap_unpin");
+	KASSERT(coremap[page].cme_state == CME_USER);
+	KASSERT(coremap[page].cme_busy);
+	coremap[page].cme_busy = false;
+	wchan_wakeall(coremap_wchan, &coremap_lock);
+	spinlock_release(&coremap_lock);
+}
+
+void
+coremap_wire(paddr_t paddr)
+{
+	uint32_t page;
+
+	spinlock_acquire(&coremap_lock);
+	page = coremap_runhead(paddr, "coremap_wire");
+	KASSERT(coremap[page].cme_state == CME_USER);
+	KASSERT(coremap[page].cme_busy);
+	KASSERT(coremap[page].cme_wired < 0xffff);
+	coremap[page].cme_wired++;
+	spinlock_release(&coremap_lock);
+}
+
+void
+coremap_unwire(paddr_t paddr)
+{
+	uint32_t page;
+
+	spinlock_acquire(&coremap_lock);
+	page = coremap_runhead(paddr, "coremap_unwire");
+	KASSERT(coremap[page].cme_state == CME_USER);
+	KASSERT(coremap[page].cme_wired > 0);
+	coremap[page].cme_wired--;
+	spinlock_release(&coremap_lock);
+}
+
+/*
+ * Note that the pinned user page PADDR is about to be entered into
+ * the TLB at VADDR in AS (whose PTE for it is PTE), for writing if
+ * WRITE is set. If the page is no longer shared and has no owner, AS
+ * becomes its owner.
+ *
+ * Returns true if the TLB entry may be writeable: that is, if the
+ * page is unshared and already dirty.
+ */
+bool
+coremap_map(paddr_t paddr, struct addrspace *as, vaddr_t vaddr,
+	    uint32_t *pte, bool write)
+{
+	struct coremap_entry *cme;
+	bool ret;
+
+	spinlock_acquire(&coremap_lock);
+	cme = &coremap[coremap_runhead(paddr, "coremap_map")];
+	KASSERT(cme->cme_state == CME_USER);
+	KASSERT(cme->cme_busy);
+
+	cme->cme_ref = true;
+	if (cme->cme_refcount == 1) {
+		if (cme->cme_as == NULL) {
+			cme->cme_as = as;
+			cme->cme_vaddr = vaddr;
+			cme->cme_pte = pte;
+		}
+		KASSERT(cme->cme_as == as && cme->cme_vaddr == vaddr);
+		if (write) {
+			cme->cme_dirty = true;
+		}
+		ret = cme->cme_dirty;
+	}
+	else {
+		KASSERT(!write);
+		ret = false;
+	}
+
+	spinlock_release(&coremap_lock);
+	return ret;
+}
+
+/*
+ * Record that the pinned user page PADDR was just read in from swap
+ * slot SLOT and is a clean copy of it. The slot now belongs to the
+ * page and is freed with it.
+ */
+void
+coremap_setswapslot(paddr_t paddr, unsigned slot)
+{
+	struct coremap_entry *cme;
+
+	spinlock_acquire(&coremap_lock);
+	cme = &coremap[coremap_runhead(paddr, "coremap_setswapslot")];
+	KASSERT(cme->cme_state == CME_USER);
+	KASSERT(cme->cme_busy);
+	KASSERT(cme->cme_swapslot == SWAP_NOSLOT);
+	cme->cme_swapslot = slot;
+	cme->cme_dirty = false;
+	spinlock_release(&coremap_lock);
+}
+
+/*
+ * Attach PRIV to the page PADDR of an allocated kernel run, for
+ * whoever allocated it (kmalloc uses this to find its page and slab
+ * records). It is cleared when the run is freed, including when a
+ * single page goes into a CPU's free page cache.
+ */
+void
+coremap_setprivate(paddr_t paddr, void *priv)
+{
+	struct coremap_entry *cme;
+
+	KASSERT(paddr % PAGE_SIZE == 0);
+	KASSERT(paddr / PAGE_SIZE < coremap_npages);
+
+	spinlock_acquire(&coremap_lock);
+	cme = &coremap[paddr / PAGE_SIZE];
+	if (cme->cme_state != CME_KERNEL) {
+		panic("coremap_setprivate: 0x%x is not a kernel page\n",
+		      paddr);
+	}
+	cme->cme_private = priv;
+	spinlock_release(&coremap_lock);
+}
+
+/*
+ * Return what was attached to the kernel page PADDR with
+ * coremap_setprivate, or NULL. No lock is taken: the caller must own
+ * the page, so that it can't be freed or handed out again meanwhile.
+ */
+void *
+coremap_getprivate(paddr_t paddr)
+{
+	struct coremap_entry *cme;
+
+	KASSERT(paddr % PAGE_SIZE == 0);
+	KASSERT(paddr / PAGE_SIZE < coremap_npages);
+	cme = &coremap[paddr / PAGE_SIZE];
+	if (cme->cme_state != CME_KERNEL) {
+		return NULL;
+	}
+	return cme->cme_private;
+}
+
+/*
+ * Print how well each CPU's free page cache is doing.
+ */
+void
+coremap_printstats(void)
+{
+	struct cpu *c;
+	unsigned i;
+
+	kprintf("coremap: %u pages free\n", coremap_nfree);
+	for (i=0; i<cpu_numcpus(); i++) {
+		c = cpu_getcpu(i);
+		kprintf("cpu%u: %u page cache hits, %u misses, "
+			"%u pages cached\n", c->c_number,
+			c->c_freepagehits, c->c_freepagemisses,
+			c->c_nfreepages);
+	}
+}
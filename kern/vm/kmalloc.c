@@ -28,9 +28,15 @@
  */
 
 #include <types.h>
+#include <stdarg.h>
 #include <lib.h>
+#include <spl.h>
 #include <spinlock.h>
+#include <current.h>
+#include <cpu.h>
 #include <vm.h>
+#include <coremap.h>
+#include <platform/maxcpus.h>
 
 /*
  * Kernel malloc.
@@ -131,6 +137,14 @@ static const size_t sizes[NSIZES] = { 16, 32, 64, 128, 256, 512, 1024, 2048 };
 #define SMALLEST_SUBPAGE_SIZE 16
 #define LARGEST_SUBPAGE_SIZE 2048
 
+/*
+ * Large block sizes, and the size in pages of the slabs each is cut
+ * from. At most 32 blocks fit in a slab.
+ */
+#define NLARGESIZES 4
+static const size_t largesizes[NLARGESIZES] = { 4096, 8192, 16384, 65536 };
+static const unsigned largeslabpages[NLARGESIZES] = { 4, 8, 16, 16 };
+
 #elif PAGE_SIZE == 8192
 #error "No support for 8k pages (yet?)"
 #else
@@ -160,10 +174,9 @@ struct pageref {
 ////////////////////////////////////////
 
 /*
- * Use one spinlock for the whole thing. Making parts of the kmalloc
- * logic per-cpu is worthwhile for scalability; however, for the time
- * being at least we won't, because it adds a lot of complexity and in
- * OS/161 performance and scalability aren't super-critical.
+ * Use one spinlock for the page freelists and pageref tables. Most
+ * allocations and frees don't take it at all; they are served from
+ * per-CPU magazines (see below).
  */
 
 static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
@@ -347,6 +360,296 @@ static struct pageref *allbase;
 
 ////////////////////////////////////////
 
+/*
+ * Record for a slab of large blocks. The slabs of each size are kept
+ * on a list, protected by kmalloc_spinlock.
+ */
+struct largeslab {
+	struct largeslab *ls_next;	/* next slab of the same size */
+	vaddr_t ls_addr;		/* address of first page */
+	unsigned ls_type;		/* index into largesizes[] */
+	unsigned ls_nfree;		/* number of free blocks */
+	uint32_t ls_freemap;		/* bit i set if block i is free */
+};
+
+static struct largeslab *largebases[NLARGESIZES];
+
+/*
+ * A slab's record is attached to the first page of each of its blocks
+ * with coremap_setprivate, like a pageref is to a subpage heap page.
+ * It is tagged by setting the low bit so the two can be told apart.
+ */
+#define LARGESLAB_TAG ((vaddr_t)0x1)
+
+////////////////////////////////////////
+
+/*
+ * Statistics.
+ *
+ * Counters are kept for each size class: the subpage sizes, then the
+ * large sizes, then whole-page allocations. Allocs, frees and the
+ * change in live bytes are counted per CPU with interrupts off, so
+ * the fast paths share nothing. A CPU folds its live byte count into
+ * the class totals whenever it takes kmalloc_spinlock on behalf of
+ * the class (see kheap_lock), and the high-water mark is updated
+ * then; it can therefore miss peaks by about what the per-CPU caches
+ * hold. Lock spins are polls while waiting for kmalloc_spinlock.
+ */
+
+#define KHEAP_NCLASSES (NSIZES + NLARGESIZES + 1)
+#define KHEAP_LARGE(blktype) (NSIZES + (blktype))
+#define KHEAP_PAGES (NSIZES + NLARGESIZES)
+
+struct kheap_cpustats {
+	unsigned kc_allocs;
+	unsigned kc_frees;
+	ssize_t kc_live;		/* bytes not yet folded in */
+};
+
+struct kheap_classstats {
+	size_t cs_live;			/* bytes */
+	size_t cs_highwater;		/* bytes */
+	unsigned cs_spins;
+};
+
+static struct kheap_cpustats kheap_cpustats[MAXCPUS][KHEAP_NCLASSES];
+
+/* Protected by kmalloc_spinlock. */
+static struct kheap_classstats kheap_classstats[KHEAP_NCLASSES];
+
+/*
+ * Count an allocation (ALLOC true) or free of BYTES bytes in class
+ * CLS. Before the first thread exists only the boot CPU is running,
+ * and it uses slot 0.
+ */
+static
+void
+kheap_count(unsigned cls, size_t bytes, bool alloc)
+{
+	struct kheap_cpustats *kc;
+	int spl;
+
+	spl = splhigh();
+	kc = &kheap_cpustats[CURCPU_EXISTS() ? curcpu->c_number : 0][cls];
+	if (alloc) {
+		kc->kc_allocs++;
+		kc->kc_live += bytes;
+	}
+	else {
+		kc->kc_frees++;
+		kc->kc_live -= bytes;
+	}
+	splx(spl);
+}
+
+/*
+ * Get kmalloc_spinlock on behalf of class CLS, counting how long we
+ * wait for it, and fold this CPU's live bytes for the class into the
+ * totals.
+ */
+static
+void
+kheap_lock(unsigned cls)
+{
+	struct kheap_cpustats *kc;
+	struct kheap_classstats *cs;
+	unsigned spins;
+
+	spins = spinlock_acquire_spins(&kmalloc_spinlock);
+
+	cs = &kheap_classstats[cls];
+	kc = &kheap_cpustats[CURCPU_EXISTS() ? curcpu->c_number : 0][cls];
+	cs->cs_spins += spins;
+	cs->cs_live += kc->kc_live;
+	kc->kc_live = 0;
+	if (cs->cs_live > cs->cs_highwater) {
+		cs->cs_highwater = cs->cs_live;
+	}
+}
+
+/*
+ * Sampled per-caller histogram. While kheap_samplerate is nonzero,
+ * every kheap_samplerate'th kmalloc on each CPU is charged to its
+ * caller. Callers that don't fit in the table are only counted in
+ * kheap_sampledropped.
+ */
+
+#define KHEAP_NCALLERS 64
+
+struct kheap_caller {
+	vaddr_t kr_caller;		/* return address of kmalloc call */
+	unsigned kr_count;		/* samples */
+	size_t kr_bytes;		/* bytes asked for in those samples */
+};
+
+static struct spinlock kheap_samplelock = SPINLOCK_INITIALIZER;
+static volatile unsigned kheap_samplerate;
+static unsigned kheap_samplecount[MAXCPUS];
+
+/* Protected by kheap_samplelock. */
+static struct kheap_caller kheap_callers[KHEAP_NCALLERS];
+static unsigned kheap_sampledropped;
+
+/*
+ * Note a kmalloc of SZ bytes from CALLER, if it is time to take a
+ * sample.
+ */
+static
+void
+kheap_sample(vaddr_t caller, size_t sz)
+{
+	struct kheap_caller *kr;
+	unsigned i, n, rate;
+	int spl;
+
+	rate = kheap_samplerate;
+	if (rate == 0) {
+		return;
+	}
+
+	spl = splhigh();
+	n = CURCPU_EXISTS() ? curcpu->c_number : 0;
+	if (++kheap_samplecount[n] < rate) {
+		splx(spl);
+		return;
+	}
+	kheap_samplecount[n] = 0;
+
+	spinlock_acquire(&kheap_samplelock);
+	i = (caller / sizeof(uint32_t)) % KHEAP_NCALLERS;
+	for (n=0; n<KHEAP_NCALLERS; n++) {
+		kr = &kheap_callers[(i + n) % KHEAP_NCALLERS];
+		if (kr->kr_caller == caller || kr->kr_caller == 0) {
+			kr->kr_caller = caller;
+			kr->kr_count++;
+			kr->kr_bytes += sz;
+			break;
+		}
+	}
+	if (n == KHEAP_NCALLERS) {
+		kheap_sampledropped++;
+	}
+	spinlock_release(&kheap_samplelock);
+
+	splx(spl);
+}
+
+/*
+ * Start sampling every RATE'th allocation on each CPU, or stop if
+ * RATE is 0. The histogram is cleared.
+ */
+void
+kheap_setsamplerate(unsigned rate)
+{
+	unsigned i;
+
+	spinlock_acquire(&kheap_samplelock);
+	for (i=0; i<KHEAP_NCALLERS; i++) {
+		kheap_callers[i].kr_caller = 0;
+		kheap_callers[i].kr_count = 0;
+		kheap_callers[i].kr_bytes = 0;
+	}
+	kheap_sampledropped = 0;
+	kheap_samplerate = rate;
+	spinlock_release(&kheap_samplelock);
+}
+
+/*
+ * Append to the text being built in BUF.
+ */
+static
+void
+kheap_put(char *buf, size_t maxlen, size_t *len, const char *fmt, ...)
+{
+	va_list ap;
+	size_t pos;
+
+	pos = *len < maxlen ? *len : maxlen;
+	va_start(ap, fmt);
+	*len += vsnprintf(buf + pos, maxlen - pos, fmt, ap);
+	va_end(ap);
+}
+
+/*
+ * Write the size class counters and the caller histogram into BUF as
+ * text. Like snprintf, returns the length the whole thing needs,
+ * which may be more than was written.
+ */
+size_t
+kheap_getstats(char *buf, size_t maxlen)
+{
+	struct kheap_classstats cs;
+	struct kheap_caller *kr;
+	unsigned allocs, frees, i, j;
+	size_t blocksize, len;
+	ssize_t live;
+
+	len = 0;
+	kheap_put(buf, maxlen, &len, "%8s %9s %9s %11s %11s %8s\n",
+		  "size", "allocs", "frees", "live", "highwater", "spins");
+
+	for (i=0; i<KHEAP_NCLASSES; i++) {
+		allocs = frees = 0;
+		live = 0;
+		for (j=0; j<MAXCPUS; j++) {
+			allocs += kheap_cpustats[j][i].kc_allocs;
+			frees += kheap_cpustats[j][i].kc_frees;
+			live += kheap_cpustats[j][i].kc_live;
+		}
+		spinlock_acquire(&kmalloc_spinlock);
+		cs = kheap_classstats[i];
+		spinlock_release(&kmalloc_spinlock);
+		live += cs.cs_live;
+		if (live > (ssize_t)cs.cs_highwater) {
+			cs.cs_highwater = live;
+		}
+
+		if (i < NSIZES) {
+			blocksize = sizes[i];
+		}
+		else if (i < KHEAP_PAGES) {
+			blocksize = largesizes[i - NSIZES];
+		}
+		else {
+			blocksize = 0;
+		}
+		if (blocksize > 0) {
+			kheap_put(buf, maxlen, &len, "%8zu", blocksize);
+		}
+		else {
+			kheap_put(buf, maxlen, &len, "%8s", "pages");
+		}
+		kheap_put(buf, maxlen, &len, " %9u %9u %11zd %11zu %8u\n",
+			  allocs, frees, live, cs.cs_highwater, cs.cs_spins);
+	}
+
+	spinlock_acquire(&kheap_samplelock);
+	if (kheap_samplerate == 0) {
+		kheap_put(buf, maxlen, &len, "Caller sampling is off.\n");
+	}
+	else {
+		kheap_put(buf, maxlen, &len,
+			  "Callers, sampling 1 in %u (%u samples dropped):\n",
+			  kheap_samplerate, kheap_sampledropped);
+		kheap_put(buf, maxlen, &len, "%10s %9s %11s\n",
+			  "caller", "samples", "bytes");
+		for (i=0; i<KHEAP_NCALLERS; i++) {
+			kr = &kheap_callers[i];
+			if (kr->kr_caller != 0) {
+				kheap_put(buf, maxlen, &len,
+					  "0x%08lx %9u %11zu\n",
+					  (unsigned long)kr->kr_caller,
+					  kr->kr_count, kr->kr_bytes);
+			}
+		}
+	}
+	spinlock_release(&kheap_samplelock);
+
+	return len;
+}
+
+////////////////////////////////////////
+
 #ifdef GUARDS
 
 /* Space returned to the client is filled with GUARD_RETBYTE */
@@ -794,6 +1097,16 @@ subpage_stats(struct pageref *pr)
 	kprintf("\n");
 }
 
+/*
+ * Early setup. Just lists kmalloc_spinlock with the spinlock
+ * statistics.
+ */
+void
+kheap_bootstrap(void)
+{
+	spinlock_register(&kmalloc_spinlock, "kmalloc");
+}
+
 /*
  * Print the whole heap.
  */
@@ -801,6 +1114,8 @@ void
 kheap_printstats(void)
 {
 	struct pageref *pr;
+	struct largeslab *ls;
+	unsigned i, nblocks;
 
 	/* print the whole thing with interrupts off */
 	spinlock_acquire(&kmalloc_spinlock);
@@ -811,6 +1126,18 @@ kheap_printstats(void)
 		subpage_stats(pr);
 	}
 
+	kprintf("Large block allocator status:\n");
+
+	for (i=0; i<NLARGESIZES; i++) {
+		nblocks = largeslabpages[i] * PAGE_SIZE / largesizes[i];
+		for (ls = largebases[i]; ls != NULL; ls = ls->ls_next) {
+			kprintf("at 0x%08lx: size %-5lu  %u/%u free\n",
+				(unsigned long)ls->ls_addr,
+				(unsigned long)largesizes[i],
+				ls->ls_nfree, nblocks);
+		}
+	}
+
 	spinlock_release(&kmalloc_spinlock);
 }
 
@@ -866,46 +1193,266 @@ int blocktype(size_t clientsz)
 	return 0;
 }
 
+////////////////////////////////////////
+
 /*
- * Allocate a block of size SZ, where SZ is not large enough to
- * warrant a whole-page allocation.
+ * Per-CPU magazines.
+ *
+ * Each CPU keeps, for each block size, a stack of up to two
+ * magazines' worth (2 * KMAG_SIZE) of free blocks. kmalloc and kfree
+ * use it without taking kmalloc_spinlock. When the stack runs dry a
+ * magazine's worth of blocks is taken from the page freelists in one
+ * go, and when it fills up the oldest magazine's worth goes back; the
+ * page freelists thus serve as the depot.
+ *
+ * Blocks sitting in a magazine still count as allocated as far as the
+ * page freelists (and kheap_printstats) are concerned. They are
+ * deadbeefed when freed like any other free block, which also keeps
+ * kheap_dump from reporting them.
+ *
+ * A CPU's magazines are only touched by that CPU with interrupts off.
+ * Before the first thread exists there is no curcpu, and everything
+ * goes straight to the page freelists.
+ */
+
+#define KMAG_SIZE 8
+
+struct kmalloc_mag {
+	unsigned km_count;
+	vaddr_t km_blocks[2 * KMAG_SIZE];
+};
+
+static struct kmalloc_mag kmalloc_mags[MAXCPUS][NSIZES];
+
+/*
+ * Find the pageref for the heap page holding the block at BLOCKADDR,
+ * or NULL if it isn't a subpage block. The pageref is kept in the
+ * coremap, so no lock is needed as long as the caller owns the block.
+ * Large slabs keep their records there too, tagged with LARGESLAB_TAG.
  */
 static
-void *
-subpage_kmalloc(size_t sz
-#ifdef LABELS
-		, vaddr_t label
-#endif
-	)
+struct pageref *
+subpage_lookup(vaddr_t blockaddr)
+{
+	void *priv;
+
+	priv = coremap_getprivate(KVADDR_TO_PADDR(blockaddr & PAGE_FRAME));
+	if (((vaddr_t)priv & LARGESLAB_TAG) != 0) {
+		return NULL;
+	}
+	return priv;
+}
+
+/*
+ * Take a block off the freelist of PR, which must have one.
+ */
+static
+vaddr_t
+subpage_takeblock(struct pageref *pr)
 {
-	unsigned blktype;	// index into sizes[] that we're using
-	struct pageref *pr;	// pageref for page we're allocating from
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
 	vaddr_t fla;		// free list entry address
-	struct freelist *volatile fl;	// free list entry
-	void *retptr;		// our result
+	struct freelist *fl;	// free list entry
+	vaddr_t ret;
 
-	volatile int i;
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	KASSERT(pr->nfree > 0);
+	KASSERT(pr->freelist_offset < PAGE_SIZE);
+	prpage = PR_PAGEADDR(pr);
+	fla = prpage + pr->freelist_offset;
+	fl = (struct freelist *)fla;
 
-#ifdef GUARDS
-	size_t clientsz;
-#endif
+	ret = fla;
+	fl = fl->next;
+	pr->nfree--;
 
-#ifdef GUARDS
-	clientsz = sz;
-	sz += GUARD_OVERHEAD;
-#endif
-#ifdef LABELS
-#ifdef GUARDS
-	/* Include the label in what GUARDS considers the client data. */
-	clientsz += LABEL_PTROFFSET;
-#endif
-	sz += LABEL_PTROFFSET;
+	if (fl != NULL) {
+		KASSERT(pr->nfree > 0);
+		fla = (vaddr_t)fl;
+		KASSERT(fla - prpage < PAGE_SIZE);
+		pr->freelist_offset = fla - prpage;
+	}
+	else {
+		KASSERT(pr->nfree == 0);
+		pr->freelist_offset = INVALID_OFFSET;
+	}
+	return ret;
+}
+
+/*
+ * Put the (already deadbeefed) block at BLOCKADDR back on the
+ * freelist of PR. If that leaves the whole page free, the page is
+ * taken out of the heap and its address is returned; the caller
+ * should pass it to free_kpages once kmalloc_spinlock is released.
+ * Otherwise returns 0.
+ */
+static
+vaddr_t
+subpage_putblock(struct pageref *pr, vaddr_t blockaddr)
+{
+	int blktype;		// index into sizes[] that we're using
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	struct freelist *fl;	// free list entry
+	vaddr_t offset;		// offset into page
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
+	offset = blockaddr - prpage;
+
+	/*
+	 * We probably ought to check for free twice by seeing if the block
+	 * is already on the free list. But that's expensive, so we don't.
+	 */
+
+	fl = (struct freelist *)blockaddr;
+	if (pr->freelist_offset == INVALID_OFFSET) {
+		fl->next = NULL;
+	} else {
+		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
+
+		/* this block should not already be on the free list! */
+#ifdef SLOW
+		{
+			struct freelist *fl2;
+
+			for (fl2 = fl->next; fl2 != NULL; fl2 = fl2->next) {
+				KASSERT(fl2 != fl);
+			}
+		}
+#else
+		/* check just the head */
+		KASSERT(fl != fl->next);
 #endif
-	blktype = blocktype(sz);
-	sz = sizes[blktype];
+	}
+	pr->freelist_offset = offset;
+	pr->nfree++;
 
-	spinlock_acquire(&kmalloc_spinlock);
+	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
+	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
+		/* Whole page is free. */
+		remove_lists(pr, blktype);
+		freepageref(pr);
+		coremap_setprivate(KVADDR_TO_PADDR(prpage), NULL);
+		return prpage;
+	}
+	return 0;
+}
+
+/*
+ * Take a block of type BLKTYPE from this CPU's magazines, refilling
+ * them from the page freelists if they are empty. Returns 0 if there
+ * is no free block on any existing heap page.
+ */
+static
+vaddr_t
+kmag_alloc(unsigned blktype)
+{
+	struct kmalloc_mag *km;
+	struct pageref *pr;
+	vaddr_t ret;
+	int spl;
+
+	if (!CURCPU_EXISTS()) {
+		return 0;
+	}
+
+	spl = splhigh();
+	km = &kmalloc_mags[curcpu->c_number][blktype];
+
+	if (km->km_count == 0) {
+		kheap_lock(blktype);
+		checksubpages();
+		for (pr = sizebases[blktype];
+		     pr != NULL && km->km_count < KMAG_SIZE;
+		     pr = pr->next_samesize) {
+			KASSERT(PR_BLOCKTYPE(pr) == blktype);
+			checksubpage(pr);
+			while (pr->nfree > 0 && km->km_count < KMAG_SIZE) {
+				km->km_blocks[km->km_count++] =
+					subpage_takeblock(pr);
+			}
+		}
+		checksubpages();
+		spinlock_release(&kmalloc_spinlock);
+	}
+
+	ret = 0;
+	if (km->km_count > 0) {
+		ret = km->km_blocks[--km->km_count];
+	}
+	splx(spl);
+	return ret;
+}
+
+/*
+ * Put the free block at BLOCKADDR, of type BLKTYPE, in this CPU's
+ * magazines, first sending the oldest magazine's worth back to the
+ * page freelists if they are full. Returns false if there are no
+ * magazines to use yet.
+ */
+static
+bool
+kmag_free(unsigned blktype, vaddr_t blockaddr)
+{
+	struct kmalloc_mag *km;
+	vaddr_t freepages[KMAG_SIZE];
+	unsigned i, nfreepages;
+	int spl;
+
+	if (!CURCPU_EXISTS()) {
+		return false;
+	}
+
+	spl = splhigh();
+	km = &kmalloc_mags[curcpu->c_number][blktype];
+
+	if (km->km_count == 2 * KMAG_SIZE) {
+		nfreepages = 0;
+		kheap_lock(blktype);
+		checksubpages();
+		for (i=0; i<KMAG_SIZE; i++) {
+			freepages[nfreepages] = subpage_putblock(
+				subpage_lookup(km->km_blocks[i]),
+				km->km_blocks[i]);
+			if (freepages[nfreepages] != 0) {
+				nfreepages++;
+			}
+		}
+		checksubpages();
+		/* Call free_kpages without kmalloc_spinlock. */
+		spinlock_release(&kmalloc_spinlock);
+		for (i=0; i<nfreepages; i++) {
+			free_kpages(freepages[i]);
+		}
+
+		for (i=KMAG_SIZE; i<2 * KMAG_SIZE; i++) {
+			km->km_blocks[i - KMAG_SIZE] = km->km_blocks[i];
+		}
+		km->km_count -= KMAG_SIZE;
+	}
+	km->km_blocks[km->km_count++] = blockaddr;
+
+	splx(spl);
+	return true;
+}
+
+/*
+ * Get a block of type BLKTYPE from the page freelists, making a new
+ * heap page if none has a free block.
+ */
+static
+vaddr_t
+subpage_getblock(unsigned blktype)
+{
+	struct pageref *pr;	// pageref for page we're allocating from
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t fla;		// free list entry address
+	struct freelist *volatile fl;	// free list entry
+	vaddr_t ret;		// our result
+	volatile int i;
+
+	kheap_lock(blktype);
 
 	checksubpages();
 
@@ -919,36 +1466,12 @@ subpage_kmalloc(size_t sz
 
 		doalloc: /* comes here after getting a whole fresh page */
 
-			KASSERT(pr->freelist_offset < PAGE_SIZE);
-			prpage = PR_PAGEADDR(pr);
-			fla = prpage + pr->freelist_offset;
-			fl = (struct freelist *)fla;
-
-			retptr = fl;
-			fl = fl->next;
-			pr->nfree--;
-
-			if (fl != NULL) {
-				KASSERT(pr->nfree > 0);
-				fla = (vaddr_t)fl;
-				KASSERT(fla - prpage < PAGE_SIZE);
-				pr->freelist_offset = fla - prpage;
-			}
-			else {
-				KASSERT(pr->nfree == 0);
-				pr->freelist_offset = INVALID_OFFSET;
-			}
-#ifdef GUARDS
-			retptr = establishguardband(retptr, clientsz, sz);
-#endif
-#ifdef LABELS
-			retptr = establishlabel(retptr, label);
-#endif
+			ret = subpage_takeblock(pr);
 
 			checksubpages();
 
 			spinlock_release(&kmalloc_spinlock);
-			return retptr;
+			return ret;
 		}
 	}
 
@@ -966,14 +1489,14 @@ subpage_kmalloc(size_t sz
 	if (prpage==0) {
 		/* Out of memory. */
 		kprintf("kmalloc: Subpage allocator couldn't get a page\n");
-		return NULL;
+		return 0;
 	}
 	KASSERT(prpage % PAGE_SIZE == 0);
 #ifdef CHECKBEEF
 	/* deadbeef the whole page, as it probably starts zeroed */
 	fill_deadbeef((void *)prpage, PAGE_SIZE);
 #endif
-	spinlock_acquire(&kmalloc_spinlock);
+	kheap_lock(blktype);
 
 	pr = allocpageref();
 	if (pr==NULL) {
@@ -981,7 +1504,7 @@ subpage_kmalloc(size_t sz
 		spinlock_release(&kmalloc_spinlock);
 		free_kpages(prpage);
 		kprintf("kmalloc: Subpage allocator couldn't get pageref\n");
-		return NULL;
+		return 0;
 	}
 
 	pr->pageaddr_and_blocktype = MKPAB(prpage, blktype);
@@ -1011,10 +1534,66 @@ subpage_kmalloc(size_t sz
 	pr->next_all = allbase;
 	allbase = pr;
 
+	/* Let kfree find the pageref without searching. */
+	coremap_setprivate(KVADDR_TO_PADDR(prpage), pr);
+
 	/* This is kind of cheesy, but avoids duplicating the alloc code. */
 	goto doalloc;
 }
 
+/*
+ * Allocate a block of size SZ, where SZ is not large enough to
+ * warrant a whole-page allocation.
+ */
+static
+void *
+subpage_kmalloc(size_t sz
+#ifdef LABELS
+		, vaddr_t label
+#endif
+	)
+{
+	unsigned blktype;	// index into sizes[] that we're using
+	void *retptr;		// our result
+	vaddr_t block;
+#ifdef GUARDS
+	size_t clientsz;
+#endif
+
+#ifdef GUARDS
+	clientsz = sz;
+	sz += GUARD_OVERHEAD;
+#endif
+#ifdef LABELS
+#ifdef GUARDS
+	/* Include the label in what GUARDS considers the client data. */
+	clientsz += LABEL_PTROFFSET;
+#endif
+	sz += LABEL_PTROFFSET;
+#endif
+	blktype = blocktype(sz);
+	sz = sizes[blktype];
+
+	block = kmag_alloc(blktype);
+	if (block == 0) {
+		block = subpage_getblock(blktype);
+		if (block == 0) {
+			return NULL;
+		}
+	}
+	kheap_count(blktype, sz, true);
+	retptr = (void *)block;
+
+#ifdef GUARDS
+	retptr = establishguardband(retptr, clientsz, sz);
+#endif
+#ifdef LABELS
+	retptr = establishlabel(retptr, label);
+#endif
+
+	return retptr;
+}
+
 /*
  * Free a pointer previously returned from subpage_kmalloc. If the
  * pointer is not on any heap page we recognize, return -1.
@@ -1027,8 +1606,6 @@ subpage_kfree(void *ptr)
 	vaddr_t ptraddr;	// same as ptr
 	struct pageref *pr;	// pageref for page we're freeing in
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
-	vaddr_t fla;		// free list entry address
-	struct freelist *fl;	// free list entry
 	vaddr_t offset;		// offset into page
 #ifdef GUARDS
 	size_t blocksize, smallerblocksize;
@@ -1059,30 +1636,17 @@ subpage_kfree(void *ptr)
 	ptraddr -= LABEL_PTROFFSET;
 #endif
 
-	spinlock_acquire(&kmalloc_spinlock);
-
-	checksubpages();
-
-	for (pr = allbase; pr; pr = pr->next_all) {
-		prpage = PR_PAGEADDR(pr);
-		blktype = PR_BLOCKTYPE(pr);
-		KASSERT(blktype >= 0 && blktype < NSIZES);
-
-		/* check for corruption */
-		KASSERT(blktype>=0 && blktype<NSIZES);
-		checksubpage(pr);
-
-		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
-			break;
-		}
-	}
-
+	pr = subpage_lookup(ptraddr);
 	if (pr==NULL) {
 		/* Not on any of our pages - not a subpage allocation */
-		spinlock_release(&kmalloc_spinlock);
 		return -1;
 	}
 
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
+	KASSERT(blktype >= 0 && blktype < NSIZES);
+	KASSERT(ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE);
+
 	offset = ptraddr - prpage;
 
 	/* Check for proper positioning and alignment */
@@ -1102,54 +1666,293 @@ subpage_kfree(void *ptr)
 	 */
 	fill_deadbeef((void *)ptraddr, sizes[blktype]);
 
-	/*
-	 * We probably ought to check for free twice by seeing if the block
-	 * is already on the free list. But that's expensive, so we don't.
-	 */
+	kheap_count(blktype, sizes[blktype], false);
 
-	fla = prpage + offset;
-	fl = (struct freelist *)fla;
-	if (pr->freelist_offset == INVALID_OFFSET) {
-		fl->next = NULL;
-	} else {
-		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
+	if (kmag_free(blktype, ptraddr)) {
+		return 0;
+	}
 
-		/* this block should not already be on the free list! */
-#ifdef SLOW
-		{
-			struct freelist *fl2;
+	kheap_lock(blktype);
+	checksubpages();
+	prpage = subpage_putblock(pr, ptraddr);
+	checksubpages();
+	/* Call free_kpages without kmalloc_spinlock. */
+	spinlock_release(&kmalloc_spinlock);
+	if (prpage != 0) {
+		free_kpages(prpage);
+	}
 
-			for (fl2 = fl->next; fl2 != NULL; fl2 = fl2->next) {
-				KASSERT(fl2 != fl);
+	return 0;
+}
+
+//
+////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////
+//
+// Large block allocator.
+//
+//    Allocations too big for the subpage allocator that fit one of
+//    largesizes[] are cut from multi-page slabs, rather than each
+//    getting its own run from alloc_kpages. Slabs hold several blocks,
+//    except for the largest size.
+//
+//    On top of that each CPU keeps up to LARGECACHE_SIZE recently
+//    freed blocks of each size, which it hands back out without
+//    taking any lock. Blocks in these caches still count as allocated
+//    in their slab.
+//
+//    Requests for which the smallest large size that fits is at least
+//    twice as big (20K would need a 64K block) and requests
+//    beyond the largest size go straight to alloc_kpages as before.
+//
+
+#define LARGECACHE_SIZE 2
+
+struct largecache {
+	unsigned lc_count;
+	vaddr_t lc_blocks[LARGECACHE_SIZE];
+};
+
+static struct largecache largecaches[MAXCPUS][NLARGESIZES];
+
+/*
+ * Return the index into largesizes[] to use for a request of SZ
+ * bytes, or -1 if it should get whole pages.
+ */
+static
+int
+large_blocktype(size_t sz)
+{
+	unsigned i;
+
+	for (i=0; i<NLARGESIZES; i++) {
+		if (sz <= largesizes[i]) {
+			if (i > 0 && sz <= largesizes[i] / 2) {
+				return -1;
 			}
+			return i;
 		}
-#else
-		/* check just the head */
-		KASSERT(fl != fl->next);
-#endif
 	}
-	pr->freelist_offset = offset;
-	pr->nfree++;
+	return -1;
+}
 
-	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
-	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
-		/* Whole page is free. */
-		remove_lists(pr, blktype);
-		freepageref(pr);
-		/* Call free_kpages without kmalloc_spinlock. */
-		spinlock_release(&kmalloc_spinlock);
-		free_kpages(prpage);
+/*
+ * Find the slab holding the large block at BLOCKADDR, or NULL if it
+ * isn't one. As with subpage_lookup, no lock is needed as long as the
+ * caller owns the block.
+ */
+static
+struct largeslab *
+large_lookup(vaddr_t blockaddr)
+{
+	vaddr_t priv;
+
+	KASSERT(blockaddr % PAGE_SIZE == 0);
+	priv = (vaddr_t)coremap_getprivate(KVADDR_TO_PADDR(blockaddr));
+	if ((priv & LARGESLAB_TAG) == 0) {
+		return NULL;
 	}
-	else {
+	return (struct largeslab *)(priv & ~LARGESLAB_TAG);
+}
+
+/*
+ * Attach PRIV to the first page of each block of slab LS.
+ */
+static
+void
+large_setprivate(struct largeslab *ls, void *priv)
+{
+	vaddr_t block, end;
+
+	end = ls->ls_addr + largeslabpages[ls->ls_type] * PAGE_SIZE;
+	for (block = ls->ls_addr; block < end;
+	     block += largesizes[ls->ls_type]) {
+		coremap_setprivate(KVADDR_TO_PADDR(block), priv);
+	}
+}
+
+/*
+ * Get a block of type BLKTYPE from the slabs, making a new slab if
+ * none has a free block.
+ */
+static
+vaddr_t
+large_getblock(unsigned blktype)
+{
+	struct largeslab *ls;
+	unsigned i, nblocks;
+	vaddr_t ret;
+
+	nblocks = largeslabpages[blktype] * PAGE_SIZE / largesizes[blktype];
+
+	kheap_lock(KHEAP_LARGE(blktype));
+	for (ls = largebases[blktype]; ls != NULL; ls = ls->ls_next) {
+		if (ls->ls_nfree > 0) {
+			goto doalloc;
+		}
+	}
+
+	/*
+	 * Make a new slab. As in subpage_getblock, we can't hold the
+	 * spinlock across alloc_kpages (or kmalloc).
+	 */
+	spinlock_release(&kmalloc_spinlock);
+
+	ls = kmalloc(sizeof(*ls));
+	if (ls == NULL) {
+		return 0;
+	}
+	ls->ls_addr = alloc_kpages(largeslabpages[blktype]);
+	if (ls->ls_addr == 0) {
+		kfree(ls);
+		kprintf("kmalloc: Large block allocator couldn't get "
+			"%u pages\n", largeslabpages[blktype]);
+		return 0;
+	}
+	ls->ls_type = blktype;
+	ls->ls_nfree = nblocks;
+	ls->ls_freemap = nblocks == 32 ? 0xffffffff :
+		((uint32_t)1 << nblocks) - 1;
+
+	/* Let kfree find the slab. */
+	large_setprivate(ls, (void *)((vaddr_t)ls | LARGESLAB_TAG));
+
+	kheap_lock(KHEAP_LARGE(blktype));
+	ls->ls_next = largebases[blktype];
+	largebases[blktype] = ls;
+
+ doalloc:
+	KASSERT(ls->ls_nfree > 0);
+	for (i=0; (ls->ls_freemap & ((uint32_t)1 << i)) == 0; i++) {
+		KASSERT(i < nblocks);
+	}
+	ls->ls_freemap &= ~((uint32_t)1 << i);
+	ls->ls_nfree--;
+	ret = ls->ls_addr + i * largesizes[blktype];
+
+	spinlock_release(&kmalloc_spinlock);
+	return ret;
+}
+
+/*
+ * Give back the block at BLOCKADDR to its slab LS. If that leaves the
+ * whole slab free, it is destroyed.
+ */
+static
+void
+large_putblock(struct largeslab *ls, vaddr_t blockaddr)
+{
+	struct largeslab **lsp;
+	unsigned i, nblocks;
+
+	nblocks = largeslabpages[ls->ls_type] * PAGE_SIZE /
+		largesizes[ls->ls_type];
+	i = (blockaddr - ls->ls_addr) / largesizes[ls->ls_type];
+
+	kheap_lock(KHEAP_LARGE(ls->ls_type));
+
+	if ((ls->ls_freemap & ((uint32_t)1 << i)) != 0) {
+		panic("kfree: large block %p freed twice\n",
+		      (void *)blockaddr);
+	}
+	ls->ls_freemap |= (uint32_t)1 << i;
+	ls->ls_nfree++;
+
+	if (ls->ls_nfree < nblocks) {
 		spinlock_release(&kmalloc_spinlock);
+		return;
 	}
 
-#ifdef SLOWER /* Don't get the lock unless checksubpages does something. */
-	spinlock_acquire(&kmalloc_spinlock);
-	checksubpages();
+	for (lsp = &largebases[ls->ls_type]; *lsp != ls;
+	     lsp = &(*lsp)->ls_next) {
+		KASSERT(*lsp != NULL);
+	}
+	*lsp = ls->ls_next;
+
 	spinlock_release(&kmalloc_spinlock);
-#endif
 
+	large_setprivate(ls, NULL);
+	free_kpages(ls->ls_addr);
+	kfree(ls);
+}
+
+/*
+ * Allocate a large block of type BLKTYPE, preferably from this CPU's
+ * cache.
+ */
+static
+void *
+large_kmalloc(unsigned blktype)
+{
+	struct largecache *lc;
+	vaddr_t block;
+	int spl;
+
+	block = 0;
+	if (CURCPU_EXISTS()) {
+		spl = splhigh();
+		lc = &largecaches[curcpu->c_number][blktype];
+		if (lc->lc_count > 0) {
+			block = lc->lc_blocks[--lc->lc_count];
+		}
+		splx(spl);
+	}
+
+	if (block == 0) {
+		block = large_getblock(blktype);
+		if (block == 0) {
+			return NULL;
+		}
+	}
+	kheap_count(KHEAP_LARGE(blktype), largesizes[blktype], true);
+	return (void *)block;
+}
+
+/*
+ * Free a pointer previously returned from large_kmalloc, keeping it
+ * in this CPU's cache if there's room. If the pointer is not a large
+ * block, return -1.
+ */
+static
+int
+large_kfree(void *ptr)
+{
+	struct largecache *lc;
+	struct largeslab *ls;
+	vaddr_t ptraddr;
+	unsigned blktype;
+	int spl;
+
+	ptraddr = (vaddr_t)ptr;
+	if (ptraddr % PAGE_SIZE != 0) {
+		return -1;
+	}
+	ls = large_lookup(ptraddr);
+	if (ls == NULL) {
+		return -1;
+	}
+
+	blktype = ls->ls_type;
+	if (ptraddr - ls->ls_addr >= largeslabpages[blktype] * PAGE_SIZE ||
+	    (ptraddr - ls->ls_addr) % largesizes[blktype] != 0) {
+		panic("kfree: large free of invalid addr %p\n", ptr);
+	}
+
+	kheap_count(KHEAP_LARGE(blktype), largesizes[blktype], false);
+
+	if (CURCPU_EXISTS()) {
+		spl = splhigh();
+		lc = &largecaches[curcpu->c_number][blktype];
+		if (lc->lc_count < LARGECACHE_SIZE) {
+			lc->lc_blocks[lc->lc_count++] = ptraddr;
+			splx(spl);
+			return 0;
+		}
+		splx(spl);
+	}
+
+	large_putblock(ls, ptraddr);
 	return 0;
 }
 
@@ -1157,29 +1960,34 @@ subpage_kfree(void *ptr)
 ////////////////////////////////////////////////////////////
 
 /*
- * Allocate a block of size SZ. Redirect either to subpage_kmalloc or
- * alloc_kpages depending on how big SZ is.
+ * Allocate a block of size SZ. Redirect to subpage_kmalloc,
+ * large_kmalloc, or alloc_kpages depending on how big SZ is.
  */
 void *
 kmalloc(size_t sz)
 {
 	size_t checksz;
-#ifdef LABELS
 	vaddr_t label;
-#endif
 
-#ifdef LABELS
+	/* The caller is wanted for LABELS and for sampling. */
 #ifdef __GNUC__
 	label = (vaddr_t)__builtin_return_address(0);
 #else
 #error "Don't know how to get return address with this compiler"
 #endif /* __GNUC__ */
-#endif /* LABELS */
+
+	kheap_sample(label, sz);
 
 	checksz = sz + GUARD_OVERHEAD + LABEL_OVERHEAD;
 	if (checksz >= LARGEST_SUBPAGE_SIZE) {
 		unsigned long npages;
 		vaddr_t address;
+		int blktype;
+
+		blktype = large_blocktype(sz);
+		if (blktype >= 0) {
+			return large_kmalloc(blktype);
+		}
 
 		/* Round up to a whole number of pages. */
 		npages = (sz + PAGE_SIZE - 1)/PAGE_SIZE;
@@ -1189,6 +1997,11 @@ kmalloc(size_t sz)
 		}
 		KASSERT(address % PAGE_SIZE == 0);
 
+		/* These are rare; fold the count in every time. */
+		kheap_count(KHEAP_PAGES, npages * PAGE_SIZE, true);
+		kheap_lock(KHEAP_PAGES);
+		spinlock_release(&kmalloc_spinlock);
+
 		return (void *)address;
 	}
 
@@ -1206,12 +2019,18 @@ void
 kfree(void *ptr)
 {
 	/*
-	 * Try subpage first; if that fails, assume it's a big allocation.
+	 * Try subpage first, then large blocks; if both fail, assume
+	 * it's a whole-page allocation.
 	 */
 	if (ptr == NULL) {
 		return;
-	} else if (subpage_kfree(ptr)) {
+	} else if (subpage_kfree(ptr) && large_kfree(ptr)) {
 		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
+		kheap_count(KHEAP_PAGES, PAGE_SIZE *
+			    coremap_runlength(KVADDR_TO_PADDR((vaddr_t)ptr)),
+			    false);
+		kheap_lock(KHEAP_PAGES);
+		spinlock_release(&kmalloc_spinlock);
 		free_kpages((vaddr_t)ptr);
 	}
 }
@@ -0,0 +1,289 @@
+/*
+ * Object caches (see objcache.h).
+ *
+ * Each slab is one page. It starts with a struct ocslab header, and
+ * the objects follow at a fixed stride. A free object is linked to the
+ * next one through a word placed just past the object itself, so the
+ * object's constructed contents are never disturbed.
+ *
+ * Slabs with at least one free object are kept on the cache's list.
+ * Full slabs are on no list; the slab an object belongs to is found
+ * by rounding its address down to the page. Up to OBJCACHE_KEEPSLABS
+ * completely free slabs are kept around so that a burst of frees and
+ * allocations doesn't keep building and tearing down slabs; beyond
+ * that they are destroyed and their pages given back.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vm.h>
+#include <objcache.h>
+
+/* Completely free slabs a cache holds on to. */
+#define OBJCACHE_KEEPSLABS 1
+
+/* Alignment used when the caller doesn't ask for any. */
+#define OBJCACHE_ALIGN 8
+
+struct ocslab {
+	struct objcache *os_cache;	/* cache we belong to */
+	struct ocslab *os_next;		/* links on oc_slabs */
+	struct ocslab *os_prev;
+	void *os_free;			/* free objects */
+	unsigned os_nfree;
+};
+
+struct objcache {
+	const char *oc_name;
+	size_t oc_linkoff;		/* offset of free link in object */
+	size_t oc_stride;		/* distance between objects */
+	size_t oc_first;		/* offset of first object in slab */
+	unsigned oc_perslab;		/* objects per slab */
+	int (*oc_ctor)(void *obj);
+	void (*oc_dtor)(void *obj);
+
+	struct spinlock oc_lock;	/* protects everything below */
+	struct ocslab *oc_slabs;	/* slabs with free objects */
+	unsigned oc_nslabs;		/* all slabs */
+	unsigned oc_nemptyslabs;	/* completely free slabs */
+};
+
+#define OBJ_LINK(oc, obj) (*(void **)((char *)(obj) + (oc)->oc_linkoff))
+
+////////////////////////////////////////////////////////////
+//
+// Slabs
+
+/*
+ * Make a new slab and construct all its objects. Called without the
+ * cache lock, as constructors may allocate memory or sleep.
+ */
+static
+struct ocslab *
+objcache_newslab(struct objcache *oc)
+{
+	struct ocslab *slab;
+	vaddr_t page;
+	char *obj;
+	unsigned i, j;
+
+	page = alloc_kpages(1);
+	if (page == 0) {
+		return NULL;
+	}
+	slab = (struct ocslab *)page;
+	slab->os_cache = oc;
+	slab->os_next = slab->os_prev = NULL;
+	slab->os_free = NULL;
+	slab->os_nfree = 0;
+
+	for (i=oc->oc_perslab; i-- > 0; ) {
+		obj = (char *)page + oc->oc_first + i * oc->oc_stride;
+		if (oc->oc_ctor != NULL && oc->oc_ctor(obj) != 0) {
+			/* Undo the ones after it, which were done first. */
+			for (j=i+1; j<oc->oc_perslab; j++) {
+				obj = (char *)page + oc->oc_first +
+					j * oc->oc_stride;
+				if (oc->oc_dtor != NULL) {
+					oc->oc_dtor(obj);
+				}
+			}
+			free_kpages(page);
+			return NULL;
+		}
+		OBJ_LINK(oc, obj) = slab->os_free;
+		slab->os_free = obj;
+		slab->os_nfree++;
+	}
+	return slab;
+}
+
+/*
+ * Destroy a completely free slab that is no longer on any list.
+ * Called without the cache lock.
+ */
+static
+void
+objcache_destroyslab(struct objcache *oc, struct ocslab *slab)
+{
+	char *obj;
+	unsigned i;
+
+	KASSERT(slab->os_nfree == oc->oc_perslab);
+	if (oc->oc_dtor != NULL) {
+		for (i=0; i<oc->oc_perslab; i++) {
+			obj = (char *)slab + oc->oc_first + i * oc->oc_stride;
+			oc->oc_dtor(obj);
+		}
+	}
+	free_kpages((vaddr_t)slab);
+}
+
+static
+void
+objcache_link(struct objcache *oc, struct ocslab *slab)
+{
+	KASSERT(spinlock_do_i_hold(&oc->oc_lock));
+	slab->os_prev = NULL;
+	slab->os_next = oc->oc_slabs;
+	if (oc->oc_slabs != NULL) {
+		oc->oc_slabs->os_prev = slab;
+	}
+	oc->oc_slabs = slab;
+}
+
+static
+void
+objcache_unlink(struct objcache *oc, struct ocslab *slab)
+{
+	KASSERT(spinlock_do_i_hold(&oc->oc_lock));
+	if (slab->os_prev != NULL) {
+		slab->os_prev->os_next = slab->os_next;
+	}
+	else {
+		KASSERT(oc->oc_slabs == slab);
+		oc->oc_slabs = slab->os_next;
+	}
+	if (slab->os_next != NULL) {
+		slab->os_next->os_prev = slab->os_prev;
+	}
+	slab->os_next = slab->os_prev = NULL;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Interface
+
+struct objcache *
+objcache_create(const char *name, size_t size, size_t align,
+		int (*ctor)(void *obj), void (*dtor)(void *obj))
+{
+	struct objcache *oc;
+
+	if (align == 0) {
+		align = OBJCACHE_ALIGN;
+	}
+	KASSERT((align & (align - 1)) == 0);
+	KASSERT(size > 0);
+
+	oc = kmalloc(sizeof(*oc));
+	if (oc == NULL) {
+		return NULL;
+	}
+	oc->oc_name = name;
+	oc->oc_linkoff = ROUNDUP(size, sizeof(void *));
+	oc->oc_stride = ROUNDUP(oc->oc_linkoff + sizeof(void *), align);
+	oc->oc_first = ROUNDUP(sizeof(struct ocslab), align);
+	if (oc->oc_first + oc->oc_stride > PAGE_SIZE) {
+		panic("objcache_create: %s: %zu-byte objects don't fit "
+		      "in a page\n", name, size);
+	}
+	oc->oc_perslab = (PAGE_SIZE - oc->oc_first) / oc->oc_stride;
+	oc->oc_ctor = ctor;
+	oc->oc_dtor = dtor;
+
+	spinlock_init(&oc->oc_lock);
+	oc->oc_slabs = NULL;
+	oc->oc_nslabs = 0;
+	oc->oc_nemptyslabs = 0;
+
+	return oc;
+}
+
+void
+objcache_destroy(struct objcache *oc)
+{
+	struct ocslab *slab;
+
+	/* Everything has been freed, so every slab is on the list. */
+	while ((slab = oc->oc_slabs) != NULL) {
+		objcache_unlink(oc, slab);
+		KASSERT(oc->oc_nemptyslabs > 0);
+		oc->oc_nemptyslabs--;
+		oc->oc_nslabs--;
+		objcache_destroyslab(oc, slab);
+	}
+	if (oc->oc_nslabs != 0) {
+		panic("objcache_destroy: %s: objects still in use\n",
+		      oc->oc_name);
+	}
+
+	spinlock_cleanup(&oc->oc_lock);
+	kfree(oc);
+}
+
+void *
+objcache_alloc(struct objcache *oc)
+{
+	struct ocslab *slab;
+	void *obj;
+
+	spinlock_acquire(&oc->oc_lock);
+
+	while (oc->oc_slabs == NULL) {
+		spinlock_release(&oc->oc_lock);
+		slab = objcache_newslab(oc);
+		if (slab == NULL) {
+			return NULL;
+		}
+		spinlock_acquire(&oc->oc_lock);
+		/* Someone else may have made one too; that's harmless. */
+		objcache_link(oc, slab);
+		oc->oc_nslabs++;
+		oc->oc_nemptyslabs++;
+	}
+
+	slab = oc->oc_slabs;
+	KASSERT(slab->os_nfree > 0);
+	if (slab->os_nfree == oc->oc_perslab) {
+		oc->oc_nemptyslabs--;
+	}
+	obj = slab->os_free;
+	slab->os_free = OBJ_LINK(oc, obj);
+	slab->os_nfree--;
+	if (slab->os_nfree == 0) {
+		objcache_unlink(oc, slab);
+	}
+
+	spinlock_release(&oc->oc_lock);
+	return obj;
+}
+
+void
+objcache_free(struct objcache *oc, void *obj)
+{
+	struct ocslab *slab, *victim;
+
+	slab = (struct ocslab *)((vaddr_t)obj & PAGE_FRAME);
+	KASSERT(slab->os_cache == oc);
+	KASSERT(((vaddr_t)obj - (vaddr_t)slab - oc->oc_first) % oc->oc_stride
+		== 0);
+
+	victim = NULL;
+	spinlock_acquire(&oc->oc_lock);
+
+	OBJ_LINK(oc, obj) = slab->os_free;
+	slab->os_free = obj;
+	slab->os_nfree++;
+	if (slab->os_nfree == 1) {
+		objcache_link(oc, slab);
+	}
+	if (slab->os_nfree == oc->oc_perslab) {
+		if (oc->oc_nemptyslabs < OBJCACHE_KEEPSLABS) {
+			oc->oc_nemptyslabs++;
+		}
+		else {
+			objcache_unlink(oc, slab);
+			oc->oc_nslabs--;
+			victim = slab;
+		}
+	}
+
+	spinlock_release(&oc->oc_lock);
+
+	if (victim != NULL) {
+		objcache_destroyslab(oc, victim);
+	}
+}
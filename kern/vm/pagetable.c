@@ -0,0 +1,59 @@
+/*
+ * Two-level page tables for user address spaces.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <pagetable.h>
+
+struct pagetable *
+pt_create(void)
+{
+	struct pagetable *pt;
+	unsigned i;
+
+	pt = kmalloc(sizeof(*pt));
+	if (pt == NULL) {
+		return NULL;
+	}
+	for (i=0; i<PT_NENTRIES; i++) {
+		pt->pt_l2[i] = NULL;
+	}
+	return pt;
+}
+
+void
+pt_destroy(struct pagetable *pt)
+{
+	unsigned i;
+
+	for (i=0; i<PT_NENTRIES; i++) {
+		if (pt->pt_l2[i] != NULL) {
+			kfree(pt->pt_l2[i]);
+		}
+	}
+	kfree(pt);
+}
+
+uint32_t *
+pt_lookup(struct pagetable *pt, vaddr_t vaddr, bool create)
+{
+	uint32_t *l2;
+	unsigned i;
+
+	l2 = pt->pt_l2[PT_L1_INDEX(vaddr)];
+	if (l2 == NULL) {
+		if (!create) {
+			return NULL;
+		}
+		l2 = kmalloc(PT_NENTRIES * sizeof(uint32_t));
+		if (l2 == NULL) {
+			return NULL;
+		}
+		for (i=0; i<PT_NENTRIES; i++) {
+			l2[i] = 0;
+		}
+		pt->pt_l2[PT_L1_INDEX(vaddr)] = l2;
+	}
+	return &l2[PT_L2_INDEX(vaddr)];
+}
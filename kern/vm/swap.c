@@ -0,0 +1,139 @@
+/*
+ * Swap space on a raw disk device.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <bitmap.h>
+#include <uio.h>
+#include <vnode.h>
+#include <vfs.h>
+#include <vm.h>
+#include <swap.h>
+
+/*
+ * The device and the map of used slots. The bitmap is protected by
+ * swap_lock; the vnode is set once at boot and the device does its
+ * own locking for I/O.
+ */
+static struct spinlock swap_lock = SPINLOCK_INITIALIZER;
+static struct vnode *swap_vnode;
+static struct bitmap *swap_map;
+static unsigned swap_nslots;
+
+void
+swap_bootstrap(void)
+{
+	char path[sizeof(SWAP_DEVICE)];
+	struct stat st;
+	int result;
+
+	spinlock_register(&swap_lock, "swap");
+
+	strcpy(path, SWAP_DEVICE);
+	result = vfs_open(path, O_RDWR, 0, &swap_vnode);
+	if (result) {
+		kprintf("swap: %s: %s; running without swap\n",
+			SWAP_DEVICE, strerror(result));
+		swap_vnode = NULL;
+		return;
+	}
+
+	result = VOP_STAT(swap_vnode, &st);
+	if (result) {
+		panic("swap: %s: stat: %s\n", SWAP_DEVICE, strerror(result));
+	}
+
+	swap_nslots = st.st_size / PAGE_SIZE;
+	if (swap_nslots == 0) {
+		kprintf("swap: %s is too small; running without swap\n",
+			SWAP_DEVICE);
+		vfs_close(swap_vnode);
+		swap_vnode = NULL;
+		return;
+	}
+
+	swap_map = bitmap_create(swap_nslots);
+	if (swap_map == NULL) {
+		panic("swap: Out of memory creating slot map\n");
+	}
+
+	kprintf("swap: %s, %u pages\n", SWAP_DEVICE, swap_nslots);
+}
+
+int
+swap_alloc(unsigned *slot)
+{
+	int result;
+
+	if (swap_vnode == NULL) {
+		return ENOSPC;
+	}
+
+	spinlock_acquire(&swap_lock);
+	result = bitmap_alloc(swap_map, slot);
+	spinlock_release(&swap_lock);
+
+	return result;
+}
+
+void
+swap_free(unsigned slot)
+{
+	KASSERT(swap_vnode != NULL);
+	KASSERT(slot < swap_nslots);
+
+	spinlock_acquire(&swap_lock);
+	KASSERT(bitmap_isset(swap_map, slot));
+	bitmap_unmark(swap_map, slot);
+	spinlock_release(&swap_lock);
+}
+
+/*
+ * Do one page of I/O between PADDR and SLOT.
+ */
+static
+int
+swap_io(paddr_t paddr, unsigned slot, enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio ku;
+	int result;
+
+	KASSERT(swap_vnode != NULL);
+	KASSERT(slot < swap_nslots);
+	KASSERT(paddr % PAGE_SIZE == 0);
+
+	uio_kinit(&iov, &ku, (void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE,
+		  (off_t)slot * PAGE_SIZE, rw);
+	if (rw == UIO_READ) {
+		result = VOP_READ(swap_vnode, &ku);
+	}
+	else {
+		result = VOP_WRITE(swap_vnode, &ku);
+	}
+	if (result) {
+		return result;
+	}
+	if (ku.uio_resid != 0) {
+		/* Short transfer; shouldn't happen on a disk. */
+		return EIO;
+	}
+	return 0;
+}
+
+int
+swap_pagein(paddr_t paddr, unsigned slot)
+{
+	return swap_io(paddr, slot, UIO_READ);
+}
+
+int
+swap_pageout(paddr_t paddr, unsigned slot)
+{
+	return swap_io(paddr, slot, UIO_WRITE);
+}
@@ -148,6 +148,9 @@ int dup2(int filehandle, int newhandle);
 int pipe(int filehandles[2]);
 int __time(time_t *seconds, unsigned long *nanoseconds);
 ssize_t __getcwd(char *buf, size_t buflen);
+int futex_wait(volatile int *addr, int val);	/* see also usynch.h */
+int futex_wake(volatile int *addr, int count);
+int setaffinity(unsigned cpumask);
 /* stat - see sys/stat.h */
 /* lstat - see sys/stat.h */
 
@@ -0,0 +1,54 @@
+#ifndef _USYNCH_H_
+#define _USYNCH_H_
+
+/*
+ * User-level mutexes and semaphores.
+ *
+ * These live entirely in user memory and take and release without
+ * entering the kernel as long as nobody has to wait; only then do
+ * they use the futex_wait and futex_wake system calls. (Compare the
+ * semfs semaphores, "sem:", where every P and V is a read or write
+ * system call.)
+ *
+ * They work between threads or processes that share the memory they
+ * are in. Note that nothing can share memory in this system yet:
+ * there are no user-level threads, and fork gives the child its own
+ * copy (futex_wait makes sure of that for the futex's page). So for
+ * now only the uncontended cases are useful. Anything that has to
+ * wait - umutex_lock on a held mutex, usemaphore_P at 0 - sleeps in
+ * futex_wait with nobody able to wake it, and never returns.
+ *
+ * The structures are public so they can be declared statically; use
+ * the functions rather than looking inside.
+ *
+ *     umutex_lock       - take the mutex, waiting if necessary.
+ *     umutex_trylock    - take the mutex if free; returns 1 if it was
+ *                         taken, 0 if not.
+ *     umutex_unlock     - release the mutex.
+ *     usemaphore_P      - decrement the count, waiting while it is 0.
+ *     usemaphore_V      - increment the count.
+ */
+
+struct umutex {
+	volatile int um_state;		/* 0 free, 1 held, 2 held+waiters */
+};
+
+#define UMUTEX_INITIALIZER { 0 }
+
+struct usemaphore {
+	volatile int us_count;
+	volatile int us_waiters;	/* threads in or near futex_wait */
+};
+
+#define USEMAPHORE_INITIALIZER(count) { (count), 0 }
+
+void umutex_init(struct umutex *m);
+void umutex_lock(struct umutex *m);
+int umutex_trylock(struct umutex *m);
+void umutex_unlock(struct umutex *m);
+
+void usemaphore_init(struct usemaphore *s, unsigned count);
+void usemaphore_P(struct usemaphore *s);
+void usemaphore_V(struct usemaphore *s);
+
+#endif /* _USYNCH_H_ */
@@ -34,6 +34,10 @@
  * easy to follow. It performs abysmally if the heap becomes larger than
  * physical memory. To get (much) better out-of-core performance, port
  * the kernel's malloc. :-)
+ *
+ * When the block at the top of the heap is freed and it covers at
+ * least MTRIMPAGES whole pages, the pages are given back to the
+ * system with a negative sbrk.
  */
 
 #include <stdlib.h>
@@ -147,6 +151,13 @@ static size_t __malloc_pagesize;
 #define PAGE_SIZE 4096
 #endif
 
+/*
+ * Smallest amount of free space at the top of the heap, in pages,
+ * worth returning to the system. (Returning less just means sbrk'ing
+ * it right back on the next malloc.)
+ */
+#define MTRIMPAGES 4
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -527,6 +538,49 @@ __malloc_trymerge(struct mheader *mh, struct mheader *mhnext)
 	__malloc_deadbeef(mhnext, sizeof(struct mheader));
 }
 
+/*
+ * If MH is a free block at the top of the heap, shrink the heap,
+ * leaving MH (if it doesn't start on a page boundary) with as little
+ * space as it can have.
+ */
+static
+void
+__malloc_trim(struct mheader *mh)
+{
+	uintptr_t base, newtop;
+
+	if (mh->mh_inuse || M_NEXT(mh) != (struct mheader *)__heaptop) {
+		return;
+	}
+
+	base = (uintptr_t)mh;
+	if (base % PAGE_SIZE == 0) {
+		/* The whole block can go. */
+		newtop = base;
+	}
+	else {
+		newtop = base + 2*MBLOCKSIZE;
+		newtop = PAGE_SIZE * ((newtop + PAGE_SIZE - 1) / PAGE_SIZE);
+	}
+
+	if (newtop >= __heaptop || __heaptop - newtop < MTRIMPAGES*PAGE_SIZE) {
+		return;
+	}
+
+	if (sbrk(-(intptr_t)(__heaptop - newtop)) == (void *)-1) {
+		/* Not fatal; we just keep the memory. */
+		return;
+	}
+	__heaptop = newtop;
+	if (newtop != base) {
+		mh->mh_nextblock = M_MKFIELD(newtop - base);
+	}
+
+#ifdef MALLOCDEBUG
+	warnx("free: trimmed heap top to 0x%lx", (unsigned long) newtop);
+#endif
+}
+
 /*
  * The actual free() implementation.
  */
@@ -582,8 +636,15 @@ free(void *x)
 	if (mh != (struct mheader *)__heapbase) {
 		mhprev = M_PREV(mh);
 		__malloc_trymerge(mhprev, mh);
+		if (!mhprev->mh_inuse) {
+			/* merged; mh is gone */
+			mh = mhprev;
+		}
 	}
 
+	/* Give back memory at the top of the heap */
+	__malloc_trim(mh);
+
 #ifdef MALLOCDEBUG
 	warnx("free: freed %p", x);
 	__malloc_dump();
@@ -0,0 +1,168 @@
+/*
+ * User-level mutexes and semaphores (see usynch.h).
+ *
+ * The mutex is the usual three-state futex mutex: 0 is free, 1 is
+ * held with nobody waiting, and 2 is held with (maybe) someone
+ * waiting. Only unlocking from state 2 calls futex_wake, and a locker
+ * that finds the mutex held sets state 2 before sleeping on it.
+ *
+ * The semaphore keeps its count and a count of would-be sleepers. P
+ * sleeps on the count only while it is 0; if a V slips in between,
+ * futex_wait sees the new count and returns at once.
+ */
+
+#include <unistd.h>
+#include <usynch.h>
+
+/*
+ * Atomic operations, using LL/SC. Each returns the value the word had
+ * before.
+ */
+
+static
+int
+atomic_cas(volatile int *p, int oldval, int newval)
+{
+	int x, y;
+
+	/*
+	 * Y is the SC result, or 1 if *P didn't match so that we
+	 * stop trying.
+	 */
+	do {
+		__asm volatile(
+			".set push;"		/* save assembler mode */
+			".set mips32;"		/* allow MIPS32 instructions */
+			".set volatile;"	/* avoid unwanted optimization */
+			".set noreorder;"	/* we fill the delay slot */
+			"ll %0, 0(%2);"		/*   x = *p */
+			"bne %0, %3, 1f;"	/*   give up if x != oldval */
+			" li %1, 1;"		/*   (delay slot) y = 1 */
+			"move %1, %4;"		/*   y = newval */
+			"sc %1, 0(%2);"		/*   *p = y; y = success? */
+			"1:"
+			".set pop"		/* restore assembler mode */
+			: "=&r" (x), "=&r" (y)
+			: "r" (p), "r" (oldval), "r" (newval)
+			: "memory");
+	} while (y == 0);
+	return x;
+}
+
+static
+int
+atomic_swap(volatile int *p, int newval)
+{
+	int x, y;
+
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 instructions */
+		".set volatile;"	/* avoid unwanted optimization */
+		"1: ll %0, 0(%2);"	/*   x = *p */
+		"move %1, %3;"		/*   y = newval */
+		"sc %1, 0(%2);"		/*   *p = y; y = success? */
+		"beqz %1, 1b;"		/*   try again if it failed */
+		".set pop"		/* restore assembler mode */
+		: "=&r" (x), "=&r" (y) : "r" (p), "r" (newval) : "memory");
+	return x;
+}
+
+static
+int
+atomic_add(volatile int *p, int delta)
+{
+	int x, y;
+
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 instructions */
+		".set volatile;"	/* avoid unwanted optimization */
+		"1: ll %0, 0(%2);"	/*   x = *p */
+		"addu %1, %0, %3;"	/*   y = x + delta */
+		"sc %1, 0(%2);"		/*   *p = y; y = success? */
+		"beqz %1, 1b;"		/*   try again if it failed */
+		".set pop"		/* restore assembler mode */
+		: "=&r" (x), "=&r" (y) : "r" (p), "r" (delta) : "memory");
+	return x;
+}
+
+////////////////////////////////////////////////////////////
+// mutex
+
+void
+umutex_init(struct umutex *m)
+{
+	m->um_state = 0;
+}
+
+void
+umutex_lock(struct umutex *m)
+{
+	int c;
+
+	c = atomic_cas(&m->um_state, 0, 1);
+	if (c == 0) {
+		return;
+	}
+	if (c != 2) {
+		c = atomic_swap(&m->um_state, 2);
+	}
+	while (c != 0) {
+		/* Returns at once if it's no longer 2; that's fine. */
+		futex_wait(&m->um_state, 2);
+		c = atomic_swap(&m->um_state, 2);
+	}
+}
+
+int
+umutex_trylock(struct umutex *m)
+{
+	return atomic_cas(&m->um_state, 0, 1) == 0;
+}
+
+void
+umutex_unlock(struct umutex *m)
+{
+	if (atomic_swap(&m->um_state, 0) == 2) {
+		futex_wake(&m->um_state, 1);
+	}
+}
+
+////////////////////////////////////////////////////////////
+// semaphore
+
+void
+usemaphore_init(struct usemaphore *s, unsigned count)
+{
+	s->us_count = count;
+	s->us_waiters = 0;
+}
+
+void
+usemaphore_P(struct usemaphore *s)
+{
+	int c;
+
+	while (1) {
+		c = s->us_count;
+		if (c > 0) {
+			if (atomic_cas(&s->us_count, c, c - 1) == c) {
+				return;
+			}
+			continue;
+		}
+		atomic_add(&s->us_waiters, 1);
+		futex_wait(&s->us_count, 0);
+		atomic_add(&s->us_waiters, -1);
+	}
+}
+
+void
+usemaphore_V(struct usemaphore *s)
+{
+	atomic_add(&s->us_count, 1);
+	if (s->us_waiters > 0) {
+		futex_wake(&s->us_count, 1);
+	}
+}
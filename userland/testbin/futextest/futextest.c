@@ -0,0 +1,138 @@
+/*
+ * futextest - check the futex system calls and the usynch.h mutexes
+ * and semaphores built on them, and compare the cost of an
+ * uncontended semaphore P/V pair with the semfs ("sem:") one.
+ *
+ * Everything here runs in one process, so only the paths that don't
+ * actually sleep are exercised.
+ */
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <err.h>
+#include <usynch.h>
+
+#define LOOPS 2000
+#define SEMNAME "sem:futextest"
+
+static volatile int word;
+static struct umutex mutex = UMUTEX_INITIALIZER;
+static struct usemaphore sem = USEMAPHORE_INITIALIZER(0);
+
+static
+unsigned long
+now_usecs(void)
+{
+	time_t secs;
+	unsigned long nsecs;
+
+	if (__time(&secs, &nsecs) < 0) {
+		err(1, "__time");
+	}
+	return (unsigned long)secs * 1000000 + nsecs / 1000;
+}
+
+static
+void
+test_syscalls(void)
+{
+	int r;
+
+	word = 5;
+	r = futex_wait(&word, 4);
+	if (r != -1 || errno != EAGAIN) {
+		errx(1, "futex_wait on a changed value: got %d (%s)",
+		     r, r < 0 ? strerror(errno) : "no error");
+	}
+
+	r = futex_wake(&word, 1);
+	if (r != 0) {
+		errx(1, "futex_wake with no waiters woke %d", r);
+	}
+
+	r = futex_wait((volatile int *)((char *)&word + 1), 5);
+	if (r != -1 || errno != EINVAL) {
+		errx(1, "futex_wait on a misaligned address: got %d", r);
+	}
+
+	r = futex_wake((volatile int *)0x80000000, 1);
+	if (r != -1 || errno != EFAULT) {
+		errx(1, "futex_wake on a kernel address: got %d", r);
+	}
+
+	printf("futex system calls: ok\n");
+}
+
+static
+void
+test_mutex(void)
+{
+	unsigned i;
+
+	for (i=0; i<LOOPS; i++) {
+		umutex_lock(&mutex);
+		if (umutex_trylock(&mutex)) {
+			errx(1, "umutex_trylock got a held mutex");
+		}
+		umutex_unlock(&mutex);
+	}
+	if (!umutex_trylock(&mutex)) {
+		errx(1, "umutex_trylock failed on a free mutex");
+	}
+	umutex_unlock(&mutex);
+
+	printf("umutex: ok\n");
+}
+
+static
+void
+time_semaphores(void)
+{
+	unsigned long start, ufast, uslow;
+	unsigned i;
+	int fd;
+	char c = 0;
+
+	start = now_usecs();
+	for (i=0; i<LOOPS; i++) {
+		usemaphore_V(&sem);
+		usemaphore_P(&sem);
+	}
+	ufast = now_usecs() - start;
+	if (sem.us_count != 0) {
+		errx(1, "usemaphore: count is %d, should be 0", sem.us_count);
+	}
+	printf("usemaphore: %u V/P pairs in %lu us\n", LOOPS, ufast);
+
+	fd = open(SEMNAME, O_RDWR|O_CREAT|O_TRUNC, 0664);
+	if (fd < 0) {
+		warn("%s: skipping semfs comparison", SEMNAME);
+		return;
+	}
+	start = now_usecs();
+	for (i=0; i<LOOPS; i++) {
+		if (write(fd, &c, 1) != 1) {
+			err(1, "%s: write", SEMNAME);
+		}
+		if (read(fd, &c, 1) != 1) {
+			err(1, "%s: read", SEMNAME);
+		}
+	}
+	uslow = now_usecs() - start;
+	close(fd);
+	remove(SEMNAME);
+	printf("semfs:      %u V/P pairs in %lu us\n", LOOPS, uslow);
+}
+
+int
+main(void)
+{
+	test_syscalls();
+	test_mutex();
+	time_semaphores();
+	printf("futextest done.\n");
+	return 0;
+}